@@ -0,0 +1,426 @@
+/* bench.c - Kernel microbenchmarks */
+
+#include "../include/kernel.h"
+#include "../include/process.h"
+#include "../include/memory.h"
+#include "../include/interrupts.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+extern uint64_t get_cycles(void);
+extern uint64_t getticks(void);
+extern void membench(void);
+extern sid32 semcreate(int32_t count);
+extern syscall semdelete(sid32 sem);
+extern syscall sched_getstats(uint64_t *ctxsw, uint64_t *preemptions,
+                              uint64_t *rescheds);
+extern syscall mailbox_create(pid32 pid);
+extern syscall mailbox_delete(pid32 pid);
+extern syscall mailbox_send(pid32 pid, umsg32 msg);
+extern umsg32 mailbox_recv(void);
+extern int32_t port_create(const char *name);
+extern syscall port_delete(int32_t portid);
+extern syscall port_send(int32_t portid, umsg32 msg);
+extern umsg32 port_recv(int32_t portid);
+extern int32_t timer_create(void (*callback)(void *), void *arg,
+                            uint32_t delay, uint32_t period);
+extern syscall timer_start(int32_t tid, uint32_t delay);
+extern syscall timer_stop(int32_t tid);
+extern syscall timer_delete(int32_t tid);
+
+#define CLKFREQ         1000            /* Must match clock.c */
+
+/*
+ * Each benchmark prints one line:
+ * 
+ *   bench <name> iters=<n> cycles=<total> cyc/op=<n> ticks=<n> ops/s=<n>
+ * 
+ * Fields are space separated, always present and always in this order,
+ * so results can be collected with a line-oriented parser and compared
+ * across builds. ops/s is 0 when the run was too short to span a tick.
+ * Partner processes run at the benchmark's own priority, so a
+ * ping-pong measures a blocking handoff rather than a preemption.
+ */
+#define BENCH_PRIO      20
+#define BENCH_STK       4096
+#define BENCH_ITERS     1000
+#define BENCH_NTIMERS   64
+#define BENCH_BATCH     8               /* Live blocks per getmem round */
+#define BENCH_STOP      0xFFFFFFFF
+
+static pid32 bench_pid;
+static sid32 bench_sem[2];
+static int32_t bench_port;
+static volatile bool yield_stop;
+static volatile uint32_t timer_fired;
+static volatile uint64_t timer_first, timer_last;
+
+/* Print one result line */
+static void bench_report(const char *name, uint32_t iters, uint64_t cycles,
+                         uint64_t ticks) {
+    uint64_t persec = 0;
+    
+    if (ticks > 0) {
+        persec = (uint64_t)iters * CLKFREQ / ticks;
+    }
+    
+    kprintf("bench %s iters=%lu cycles=%llu cyc/op=%llu ticks=%llu ops/s=%llu\n",
+            name, iters, cycles, cycles / (iters ? iters : 1), ticks, persec);
+}
+
+/* Start a partner process at the benchmark's priority */
+static pid32 bench_spawn(void *fn, char *name) {
+    pid32 pid = create(fn, BENCH_STK, BENCH_PRIO, name, 0);
+    
+    if (pid == SYSERR) {
+        kprintf("bench %s: create failed\n", name);
+    }
+    return pid;
+}
+
+/*------------------------------------------------------------------------
+ * IPC
+ *------------------------------------------------------------------------*/
+
+static void bench_echo(void) {
+    umsg32 msg;
+    
+    while ((msg = receive()) != BENCH_STOP) {
+        send(bench_pid, msg);
+    }
+}
+
+/* send/receive round trip: two context switches per iteration */
+static void bench_ctxsw(void) {
+    pid32 pid;
+    uint64_t c0, t0;
+    uint32_t i;
+    
+    if ((pid = bench_spawn(bench_echo, "bench_echo")) == SYSERR) {
+        return;
+    }
+    resume(pid);
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        send(pid, i);
+        receive();
+    }
+    bench_report("ctxsw_pingpong", BENCH_ITERS, get_cycles() - c0,
+                 getticks() - t0);
+    
+    send(pid, BENCH_STOP);
+}
+
+static void bench_sem_partner(void) {
+    uint32_t i;
+    
+    for (i = 0; i < BENCH_ITERS; i++) {
+        wait(bench_sem[0]);
+        signal(bench_sem[1]);
+    }
+}
+
+/* Semaphore handoff in both directions */
+static void bench_semaphore(void) {
+    pid32 pid;
+    uint64_t c0, t0;
+    uint32_t i;
+    
+    bench_sem[0] = semcreate(0);
+    bench_sem[1] = semcreate(0);
+    if ((pid = bench_spawn(bench_sem_partner, "bench_sem")) == SYSERR) {
+        semdelete(bench_sem[0]);
+        semdelete(bench_sem[1]);
+        return;
+    }
+    resume(pid);
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        signal(bench_sem[0]);
+        wait(bench_sem[1]);
+    }
+    bench_report("sem_pingpong", BENCH_ITERS, get_cycles() - c0,
+                 getticks() - t0);
+    
+    semdelete(bench_sem[0]);
+    semdelete(bench_sem[1]);
+}
+
+static void bench_mbox_sink(void) {
+    uint32_t i;
+    
+    for (i = 0; i < BENCH_ITERS; i++) {
+        mailbox_recv();
+    }
+    signal(bench_sem[0]);
+}
+
+/* One-way mailbox stream; the sender blocks only when the box fills */
+static void bench_mailbox(void) {
+    pid32 pid;
+    uint64_t c0, t0;
+    uint32_t i;
+    
+    bench_sem[0] = semcreate(0);
+    if ((pid = bench_spawn(bench_mbox_sink, "bench_mbox")) == SYSERR) {
+        semdelete(bench_sem[0]);
+        return;
+    }
+    if (mailbox_create(pid) == SYSERR) {
+        kprintf("bench mailbox: mailbox_create failed\n");
+        kill(pid);
+        semdelete(bench_sem[0]);
+        return;
+    }
+    resume(pid);
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        mailbox_send(pid, i);
+    }
+    wait(bench_sem[0]);
+    bench_report("mailbox_stream", BENCH_ITERS, get_cycles() - c0,
+                 getticks() - t0);
+    
+    semdelete(bench_sem[0]);
+}
+
+static void bench_port_sink(void) {
+    uint32_t i;
+    
+    for (i = 0; i < BENCH_ITERS; i++) {
+        port_recv(bench_port);
+    }
+    signal(bench_sem[0]);
+}
+
+/* One-way port stream */
+static void bench_ports(void) {
+    pid32 pid;
+    uint64_t c0, t0;
+    uint32_t i;
+    
+    if ((bench_port = port_create("bench")) == SYSERR) {
+        kprintf("bench port: port_create failed\n");
+        return;
+    }
+    bench_sem[0] = semcreate(0);
+    if ((pid = bench_spawn(bench_port_sink, "bench_port")) == SYSERR) {
+        semdelete(bench_sem[0]);
+        port_delete(bench_port);
+        return;
+    }
+    resume(pid);
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        port_send(bench_port, i);
+    }
+    wait(bench_sem[0]);
+    bench_report("port_stream", BENCH_ITERS, get_cycles() - c0,
+                 getticks() - t0);
+    
+    semdelete(bench_sem[0]);
+    port_delete(bench_port);
+}
+
+/*------------------------------------------------------------------------
+ * Scheduler
+ *------------------------------------------------------------------------*/
+
+static void bench_yield_partner(void) {
+    while (!yield_stop) {
+        yield();
+    }
+}
+
+/*
+ * yield() between two ready processes at one priority: each iteration
+ * is a resched() that dequeues, requeues and switches, with no IPC or
+ * wait queue work, so it isolates the ready queue path.
+ */
+static void bench_yield(void) {
+    pid32 pid;
+    uint64_t c0, t0;
+    uint32_t i;
+    
+    yield_stop = false;
+    if ((pid = bench_spawn(bench_yield_partner, "bench_yield")) == SYSERR) {
+        return;
+    }
+    resume(pid);
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        yield();
+    }
+    bench_report("resched_yield", BENCH_ITERS, get_cycles() - c0,
+                 getticks() - t0);
+    
+    yield_stop = true;
+    yield();
+}
+
+/*------------------------------------------------------------------------
+ * Allocation
+ *------------------------------------------------------------------------*/
+
+/* getmem/freemem in rounds of BENCH_BATCH live blocks, sizes in [lo, hi] */
+static void bench_getmem(const char *name, uint32_t lo, uint32_t hi) {
+    void *blk[BENCH_BATCH];
+    uint32_t len[BENCH_BATCH];
+    uint32_t seed = 12345;
+    uint64_t c0, t0;
+    uint32_t i, j, ops = 0;
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS / BENCH_BATCH; i++) {
+        for (j = 0; j < BENCH_BATCH; j++) {
+            seed = seed * 1103515245 + 12345;     /* Same sequence each run */
+            len[j] = lo + (seed >> 16) % (hi - lo + 1);
+            blk[j] = getmem(len[j]);
+        }
+        for (j = 0; j < BENCH_BATCH; j++) {
+            if (blk[j] != (void *)SYSERR) {
+                freemem(blk[j], len[j]);
+                ops += 2;
+            }
+        }
+    }
+    bench_report(name, ops, get_cycles() - c0, getticks() - t0);
+}
+
+static void bench_nop(void) {
+}
+
+/* Process creation and teardown, never scheduled */
+static void bench_create(void) {
+    pid32 pid;
+    uint64_t c0, t0;
+    uint32_t i, n = 0;
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        pid = create(bench_nop, BENCH_STK, BENCH_PRIO, "bench_nop", 0);
+        if (pid != SYSERR) {
+            kill(pid);
+            n++;
+        }
+    }
+    bench_report("create_kill", n, get_cycles() - c0, getticks() - t0);
+}
+
+/*------------------------------------------------------------------------
+ * Timers
+ *------------------------------------------------------------------------*/
+
+static void bench_timer_cb(void *arg) {
+    uint64_t now = get_cycles();
+    
+    (void)arg;
+    if (timer_fired++ == 0) {
+        timer_first = now;
+    }
+    timer_last = now;
+}
+
+/*
+ * Insert cost is a stop/start pair on armed timers, which excludes the
+ * getmem() in timer_create(). Expiry cost is the spread between the
+ * first and last callback of a batch that all fire on the same tick.
+ */
+static void bench_timers(void) {
+    int32_t tid[BENCH_NTIMERS];
+    uint64_t c0, t0;
+    uint32_t i, n = 0, round;
+    
+    for (i = 0; i < BENCH_NTIMERS; i++) {
+        tid[i] = timer_create(bench_timer_cb, NULL, 10 * CLKFREQ, 0);
+        if (tid[i] == SYSERR) {
+            break;
+        }
+        n++;
+    }
+    if (n == 0) {
+        kprintf("bench timer: timer_create failed\n");
+        return;
+    }
+    
+    t0 = getticks();
+    c0 = get_cycles();
+    for (round = 0; round < BENCH_ITERS / BENCH_NTIMERS; round++) {
+        for (i = 0; i < n; i++) {
+            timer_stop(tid[i]);
+            timer_start(tid[i], 10 * CLKFREQ + i);
+        }
+    }
+    bench_report("timer_insert", round * n, get_cycles() - c0,
+                 getticks() - t0);
+    
+    /* Rearm everything for the same tick and let it fire */
+    timer_fired = 0;
+    for (i = 0; i < n; i++) {
+        timer_start(tid[i], 2);
+    }
+    t0 = getticks();
+    while (timer_fired < n && getticks() - t0 < CLKFREQ) {
+        sleepms(1);
+    }
+    bench_report("timer_expire", timer_fired, timer_last - timer_first,
+                 getticks() - t0);
+    
+    for (i = 0; i < n; i++) {
+        timer_delete(tid[i]);
+    }
+}
+
+/*------------------------------------------------------------------------
+ * Driver
+ *------------------------------------------------------------------------*/
+
+/**
+ * kbench - Run the kernel microbenchmark suite
+ * 
+ * Must be called from a process, since the IPC benchmarks block.
+ */
+void kbench(void) {
+    uint64_t ctxsw0, preempt0, resched0;
+    uint64_t ctxsw1, preempt1, resched1;
+    
+    bench_pid = getpid();
+    sched_getstats(&ctxsw0, &preempt0, &resched0);
+    
+    kprintf("bench begin\n");
+    bench_ctxsw();
+    bench_semaphore();
+    bench_mailbox();
+    bench_ports();
+    bench_yield();
+    bench_getmem("getmem_small", 16, 64);
+    bench_getmem("getmem_mixed", 16, 512);
+    bench_getmem("getmem_large", 1024, 4096);
+    bench_create();
+    bench_timers();
+    
+    sched_getstats(&ctxsw1, &preempt1, &resched1);
+    kprintf("bench sched ctxsw=%llu preemptions=%llu rescheds=%llu\n",
+            ctxsw1 - ctxsw0, preempt1 - preempt0, resched1 - resched0);
+    kprintf("bench end\n");
+    
+    membench();
+}
+
+/* Process body for running the suite at boot */
+void bench_process(void) {
+    kbench();
+}
@@ -2,6 +2,7 @@
 
 #include "../include/kernel.h"
 #include "../include/process.h"
+#include "../include/memory.h"
 #include "../include/interrupts.h"
 
 #include <string.h>
@@ -11,30 +12,101 @@
 #define CLKTICKS_PER_SEC CLKFREQ
 #define MS_PER_TICK     (1000/CLKFREQ)
 
-#define NTIMERS         32
-
 #define TMR_FREE        0
 #define TMR_ACTIVE      1
 #define TMR_EXPIRED     2
 #define TMR_STOPPED     3
 
+#define TMR_MAGIC       0x544D5231      /* "TMR1" - marks a live timer */
+
 #define MAXSLEEPTIME    0x7FFFFFFF
 
+/*
+ * Hierarchical timer wheel: TW_LEVELS levels of TW_SIZE slots each.
+ * Level 0 holds timers due within TW_SIZE ticks; each higher level
+ * covers TW_SIZE times the span of the one below and is cascaded down
+ * when the level below wraps. Insert and cancel are O(1) list
+ * operations and each tick only touches the current level-0 slot.
+ */
+#define TW_BITS         6
+#define TW_SIZE         (1 << TW_BITS)
+#define TW_MASK         (TW_SIZE - 1)
+#define TW_LEVELS       4
+#define TW_MAXDELTA     ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
 /*Clock Data Structures*/
 
 typedef void (*timer_callback_t)(void *arg);
 
-/* Timer structure */
+/* Timer node (allocated from the heap, or embedded for sleepers) */
 typedef struct timer {
+    struct timer *tnext;        /* Next node in wheel slot */
+    struct timer *tprev;        /* Previous node in wheel slot */
+    struct timer **tslot;       /* Slot head this node is linked on */
+    uint32_t    magic;          /* TMR_MAGIC while allocated */
     uint8_t     state; 
-    uint32_t    expires; 
+    uint64_t    expires; 
     uint32_t    period;
     timer_callback_t callback;  /* Callback function */
     void        *arg;           /* Callback argument */
+    pid32       pid;            /* Sleeping process, or -1 */
+    void        (*expire)(pid32);   /* Deadline expiry hook, or NULL */
 } timer_t;
 
-/* Timer table */
-static timer_t timertab[NTIMERS];
+/* Timer wheel slots */
+static timer_t *tw_wheel[TW_LEVELS][TW_SIZE];
+
+/* Next tick the wheel will process */
+static uint64_t tw_now = 1;
+
+/* Per-process sleep timers (no allocation on the sleep path) */
+static timer_t sleeptab[NPROC];
+
+/*
+ * With SLEEPQ_HEAP, sleep and deadline timers leave the wheel for a
+ * binary min-heap of PIDs keyed on absolute expiry tick. Insert and
+ * cancel are O(log n) and the next wakeup is the heap top, so the
+ * expiry check and the tickless idle path peek it in O(1) instead of
+ * scanning wheel slots. General timers stay on the wheel either way.
+ */
+#ifdef SLEEPQ_HEAP
+static pid32 sleepheap[NPROC];
+static int32_t sleepidx[NPROC];     /* Heap slot, -1 if not queued */
+static int32_t nsleepheap = 0;
+#endif
+
+/*
+ * User timers are named by an index into timertab plus the slot's
+ * generation, TMR_ID(gen, idx). The generation is bumped when a slot
+ * is freed, so a stale ID stops matching instead of aliasing the next
+ * timer to reuse the slot, and lookups never dereference a caller's
+ * value. IDs are always positive, so never 0 or SYSERR.
+ * 
+ * The slot table starts with TMR_INIT_CAP static slots and doubles
+ * from the heap when it runs out, so the number of timers is bounded
+ * by memory; the ID format's index field only caps it at 64K slots.
+ */
+#define TMR_INIT_CAP    64              /* Slots available before any growth */
+#define TMR_IDX_BITS    16
+#define TMR_IDX_MASK    ((1 << TMR_IDX_BITS) - 1)
+#define TMR_MAX_CAP     (TMR_IDX_MASK + 1)
+#define TMR_GEN_MASK    0x7FFF
+#define TMR_ID(gen, idx) ((int32_t)(((gen) << TMR_IDX_BITS) | (idx)))
+
+typedef struct timerslot {
+    timer_t     *tp;                    /* NULL while free */
+    uint16_t    gen;                    /* Never 0 */
+    int32_t     next;                   /* Free list link */
+} timerslot_t;
+
+static timerslot_t timer_initial[TMR_INIT_CAP];
+static timerslot_t *timertab = timer_initial;
+static int32_t ntimerslots = 0;         /* Table capacity */
+static int32_t timerfree = -1;
+
+static int32_t ntimers_alloc = 0;
+static int32_t ntimers_active = 0;
+static int32_t nsleeping = 0;
 
 volatile uint32_t clktime = 0;  
 volatile uint32_t ctr1000 = 0; 
@@ -43,8 +115,37 @@ volatile int32_t  clkdefer = 0;
 static uint32_t preempt_count = 0;
 #define QUANTUM         10  
 static uint32_t time_quantum = QUANTUM;
-static qid32 sleepq = -1;
-static int32_t slnempty = 0;
+
+/* Dynamic-tick state */
+#define NOHZ_MAX_TICKS  CLKFREQ         /* Longest tickless idle period */
+static bool nohz_enabled = false;
+static volatile bool nohz_idle = false;
+static uint32_t nohz_programmed = 0;    /* Ticks the one-shot was set for */
+static uint64_t nohz_start;             /* get_cycles() at idle entry */
+static uint64_t tick_last;              /* get_cycles() at the last periodic tick */
+static uint64_t tick_cycles = 0;        /* Measured cycles per tick, 0 if unknown */
+static volatile bool timers_deferred = false;
+
+static struct {
+    uint32_t idle_entries;
+    uint64_t ticks_skipped;
+    uint64_t quantum_skips;
+    uint32_t early_exits;           /* Idle ended by a non-timer IRQ */
+} nohz_stats;
+
+extern int32_t readycount(void);
+extern bool sched_all_idle(void);
+extern pid32 cpu_currpid(void);
+extern void sched_charge(uint32_t nticks);
+extern syscall defer_work(void (*fn)(void *), void *arg);
+extern void irq_resched(void);
+extern bool in_hardirq(void);
+bool clock_idle_enter(void);
+void clock_idle_exit(void);
+static void clock_idle_end(bool fired);
+static void clock_tick_measure(void);
+uint64_t get_cycles(void);
+void process_timers(void);
 
 /* System uptime */
 static struct {
@@ -55,6 +156,342 @@ static struct {
     uint32_t ticks;
 } uptime;
 
+/* Link a timer into the wheel slot for its expiry time */
+static void tw_insert(timer_t *tp) {
+    uint64_t expires = tp->expires;
+    uint64_t delta;
+    timer_t **slot;
+    
+    if (expires < tw_now) {
+        expires = tw_now;
+    }
+    delta = expires - tw_now;
+    
+    if (delta < TW_SIZE) {
+        slot = &tw_wheel[0][expires & TW_MASK];
+    } else if (delta < (1ULL << (2 * TW_BITS))) {
+        slot = &tw_wheel[1][(expires >> TW_BITS) & TW_MASK];
+    } else if (delta < (1ULL << (3 * TW_BITS))) {
+        slot = &tw_wheel[2][(expires >> (2 * TW_BITS)) & TW_MASK];
+    } else {
+        /* Far timers park in the top level and re-cascade until due */
+        if (delta > TW_MAXDELTA) {
+            expires = tw_now + TW_MAXDELTA;
+        }
+        slot = &tw_wheel[3][(expires >> (3 * TW_BITS)) & TW_MASK];
+    }
+    
+    tp->tslot = slot;
+    tp->tprev = NULL;
+    tp->tnext = *slot;
+    if (*slot != NULL) {
+        (*slot)->tprev = tp;
+    }
+    *slot = tp;
+}
+
+/* Unlink a timer from its wheel slot */
+static void tw_remove(timer_t *tp) {
+    if (tp->tslot == NULL) {
+        return;
+    }
+    
+    if (tp->tprev != NULL) {
+        tp->tprev->tnext = tp->tnext;
+    } else {
+        *tp->tslot = tp->tnext;
+    }
+    if (tp->tnext != NULL) {
+        tp->tnext->tprev = tp->tprev;
+    }
+    
+    tp->tnext = NULL;
+    tp->tprev = NULL;
+    tp->tslot = NULL;
+}
+
+#ifdef SLEEPQ_HEAP
+
+static void sq_swap(int32_t i, int32_t j) {
+    pid32 t = sleepheap[i];
+    
+    sleepheap[i] = sleepheap[j];
+    sleepheap[j] = t;
+    sleepidx[sleepheap[i]] = i;
+    sleepidx[sleepheap[j]] = j;
+}
+
+static void sq_up(int32_t i) {
+    int32_t parent;
+    
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (sleeptab[sleepheap[parent]].expires <= sleeptab[sleepheap[i]].expires) {
+            break;
+        }
+        sq_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void sq_down(int32_t i) {
+    int32_t l, r, min;
+    
+    while (true) {
+        l = 2 * i + 1;
+        r = l + 1;
+        min = i;
+        if (l < nsleepheap &&
+            sleeptab[sleepheap[l]].expires < sleeptab[sleepheap[min]].expires) {
+            min = l;
+        }
+        if (r < nsleepheap &&
+            sleeptab[sleepheap[r]].expires < sleeptab[sleepheap[min]].expires) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        sq_swap(i, min);
+        i = min;
+    }
+}
+
+/* Queue a sleep timer on the heap */
+static void sleep_arm(timer_t *tp) {
+    pid32 pid = tp->pid;
+    
+    sleepheap[nsleepheap] = pid;
+    sleepidx[pid] = nsleepheap;
+    nsleepheap++;
+    sq_up(sleepidx[pid]);
+}
+
+/* Take a sleep timer off the heap, if it is on it */
+static void sleep_disarm(timer_t *tp) {
+    int32_t i = sleepidx[tp->pid];
+    
+    if (i < 0) {
+        return;
+    }
+    
+    nsleepheap--;
+    if (i != nsleepheap) {
+        sq_swap(i, nsleepheap);
+        sq_up(i);
+        sq_down(i);
+    }
+    sleepidx[tp->pid] = -1;
+}
+
+#else
+
+#define sleep_arm(tp)       tw_insert(tp)
+#define sleep_disarm(tp)    tw_remove(tp)
+
+#endif /* SLEEPQ_HEAP */
+
+/* Expire a sleep or deadline timer taken off its queue */
+static void sleep_fire(timer_t *tp) {
+    tp->state = TMR_EXPIRED;
+    
+    if (tp->expire != NULL) {
+        /* Blocking deadline: let the wait object unblock the process */
+        tp->expire(tp->pid);
+        return;
+    }
+    
+    /* Sleep timer: wake the process */
+    nsleeping--;
+    if (proctab[tp->pid].prstate == PR_SLEEP) {
+        ready(tp->pid);
+    }
+}
+
+/* Move every timer in a higher-level slot down to its proper level */
+static void tw_cascade(int level, uint32_t index) {
+    timer_t *tp;
+    
+    while ((tp = tw_wheel[level][index]) != NULL) {
+        tw_remove(tp);
+        tw_insert(tp);
+    }
+}
+
+/* Run one wheel tick */
+static void tw_tick(uint64_t now) {
+    timer_t *tp;
+    timer_callback_t callback;
+    void *arg;
+    uint32_t index = now & TW_MASK;
+    int level;
+    
+    /* Cascade higher levels as the lower ones wrap */
+    for (level = 1; level < TW_LEVELS && index == 0; level++) {
+        index = (now >> (level * TW_BITS)) & TW_MASK;
+        tw_cascade(level, index);
+    }
+    
+    index = now & TW_MASK;
+    while ((tp = tw_wheel[0][index]) != NULL) {
+        tw_remove(tp);
+        
+        if (tp->expires > now) {
+            /* Clamped far timer, not yet due */
+            tw_insert(tp);
+            continue;
+        }
+        
+        if (tp->pid >= 0) {
+            sleep_fire(tp);
+            continue;
+        }
+        
+        callback = tp->callback;
+        arg = tp->arg;
+        
+        if (tp->period > 0) {
+            tp->expires = now + tp->period;
+            tw_insert(tp);
+        } else {
+            tp->state = TMR_EXPIRED;
+            ntimers_active--;
+        }
+        
+        /* Callback may delete its own timer; do not touch tp after this */
+        if (callback != NULL) {
+            callback(arg);
+        }
+    }
+}
+
+/* True if some higher-level slot cascades down at tick t */
+static bool tw_cascade_pending(uint64_t t) {
+    int level;
+    uint32_t index;
+    
+    for (level = 1; level < TW_LEVELS; level++) {
+        index = (t >> (level * TW_BITS)) & TW_MASK;
+        if (tw_wheel[level][index] != NULL) {
+            return true;
+        }
+        if (index != 0) {
+            break;
+        }
+    }
+    
+    return false;
+}
+
+/* Earliest tick with wheel work, searching at most limit ticks ahead */
+static uint64_t tw_next_event(uint32_t limit) {
+    uint64_t t;
+    uint64_t end = tw_now + limit;
+    
+#ifdef SLEEPQ_HEAP
+    /* The next wakeup is the heap top; only timers need the scan */
+    if (nsleepheap > 0 && sleeptab[sleepheap[0]].expires < end) {
+        end = sleeptab[sleepheap[0]].expires;
+        if (end < tw_now) {
+            end = tw_now;
+        }
+    }
+#endif
+    
+    for (t = tw_now; t < end; t++) {
+        /* Level 0 only ever holds the next TW_SIZE ticks */
+        if (t < tw_now + TW_SIZE && tw_wheel[0][t & TW_MASK] != NULL) {
+            return t;
+        }
+        if ((t & TW_MASK) == 0 && tw_cascade_pending(t)) {
+            return t;
+        }
+    }
+    
+    return end;
+}
+
+/* Map a timer ID to its node, or NULL if invalid */
+static timer_t *timer_lookup(int32_t tid) {
+    int32_t idx = tid & TMR_IDX_MASK;
+    timer_t *tp;
+    
+    if (tid <= 0 || idx >= ntimerslots ||
+        ((uint32_t)tid >> TMR_IDX_BITS) != timertab[idx].gen) {
+        return NULL;
+    }
+    
+    tp = timertab[idx].tp;
+    if (tp == NULL || tp->magic != TMR_MAGIC || tp->state == TMR_FREE) {
+        return NULL;
+    }
+    
+    return tp;
+}
+
+/*
+ * Time page. The clock handler republishes the time after every
+ * advance into a page-aligned block that user processes map read-only,
+ * so they can read the time without a syscall. seq is odd while an
+ * update is in progress; a reader retries until it sees the same even
+ * value before and after its copy, which also keeps the 64-bit tick
+ * count from tearing on 32-bit CPUs. The block is padded to a whole
+ * page so that mapping it exposes nothing else the linker put nearby.
+ */
+#define TIMEPAGE_SIZE   4096
+
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t clktime;               /* Seconds since boot */
+    uint64_t clkticks;              /* Ticks since boot */
+    uint32_t days;
+    uint8_t  hours;
+    uint8_t  minutes;
+    uint8_t  seconds;
+} timepage_t;
+
+static union {
+    timepage_t  tp;
+    uint8_t     pad[TIMEPAGE_SIZE];
+} timepage __attribute__((aligned(TIMEPAGE_SIZE)));
+
+/* Publish the current time to the time page (interrupts disabled) */
+static void timepage_update(void) {
+    __atomic_store_n(&timepage.tp.seq, timepage.tp.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    timepage.tp.clktime = clktime;
+    timepage.tp.clkticks = clkticks;
+    timepage.tp.days = uptime.days;
+    timepage.tp.hours = uptime.hours;
+    timepage.tp.minutes = uptime.minutes;
+    timepage.tp.seconds = uptime.seconds;
+    
+    __atomic_store_n(&timepage.tp.seq, timepage.tp.seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Consistent snapshot of the time page */
+static void timepage_read(timepage_t *snap) {
+    uint32_t seq;
+    
+    do {
+        seq = __atomic_load_n(&timepage.tp.seq, __ATOMIC_ACQUIRE);
+        snap->clktime = timepage.tp.clktime;
+        snap->clkticks = timepage.tp.clkticks;
+        snap->days = timepage.tp.days;
+        snap->hours = timepage.tp.hours;
+        snap->minutes = timepage.tp.minutes;
+        snap->seconds = timepage.tp.seconds;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&timepage.tp.seq,
+                                                 __ATOMIC_RELAXED));
+}
+
+/* Address of the time page, for mapping read-only into processes */
+const void *clock_timepage(void) {
+    return &timepage;
+}
+
 /* Initialize clock subsystem */
 syscall clkinit(void) {
     int i;
@@ -65,38 +502,76 @@ syscall clkinit(void) {
     clkdefer = 0;
     preempt_count = time_quantum;
     
+    nohz_idle = false;
+    nohz_programmed = 0;
+    tick_last = 0;
+    tick_cycles = 0;
+    timers_deferred = false;
+    nohz_stats.idle_entries = 0;
+    nohz_stats.ticks_skipped = 0;
+    nohz_stats.quantum_skips = 0;
+    nohz_stats.early_exits = 0;
+    
     uptime.days = 0;
     uptime.hours = 0;
     uptime.minutes = 0;
     uptime.seconds = 0;
     uptime.ticks = 0;
     
-    for (i = 0; i < NTIMERS; i++) {
-        timertab[i].state = TMR_FREE;
-        timertab[i].expires = 0;
-        timertab[i].period = 0;
-        timertab[i].callback = NULL;
-        timertab[i].arg = NULL;
+    timepage.tp.seq = 0;
+    timepage_update();
+    
+    for (i = 0; i < TW_LEVELS * TW_SIZE; i++) {
+        tw_wheel[i / TW_SIZE][i % TW_SIZE] = NULL;
     }
+    tw_now = clkticks + 1;
     
-    sleepq = newqueue();
-    if (sleepq == SYSERR) {
-        return SYSERR;
+    for (i = 0; i < NPROC; i++) {
+        sleeptab[i].tnext = NULL;
+        sleeptab[i].tprev = NULL;
+        sleeptab[i].tslot = NULL;
+        sleeptab[i].magic = 0;
+        sleeptab[i].state = TMR_FREE;
+        sleeptab[i].expires = 0;
+        sleeptab[i].period = 0;
+        sleeptab[i].callback = NULL;
+        sleeptab[i].arg = NULL;
+        sleeptab[i].pid = i;
+        sleeptab[i].expire = NULL;
+#ifdef SLEEPQ_HEAP
+        sleepidx[i] = -1;
+#endif
     }
-    slnempty = 0;
+#ifdef SLEEPQ_HEAP
+    nsleepheap = 0;
+#endif
+    
+    if (timertab != timer_initial) {
+        freemem(timertab, ntimerslots * sizeof(timerslot_t));
+    }
+    timertab = timer_initial;
+    ntimerslots = TMR_INIT_CAP;
+    for (i = 0; i < TMR_INIT_CAP; i++) {
+        timertab[i].tp = NULL;
+        timertab[i].gen = 1;
+        timertab[i].next = (i < TMR_INIT_CAP - 1) ? i + 1 : -1;
+    }
+    timerfree = 0;
+    ntimers_alloc = 0;
+    ntimers_active = 0;
+    nsleeping = 0;
     
     return OK;
 }
 
-/* Clock interrupt handler */
-void clkhandler(void) {
-    pid32 pid;
+/* Advance the clock by nticks, carrying into clktime and uptime */
+static void clock_advance(uint32_t nticks) {
+    clkticks += nticks;
+    uptime.ticks += nticks;
     
-    clkticks++;
-    
-    ctr1000++;
-    if (ctr1000 >= 1000) {
-        ctr1000 = 0;
+    ctr1000 += nticks;
+    while (ctr1000 >= 1000) {
+        ctr1000 -= 1000;
         clktime++;
         
         /* Update uptime */
@@ -114,19 +589,57 @@ void clkhandler(void) {
             }
         }
     }
-    uptime.ticks++;
+    
+    timepage_update();
+}
+
+/* Deferred half of the tick: run the timer wheel up to clkticks */
+static void clock_softirq(void *arg) {
+    intmask mask = disable();
+    
+    (void)arg;
+    timers_deferred = false;
+    process_timers();
+    
+    restore(mask);
+}
+
+/* Expire timers, from the bottom half when called in a hard IRQ */
+static void clock_run_timers(void) {
+    if (!in_hardirq()) {
+        process_timers();
+    } else if (!timers_deferred) {
+        timers_deferred = true;
+        defer_work(clock_softirq, NULL);
+    }
+}
+
+/* Clock interrupt handler */
+void clkhandler(void) {
+    if (nohz_idle) {
+        /* One-shot expiry ended an idle period; fold the skipped ticks */
+        clock_idle_end(true);
+        return;
+    }
+    
+    clock_advance(1);
+    sched_charge(1);
+    clock_tick_measure();
     
     if (clkdefer > 0) {
         clkdefer++;
         return;
     }
     
-    process_timers();
-    wakeup();
+    clock_run_timers();
     
-    if (--preempt_count <= 0) {
+    if (nohz_enabled && readycount() == 0) {
+        /* Nothing else can run: the quantum tick would be wasted */
         preempt_count = time_quantum;
-        resched();
+        nohz_stats.quantum_skips++;
+    } else if (--preempt_count <= 0) {
+        preempt_count = time_quantum;   /* Reloaded by the switch, if any */
+        irq_resched();
     }
 }
 
@@ -142,13 +655,10 @@ void undefer_clock(void) {
     intmask mask = disable();
     
     if (clkdefer > 1) {
-        int32_t deferred = clkdefer - 1;
         clkdefer = 0;
         
-        while (deferred-- > 0) {
-            process_timers();
-            wakeup();
-        }
+        /* The wheel catches up on every deferred tick in one pass */
+        process_timers();
         
         resched();
     } else {
@@ -158,48 +668,229 @@ void undefer_clock(void) {
     restore(mask);
 }
 
-/* Wake processes whose sleep time has expired */
-void wakeup(void) {
-    pid32 pid;
+/*------------------------------------------------------------------------
+ * Dynamic Tick (Tickless Idle)
+ *------------------------------------------------------------------------*/
+
+/* Program the timer to interrupt once after nticks */
+static void clock_hw_oneshot(uint32_t nticks) {
+    /*
+     * x86 APIC:  LVT timer one-shot mode, initial count = nticks * divisor
+     * ARM:       CNTP_TVAL = nticks * (CNTFRQ / CLKFREQ), CNTP_CTL = 1
+     */
+    (void)nticks;
+}
+
+/* Restore the periodic CLKFREQ tick */
+static void clock_hw_periodic(void) {
+    /*
+     * x86 APIC:  LVT timer periodic mode
+     * ARM:       re-arm CNTP_TVAL from the clock handler each tick
+     */
+}
+
+/*
+ * Track the cycle counter's rate against the periodic tick, as a
+ * running average of the gap between consecutive ticks. An idle period
+ * breaks the chain, so the first tick after one only restarts it.
+ */
+static void clock_tick_measure(void) {
+    uint64_t now = get_cycles();
+    uint64_t gap;
     
-    while (slnempty && proctab[firstid(sleepq)].pargs <= 0) {
-        pid = dequeue(sleepq);
-        if (pid != EMPTY && pid >= 0 && pid < NPROC) {
-            if (proctab[pid].prstate == PR_SLEEP) {
-                ready(pid);
-            }
-        }
-        slnempty = nonempty(sleepq);
+    if (tick_last != 0) {
+        gap = now - tick_last;
+        tick_cycles = (tick_cycles == 0) ? gap : (tick_cycles * 7 + gap) / 8;
     }
+    tick_last = now;
+}
+
+/* Ticks elapsed since the one-shot was programmed */
+static uint32_t clock_hw_elapsed(bool fired) {
+    uint64_t ticks;
     
-    if (slnempty) {
-        pid = firstid(sleepq);
-        if (pid != EMPTY && pid >= 0 && pid < NPROC) {
-            proctab[pid].pargs--;
-        }
+    if (fired) {
+        return nohz_programmed;
+    }
+    
+    /*
+     * Woken early by another IRQ: the one-shot hasn't expired, so measure
+     * the idle span on the cycle counter and stop short of the
+     * programmed count, since jumping ahead would fire timers early.
+     * Without a calibrated counter, fold nothing; running slow is safe.
+     */
+    if (tick_cycles == 0) {
+        return 0;
+    }
+    ticks = (get_cycles() - nohz_start) / tick_cycles;
+    if (ticks >= nohz_programmed) {
+        ticks = nohz_programmed - 1;
+    }
+    return (uint32_t)ticks;
+}
+
+/* Enable or disable dynamic-tick mode */
+syscall clock_set_nohz(bool enable) {
+    intmask mask = disable();
+    
+    if (!enable && nohz_idle) {
+        clock_idle_exit();
+    }
+    nohz_enabled = enable;
+    
+    restore(mask);
+    return OK;
+}
+
+/**
+ * clock_idle_enter - Stop the periodic tick before the CPU idles
+ * 
+ * Returns: true if the tick was stopped, false if the caller should
+ *          fall back to a normal periodic idle
+ * 
+ * Called by the idle loop with nothing else runnable. Programs the
+ * timer for the next wheel event (timer or sleeper), capped at
+ * NOHZ_MAX_TICKS so the time base never drifts far.
+ */
+bool clock_idle_enter(void) {
+    intmask mask;
+    uint64_t next;
+    uint32_t nticks;
+    
+    mask = disable();
+    
+    /* The tick is shared, so every CPU must be idle, not just this one */
+    if (!nohz_enabled || nohz_idle || clkdefer > 0 || !sched_all_idle()) {
+        restore(mask);
+        return false;
+    }
+    
+    /* Catch up first so the wheel's notion of now matches clkticks */
+    process_timers();
+    
+    next = tw_next_event(NOHZ_MAX_TICKS);
+    nticks = (uint32_t)(next - clkticks);
+    if (nticks <= 1) {
+        /* Something is due on the very next tick anyway */
+        restore(mask);
+        return false;
+    }
+    
+    nohz_idle = true;
+    nohz_programmed = nticks;
+    nohz_start = get_cycles();
+    tick_last = 0;
+    nohz_stats.idle_entries++;
+    clock_hw_oneshot(nticks);
+    
+    restore(mask);
+    return true;
+}
+
+/**
+ * clock_idle_exit - Resume the periodic tick after an idle period
+ * 
+ * Called from the idle loop after an interrupt wakes the CPU. When
+ * that interrupt was the one-shot, the clock handler has already
+ * ended the idle period and this does nothing.
+ */
+void clock_idle_exit(void) {
+    clock_idle_end(false);
+}
+
+/*
+ * End an idle period: fold the ticks that elapsed into clkticks/uptime
+ * and run everything that came due. fired is true when the one-shot
+ * expired, as opposed to some other interrupt waking the CPU.
+ */
+static void clock_idle_end(bool fired) {
+    intmask mask;
+    uint32_t elapsed;
+    
+    mask = disable();
+    
+    if (!nohz_idle) {
+        restore(mask);
+        return;
+    }
+    
+    if (!fired) {
+        nohz_stats.early_exits++;
     }
+    elapsed = clock_hw_elapsed(fired);
+    if (elapsed > nohz_programmed) {
+        elapsed = nohz_programmed;
+    }
+    
+    nohz_idle = false;
+    nohz_programmed = 0;
+    clock_hw_periodic();
+    
+    clock_advance(elapsed);
+    sched_charge(elapsed);
+    if (elapsed > 1) {
+        nohz_stats.ticks_skipped += elapsed - 1;
+    }
+    
+    clock_run_timers();
+    preempt_count = time_quantum;
+    irq_resched();
+    
+    restore(mask);
+}
+
+/* Wake processes whose sleep time has expired */
+void wakeup(void) {
+#ifdef SLEEPQ_HEAP
+    timer_t *tp;
+    
+    while (nsleepheap > 0 && sleeptab[sleepheap[0]].expires <= clkticks) {
+        tp = &sleeptab[sleepheap[0]];
+        sleep_disarm(tp);
+        sleep_fire(tp);
+    }
+#else
+    /* Sleepers are timer-wheel entries; expiring the wheel wakes them */
+    process_timers();
+#endif
 }
 
 /* Put current process to sleep */
 syscall sleep(uint32_t delay) {
     intmask mask;
+    timer_t *tp;
+    pid32 self = cpu_currpid();
     
     if (delay == 0) {
         return OK;
     }
     
+    if (delay > MAXSLEEPTIME) {
+        return SYSERR;
+    }
+    
     mask = disable();
     
-    if (currpid < 0 || currpid >= NPROC) {
+    if (self < 0 || self >= NPROC) {
         restore(mask);
         return SYSERR;
     }
     
-    proctab[currpid].prstate = PR_SLEEP;
-    proctab[currpid].pargs = delay;
+    tp = &sleeptab[self];
+    if (tp->state == TMR_ACTIVE) {
+        /* Stale entry left by a killed process that owned this PID */
+        sleep_disarm(tp);
+        if (tp->expire == NULL) {
+            nsleeping--;
+        }
+    }
+    tp->expire = NULL;
+    tp->state = TMR_ACTIVE;
+    tp->expires = clkticks + delay;
+    sleep_arm(tp);
+    nsleeping++;
     
-    insertd(currpid, sleepq, delay);
-    slnempty = 1;
+    proctab[self].prstate = PR_SLEEP;
     
     resched();
     
@@ -219,7 +910,7 @@ syscall sleepms(uint32_t msec) {
 /* Remove process from sleep queue */
 syscall unsleep(pid32 pid) {
     intmask mask;
-    syscall status;
+    timer_t *tp;
     
     if (pid < 0 || pid >= NPROC) {
         return SYSERR;
@@ -227,89 +918,232 @@ syscall unsleep(pid32 pid) {
     
     mask = disable();
     
-    if (proctab[pid].prstate != PR_SLEEP) {
+    tp = &sleeptab[pid];
+    if (proctab[pid].prstate != PR_SLEEP || tp->state != TMR_ACTIVE ||
+        tp->expire != NULL) {
         restore(mask);
         return SYSERR;
     }
     
-    status = getitem(pid, sleepq);
-    if (status == OK) {
-        proctab[pid].prstate = PR_SUSP;
-        slnempty = nonempty(sleepq);
+    sleep_disarm(tp);
+    tp->state = TMR_STOPPED;
+    nsleeping--;
+    proctab[pid].prstate = PR_SUSP;
+    
+    restore(mask);
+    return OK;
+}
+
+/**
+ * deadline_arm - Arm a timeout for a process that is about to block
+ * 
+ * @param pid: Process that will block
+ * @param ticks: Ticks until the deadline
+ * @param expire: Called with interrupts disabled if the deadline passes
+ *                before the wait object wakes the process
+ * 
+ * Returns: OK on success, SYSERR on error
+ * 
+ * The caller blocks on its wait object as usual, then calls
+ * deadline_cancel() once it runs again. Whichever of the wait object
+ * and the timer wheel fires first wakes the process, at the exact tick.
+ */
+syscall deadline_arm(pid32 pid, uint32_t ticks, void (*expire)(pid32)) {
+    intmask mask;
+    timer_t *tp;
+    
+    if (pid < 0 || pid >= NPROC || expire == NULL || ticks == 0) {
+        return SYSERR;
     }
     
+    mask = disable();
+    
+    tp = &sleeptab[pid];
+    if (tp->state == TMR_ACTIVE) {
+        sleep_disarm(tp);
+        if (tp->expire == NULL) {
+            nsleeping--;
+        }
+    }
+    
+    tp->expire = expire;
+    tp->state = TMR_ACTIVE;
+    tp->expires = clkticks + ticks;
+    sleep_arm(tp);
+    
     restore(mask);
-    return status;
+    return OK;
+}
+
+/**
+ * deadline_cancel - Disarm a deadline set with deadline_arm()
+ * 
+ * @param pid: Process whose deadline to cancel
+ * 
+ * Returns: true if the deadline was still pending, false if it fired
+ */
+bool deadline_cancel(pid32 pid) {
+    intmask mask;
+    timer_t *tp;
+    bool pending = false;
+    
+    if (pid < 0 || pid >= NPROC) {
+        return false;
+    }
+    
+    mask = disable();
+    
+    tp = &sleeptab[pid];
+    if (tp->expire != NULL) {
+        if (tp->state == TMR_ACTIVE) {
+            sleep_disarm(tp);
+            pending = true;
+        }
+        tp->state = TMR_STOPPED;
+        tp->expire = NULL;
+    }
+    
+    restore(mask);
+    return pending;
+}
+
+/* Double the timer slot table (ints disabled) */
+static syscall timer_grow(void) {
+    timerslot_t *newtab;
+    int32_t newcap, i;
+    
+    newcap = ntimerslots * 2;
+    if (newcap > TMR_MAX_CAP) {
+        return SYSERR;
+    }
+    
+    newtab = (timerslot_t *)getmem(newcap * sizeof(timerslot_t));
+    if (newtab == (timerslot_t *)SYSERR) {
+        return SYSERR;
+    }
+    
+    memcpy(newtab, timertab, ntimerslots * sizeof(timerslot_t));
+    
+    /* New slots go on the free list in index order */
+    for (i = ntimerslots; i < newcap; i++) {
+        newtab[i].tp = NULL;
+        newtab[i].gen = 1;
+        newtab[i].next = (i + 1 < newcap) ? i + 1 : timerfree;
+    }
+    timerfree = ntimerslots;
+    
+    if (timertab != timer_initial) {
+        freemem(timertab, ntimerslots * sizeof(timerslot_t));
+    }
+    timertab = newtab;
+    ntimerslots = newcap;
+    
+    return OK;
 }
 
 /* Create a new timer */
 int32_t timer_create(timer_callback_t callback, void *arg,
                      uint32_t delay, uint32_t period) {
-    int i;
     intmask mask;
+    timer_t *tp;
+    int32_t idx;
     
     if (callback == NULL || delay == 0) {
         return SYSERR;
     }
     
+    tp = (timer_t *)getmem(sizeof(timer_t));
+    if (tp == (timer_t *)SYSERR) {
+        return SYSERR;
+    }
+    
+    tp->tnext = NULL;
+    tp->tprev = NULL;
+    tp->tslot = NULL;
+    tp->magic = TMR_MAGIC;
+    tp->period = period;
+    tp->callback = callback;
+    tp->arg = arg;
+    tp->pid = -1;
+    tp->expire = NULL;
+    
     mask = disable();
     
-    for (i = 0; i < NTIMERS; i++) {
-        if (timertab[i].state == TMR_FREE) {
-            timertab[i].state = TMR_ACTIVE;
-            timertab[i].expires = clkticks + delay;
-            timertab[i].period = period;
-            timertab[i].callback = callback;
-            timertab[i].arg = arg;
-            
-            restore(mask);
-            return i;
-        }
+    if (timerfree == -1 && timer_grow() == SYSERR) {
+        restore(mask);
+        freemem(tp, sizeof(timer_t));
+        return SYSERR;
     }
+    idx = timerfree;
+    timerfree = timertab[idx].next;
+    timertab[idx].tp = tp;
+    
+    tp->state = TMR_ACTIVE;
+    tp->expires = clkticks + delay;
+    tw_insert(tp);
+    ntimers_alloc++;
+    ntimers_active++;
     
     restore(mask);
-    return SYSERR;
+    return TMR_ID(timertab[idx].gen, idx);
 }
 
 /* Delete a timer */
 syscall timer_delete(int32_t tid) {
     intmask mask;
-    
-    if (tid < 0 || tid >= NTIMERS) {
-        return SYSERR;
-    }
+    timer_t *tp;
+    int32_t idx;
     
     mask = disable();
     
-    if (timertab[tid].state == TMR_FREE) {
+    tp = timer_lookup(tid);
+    if (tp == NULL) {
         restore(mask);
         return SYSERR;
     }
     
-    timertab[tid].state = TMR_FREE;
-    timertab[tid].callback = NULL;
-    timertab[tid].arg = NULL;
+    if (tp->state == TMR_ACTIVE) {
+        tw_remove(tp);
+        ntimers_active--;
+    }
+    
+    tp->state = TMR_FREE;
+    tp->magic = 0;
+    tp->callback = NULL;
+    tp->arg = NULL;
+    ntimers_alloc--;
+    
+    /* Retire the ID before the slot can be reused */
+    idx = tid & TMR_IDX_MASK;
+    timertab[idx].tp = NULL;
+    if (++timertab[idx].gen > TMR_GEN_MASK) {
+        timertab[idx].gen = 1;
+    }
+    timertab[idx].next = timerfree;
+    timerfree = idx;
     
     restore(mask);
+    
+    freemem(tp, sizeof(timer_t));
     return OK;
 }
 
 /* Stop a running timer */
 syscall timer_stop(int32_t tid) {
     intmask mask;
-    
-    if (tid < 0 || tid >= NTIMERS) {
-        return SYSERR;
-    }
+    timer_t *tp;
     
     mask = disable();
     
-    if (timertab[tid].state != TMR_ACTIVE) {
+    tp = timer_lookup(tid);
+    if (tp == NULL || tp->state != TMR_ACTIVE) {
         restore(mask);
         return SYSERR;
     }
     
-    timertab[tid].state = TMR_STOPPED;
+    tw_remove(tp);
+    tp->state = TMR_STOPPED;
+    ntimers_active--;
     
     restore(mask);
     return OK;
@@ -318,22 +1152,27 @@ syscall timer_stop(int32_t tid) {
 /* Restart a stopped timer */
 syscall timer_start(int32_t tid, uint32_t delay) {
     intmask mask;
-    
-    if (tid < 0 || tid >= NTIMERS) {
-        return SYSERR;
-    }
+    timer_t *tp;
     
     mask = disable();
     
-    if (timertab[tid].state == TMR_FREE) {
+    tp = timer_lookup(tid);
+    if (tp == NULL) {
         restore(mask);
         return SYSERR;
     }
     
+    if (tp->state == TMR_ACTIVE) {
+        tw_remove(tp);
+    } else {
+        ntimers_active++;
+    }
+    
     if (delay > 0) {
-        timertab[tid].expires = clkticks + delay;
+        tp->expires = clkticks + delay;
     }
-    timertab[tid].state = TMR_ACTIVE;
+    tp->state = TMR_ACTIVE;
+    tw_insert(tp);
     
     restore(mask);
     return OK;
@@ -341,28 +1180,15 @@ syscall timer_start(int32_t tid, uint32_t delay) {
 
 /* Process expired timers */
 void process_timers(void) {
-    int i;
-    timer_callback_t callback;
-    void *arg;
-    
-    for (i = 0; i < NTIMERS; i++) {
-        if (timertab[i].state == TMR_ACTIVE) {
-            if (clkticks >= timertab[i].expires) {
-                callback = timertab[i].callback;
-                arg = timertab[i].arg;
-                
-                if (timertab[i].period > 0) {
-                    timertab[i].expires = clkticks + timertab[i].period;
-                } else {
-                    timertab[i].state = TMR_EXPIRED;
-                }
-                
-                if (callback != NULL) {
-                    callback(arg);
-                }
-            }
-        }
+    /* Run every tick not yet seen by the wheel */
+    while (tw_now <= clkticks) {
+        tw_tick(tw_now);
+        tw_now++;
     }
+    
+#ifdef SLEEPQ_HEAP
+    wakeup();
+#endif
 }
 
 /* Get current time in seconds since boot */
@@ -370,22 +1196,40 @@ uint32_t gettime(void) {
     return clktime;
 }
 
+/* Read the CPU cycle counter (falls back to ticks where none exists) */
+uint64_t get_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t cnt;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r" (cnt));
+    return cnt;
+#else
+    return clkticks;
+#endif
+}
+
 /* Get total ticks since boot */
 uint64_t getticks(void) {
-    return clkticks;
+    timepage_t snap;
+    
+    timepage_read(&snap);
+    return snap.clkticks;
 }
 
 /* Get structured uptime information */
 void getuptime(uint32_t *days, uint8_t *hours, 
                uint8_t *minutes, uint8_t *seconds) {
-    intmask mask = disable();
+    timepage_t snap;
     
-    if (days) *days = uptime.days;
-    if (hours) *hours = uptime.hours;
-    if (minutes) *minutes = uptime.minutes;
-    if (seconds) *seconds = uptime.seconds;
+    timepage_read(&snap);
     
-    restore(mask);
+    if (days) *days = snap.days;
+    if (hours) *hours = snap.hours;
+    if (minutes) *minutes = snap.minutes;
+    if (seconds) *seconds = snap.seconds;
 }
 
 /* Convert ticks to milliseconds */
@@ -415,6 +1259,11 @@ uint32_t setquantum(uint32_t quantum) {
     return old;
 }
 
+/* Start a new slice for the process being switched in (0 = global quantum) */
+void clock_set_slice(uint32_t ticks) {
+    preempt_count = (ticks != 0) ? ticks : time_quantum;
+}
+
 /* Get the current time quantum */
 uint32_t getquantum(void) {
     return time_quantum;
@@ -453,15 +1302,6 @@ void mdelay(uint32_t msec) {
 
 /* Print clock information */
 void clock_info(void) {
-    int active_timers = 0;
-    int i;
-    
-    for (i = 0; i < NTIMERS; i++) {
-        if (timertab[i].state == TMR_ACTIVE) {
-            active_timers++;
-        }
-    }
-    
     kprintf("\n===== Clock Information =====\n");
     kprintf("Clock frequency:   %d Hz\n", CLKFREQ);
     kprintf("Time since boot:   %lu seconds\n", clktime);
@@ -470,6 +1310,12 @@ void clock_info(void) {
             uptime.days, uptime.hours, uptime.minutes, uptime.seconds);
     kprintf("Time quantum:      %lu ticks (%lu ms)\n", 
             time_quantum, ticks_to_ms(time_quantum));
-    kprintf("Active timers:     %d / %d\n", active_timers, NTIMERS);
-    kprintf("Sleep queue:       %s\n", slnempty ? "non-empty" : "empty");
+    kprintf("Active timers:     %d (%d allocated)\n",
+            ntimers_active, ntimers_alloc);
+    kprintf("Sleeping procs:    %d\n", nsleeping);
+    kprintf("Dynamic tick:      %s\n", nohz_enabled ? "on" : "off");
+    kprintf("  Idle entries:    %lu\n", nohz_stats.idle_entries);
+    kprintf("  Ticks skipped:   %llu\n", nohz_stats.ticks_skipped);
+    kprintf("  Quantum skips:   %llu\n", nohz_stats.quantum_skips);
+    kprintf("  Early exits:     %lu\n", nohz_stats.early_exits);
 }
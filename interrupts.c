@@ -2,6 +2,7 @@
 
 #include "../include/interrupts.h"
 #include "../include/kernel.h"
+#include "trace.h"
 #include <string.h>
 #include <stdbool.h>
 
@@ -14,14 +15,34 @@
 #define IPL_CLOCK           5
 #define IPL_HIGH            6 
 
+#ifndef NCPU
+#define NCPU            4
+#endif
 
-static volatile intmask interrupt_state = 0;
-static volatile int interrupt_depth = 0;
+#define INT_STACK_SIZE  16
 
+/*
+ * Interrupt mask state is per CPU: masking interrupts only ever holds
+ * off the local CPU, and a process that migrated must not restore the
+ * state another CPU saved. On hardware disable() would mask first and
+ * then look up its CPU, which can't change while masked.
+ */
+typedef struct intstate {
+    volatile intmask    state;          /* Nonzero while masked */
+    volatile int        depth;
+    intmask             stack[INT_STACK_SIZE];
+    int                 sp;
+} intstate_t;
+
+static intstate_t intstate[NCPU];
 
-#define INT_STACK_SIZE  16
-static intmask int_state_stack[INT_STACK_SIZE];
-static int int_stack_ptr = 0;
+typedef volatile int spinlock_t;
+
+int32_t cpuid(void);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+intmask spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, intmask mask);
 
 typedef void (*int_handler_t)(int irq);
 
@@ -33,6 +54,94 @@ static bool interrupt_enabled[MAX_INTERRUPTS];
 /* Interrupt counts for statistics */
 static uint32_t interrupt_counts[MAX_INTERRUPTS];
 
+/* Cycles spent in each handler */
+static uint64_t interrupt_cycles[MAX_INTERRUPTS];
+
+/*
+ * Deferred work. Hard-IRQ handlers queue short work items with
+ * defer_work(). irq_dispatch() runs them with interrupts enabled once
+ * the outermost handler is done and the interrupted context's
+ * interrupt state is back, and only then performs any reschedule
+ * requested through irq_resched(). A full queue makes defer_work() run
+ * the item at once.
+ * 
+ * All of this state is per CPU, like intstate[]: disable() only holds
+ * off the local CPU, and an IRQ on one CPU says nothing about whether
+ * another is in hard-IRQ or softirq context. Work is drained on the
+ * CPU that queued it. Nothing reschedules while a CPU is draining, so
+ * a drain can't migrate and may hold on to its softirq_cpu_t.
+ */
+#define NDEFER              64          /* Power of two */
+
+typedef void (*defer_fn_t)(void *arg);
+
+typedef struct softirq_cpu {
+    struct {
+        defer_fn_t  fn;
+        void        *arg;
+    } queue[NDEFER];
+    uint32_t        head;
+    uint32_t        tail;
+    volatile int    hardirq_depth;
+    volatile bool   in_softirq;
+    volatile bool   resched_pending;
+    uint32_t        queued;
+    uint32_t        overflows;          /* Run inline because queue was full */
+    uint64_t        cycles;
+} softirq_cpu_t;
+
+static softirq_cpu_t softirq_cpu[NCPU];
+
+extern void resched(void);
+extern uint64_t get_cycles(void);
+
+/*
+ * Threaded IRQs. An IRQ registered with set_irq_thread() gets a kernel
+ * process that does the real work; the hard-IRQ side only counts the
+ * event. Events are coalesced: the thread is woken once irq_coalesce()'s
+ * max_events have arrived or max_delay ticks after the first one,
+ * whichever comes first (the defaults wake on every event). In poll
+ * mode the line is masked while the thread runs and the handler is
+ * called repeatedly until it does less than its budget of work.
+ * 
+ * The IRQ can arrive on any CPU, so pending and kicked are guarded by
+ * the line's lock rather than by disable() alone. Timer, line masking
+ * and wakeup work is done after the lock is dropped.
+ */
+typedef uint32_t (*irq_thread_fn_t)(int irq, uint32_t nevents);
+
+#define IRQ_THREAD_STK      2048
+#define IRQ_POLL_BUDGET     16
+
+static struct {
+    spinlock_t      lock;               /* Protects pending and kicked */
+    bool            threaded;
+    bool            poll;               /* NAPI-style: mask and poll */
+    irq_thread_fn_t fn;
+    pid32           pid;
+    sid32           sem;                /* Wakes the thread */
+    int32_t         timer;              /* Coalescing delay timer, or -1 */
+    uint32_t        max_events;
+    uint32_t        max_delay;          /* Ticks, 0 for no delay bound */
+    volatile uint32_t pending;          /* Events since the last wakeup */
+    volatile bool   kicked;             /* Wakeup already on its way */
+    uint32_t        wakeups;
+    uint32_t        events;
+} irq_threads[MAX_INTERRUPTS];
+
+extern pid32 create(void *funcaddr, uint32_t ssize, uint32_t priority,
+                    char *name, uint32_t nargs, ...);
+extern syscall resume(pid32 pid);
+extern sid32 semcreate(int32_t count);
+extern syscall semdelete(sid32 sem);
+extern syscall wait(sid32 sem);
+extern syscall signal(sid32 sem);
+extern int32_t timer_create(void (*callback)(void *), void *arg,
+                            uint32_t delay, uint32_t period);
+extern syscall timer_start(int32_t tid, uint32_t delay);
+extern syscall timer_stop(int32_t tid);
+extern syscall timer_delete(int32_t tid);
+
 /* Exception handler table */
 static int_handler_t exception_handlers[MAX_EXCEPTIONS];
 
@@ -70,13 +179,14 @@ static const char *exception_names[MAX_EXCEPTIONS] = {
 
 /* Interrupt Enable/Disable Functions */
 intmask disable(void) {
-    intmask old_state = interrupt_state;
+    intstate_t *is = &intstate[cpuid()];
+    intmask old_state = is->state;
     
-    interrupt_depth++;
-    interrupt_state = 1;
+    is->depth++;
+    is->state = 1;
     
-    if (int_stack_ptr < INT_STACK_SIZE) {
-        int_state_stack[int_stack_ptr++] = old_state;
+    if (is->sp < INT_STACK_SIZE) {
+        is->stack[is->sp++] = old_state;
     } else {
         panic("Interrupt stack overflow");
     }
@@ -86,32 +196,35 @@ intmask disable(void) {
 
 /* Restore interrupt state */
 void restore(intmask mask) {
-    if (interrupt_depth > 0) {
-        interrupt_depth--;
+    intstate_t *is = &intstate[cpuid()];
+    
+    if (is->depth > 0) {
+        is->depth--;
     } else {
         /* Underflow: restore called too many times */
     }
 
-    if (int_stack_ptr > 0) {
-        interrupt_state = int_state_stack[--int_stack_ptr];
+    if (is->sp > 0) {
+        is->state = is->stack[--is->sp];
     } else {
-        interrupt_state = mask;
+        is->state = mask;
     }
 }
 
 
 void enable(void) {
+    intstate_t *is = &intstate[cpuid()];
     
-    interrupt_state = 0;
-    int_stack_ptr = 0;
+    is->state = 0;
+    is->sp = 0;
 }
 
 bool interrupts_enabled(void) {
-    return (interrupt_state == 0);
+    return (intstate[cpuid()].state == 0);
 }
 
 bool in_interrupt(void) {
-    return (interrupt_depth > 0);
+    return (intstate[cpuid()].depth > 0);
 }
 
 /* Initialize interrupt subsystem */
@@ -122,15 +235,21 @@ void irq_init(void) {
         interrupt_handlers[i] = NULL;
         interrupt_enabled[i] = false;
         interrupt_counts[i] = 0;
+        interrupt_cycles[i] = 0;
     }
     
+    memset(softirq_cpu, 0, sizeof(softirq_cpu));
+    
     for (i = 0; i < MAX_EXCEPTIONS; i++) {
         exception_handlers[i] = NULL;
     }
     
-    interrupt_state = 1;
-    interrupt_depth = 0;
-    int_stack_ptr = 0;
+    /* Every CPU starts masked until it calls enable() */
+    for (i = 0; i < NCPU; i++) {
+        intstate[i].state = 1;
+        intstate[i].depth = 0;
+        intstate[i].sp = 0;
+    }
 }
 
 /* Register an interrupt handler */
@@ -198,29 +317,343 @@ syscall disable_irq(int irq) {
     return OK;
 }
 
+/* Queue work to run on this CPU after the current hard IRQ */
+syscall defer_work(void (*fn)(void *), void *arg) {
+    intmask mask;
+    softirq_cpu_t *sc;
+    
+    if (fn == NULL) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    sc = &softirq_cpu[cpuid()];
+    
+    if (sc->tail - sc->head >= NDEFER) {
+        sc->overflows++;
+        restore(mask);
+        fn(arg);
+        return OK;
+    }
+    
+    sc->queue[sc->tail % NDEFER].fn = fn;
+    sc->queue[sc->tail % NDEFER].arg = arg;
+    sc->tail++;
+    sc->queued++;
+    
+    restore(mask);
+    return OK;
+}
+
+/* Drain this CPU's deferred work; a no-op in a hard IRQ or ongoing drain */
+void softirq_run(void) {
+    intmask mask;
+    softirq_cpu_t *sc;
+    defer_fn_t fn;
+    void *arg;
+    uint64_t t0;
+    bool more;
+    
+    do {
+        mask = disable();
+        sc = &softirq_cpu[cpuid()];
+        if (sc->hardirq_depth > 0 || sc->in_softirq) {
+            restore(mask);
+            return;
+        }
+        sc->in_softirq = true;
+        restore(mask);
+        t0 = get_cycles();
+        
+        while (true) {
+            mask = disable();
+            if (sc->head == sc->tail) {
+                /*
+                 * Leave softirq context before unmasking: an IRQ that
+                 * queues work after this point drains it itself.
+                 */
+                sc->in_softirq = false;
+                restore(mask);
+                break;
+            }
+            fn = sc->queue[sc->head % NDEFER].fn;
+            arg = sc->queue[sc->head % NDEFER].arg;
+            sc->head++;
+            restore(mask);
+            
+            fn(arg);
+        }
+        
+        /* Recheck for work that arrived while the flag was going down */
+        mask = disable();
+        sc->cycles += get_cycles() - t0;
+        sc = &softirq_cpu[cpuid()];
+        more = (sc->head != sc->tail);
+        restore(mask);
+    } while (more);
+}
+
+/* Reschedule now, or once deferred work is done if called from an IRQ */
+void irq_resched(void) {
+    intmask mask = disable();
+    softirq_cpu_t *sc = &softirq_cpu[cpuid()];
+    
+    if (sc->hardirq_depth > 0 || sc->in_softirq) {
+        sc->resched_pending = true;
+        restore(mask);
+        return;
+    }
+    restore(mask);
+    resched();
+}
+
+/* True while a hard IRQ handler is running on this CPU */
+bool in_hardirq(void) {
+    intmask mask = disable();
+    bool hard = (softirq_cpu[cpuid()].hardirq_depth > 0);
+    
+    restore(mask);
+    return hard;
+}
+
 void irq_dispatch(int irq) {
     intmask mask;
+    softirq_cpu_t *sc;
+    uint64_t t0;
+    bool outer, switch_now;
     
     if (irq < 0 || irq >= MAX_INTERRUPTS) {
         return;
     }
     
     mask = disable();
+    sc = &softirq_cpu[cpuid()];
     
     /* Enter interrupt context */
-    interrupt_depth++;
+    intstate[cpuid()].depth++;
+    sc->hardirq_depth++;
     
     /* Update statistics */
     interrupt_counts[irq]++;
     
     /* Call registered handler if any */
     if (interrupt_handlers[irq] != NULL && interrupt_enabled[irq]) {
+        TRACE(TRACE_IRQ_ENTRY, irq, 0);
+        t0 = get_cycles();
         interrupt_handlers[irq](irq);
+        t0 = get_cycles() - t0;
+        interrupt_cycles[irq] += t0;
+        TRACE(TRACE_IRQ_EXIT, irq, t0);
+    }
+    
+    outer = (--sc->hardirq_depth == 0);
+    intstate[cpuid()].depth--;
+    
+    restore(mask);
+    
+    /* Bottom half: deferred work, then any reschedule it asked for */
+    if (outer) {
+        softirq_run();
+        
+        mask = disable();
+        sc = &softirq_cpu[cpuid()];
+        switch_now = (sc->resched_pending && !sc->in_softirq &&
+                      sc->hardirq_depth == 0);
+        if (switch_now) {
+            sc->resched_pending = false;
+        }
+        restore(mask);
+        
+        if (switch_now) {
+            resched();
+        }
+    }
+}
+
+/*
+ * Bottom half (or coalescing timer) side of an IRQ thread wakeup. This
+ * runs inside softirq_run(), so signal() must only request the switch
+ * through irq_resched(); irq_dispatch() performs it after the drain.
+ */
+static void irq_thread_kick(void *arg) {
+    int irq = (int)(intptr_t)arg;
+    
+    signal(irq_threads[irq].sem);
+}
+
+/* Hard-IRQ side for a threaded line: count, and maybe wake the thread */
+static void irq_thread_event(int irq) {
+    bool kick = false, arm = false;
+    
+    spin_lock(&irq_threads[irq].lock);
+    irq_threads[irq].pending++;
+    irq_threads[irq].events++;
+    
+    if (!irq_threads[irq].kicked) {
+        if (irq_threads[irq].pending >= irq_threads[irq].max_events) {
+            irq_threads[irq].kicked = true;
+            kick = true;
+        } else if (irq_threads[irq].pending == 1 &&
+                   irq_threads[irq].timer != -1) {
+            arm = true;
+        }
+    }
+    spin_unlock(&irq_threads[irq].lock);
+    
+    if (kick) {
+        if (irq_threads[irq].timer != -1) {
+            timer_stop(irq_threads[irq].timer);
+        }
+        if (irq_threads[irq].poll) {
+            disable_irq(irq);
+        }
+        defer_work(irq_thread_kick, (void *)(intptr_t)irq);
+    } else if (arm) {
+        timer_start(irq_threads[irq].timer, irq_threads[irq].max_delay);
+    }
+}
+
+/* Coalescing timer expiry: wake with whatever has arrived */
+static void irq_coalesce_timeout(void *arg) {
+    int irq = (int)(intptr_t)arg;
+    intmask mask = spin_lock_irqsave(&irq_threads[irq].lock);
+    
+    if (!irq_threads[irq].kicked && irq_threads[irq].pending > 0) {
+        irq_threads[irq].kicked = true;
+        spin_unlock_irqrestore(&irq_threads[irq].lock, mask);
+        if (irq_threads[irq].poll) {
+            disable_irq(irq);
+        }
+        irq_thread_kick(arg);
+        return;
+    }
+    
+    spin_unlock_irqrestore(&irq_threads[irq].lock, mask);
+}
+
+/* Body of an IRQ thread */
+static void irq_thread_main(int irq) {
+    intmask mask;
+    uint32_t nevents, done;
+    
+    while (true) {
+        wait(irq_threads[irq].sem);
+        
+        mask = spin_lock_irqsave(&irq_threads[irq].lock);
+        nevents = irq_threads[irq].pending;
+        irq_threads[irq].pending = 0;
+        irq_threads[irq].kicked = false;
+        irq_threads[irq].wakeups++;
+        spin_unlock_irqrestore(&irq_threads[irq].lock, mask);
+        
+        if (!irq_threads[irq].poll) {
+            irq_threads[irq].fn(irq, nevents);
+            continue;
+        }
+        
+        /* Line is masked: poll until the device runs dry, then unmask */
+        do {
+            done = irq_threads[irq].fn(irq, nevents);
+            nevents = 0;
+        } while (done >= IRQ_POLL_BUDGET);
+        
+        enable_irq(irq);
+    }
+}
+
+/**
+ * set_irq_thread - Handle an IRQ in a dedicated kernel process
+ * 
+ * @param irq: IRQ number
+ * @param fn: Handler; gets the number of events since its last call and
+ *            returns how much work it did (used in poll mode)
+ * @param priority: Priority of the IRQ thread
+ * @param poll: Mask the line while the thread runs and poll it dry
+ * 
+ * Returns: PID of the IRQ thread, or SYSERR on error
+ */
+pid32 set_irq_thread(int irq, irq_thread_fn_t fn, uint32_t priority,
+                     bool poll) {
+    intmask mask;
+    pid32 pid;
+    sid32 sem;
+    
+    if (irq < 0 || irq >= MAX_INTERRUPTS || fn == NULL ||
+        irq_threads[irq].threaded) {
+        return SYSERR;
+    }
+    
+    sem = semcreate(0);
+    if (sem == SYSERR) {
+        return SYSERR;
     }
     
-    interrupt_depth--;
+    pid = create(irq_thread_main, IRQ_THREAD_STK, priority, "irqthread", 1,
+                 irq);
+    if (pid == SYSERR) {
+        semdelete(sem);
+        return SYSERR;
+    }
     
+    mask = disable();
+    irq_threads[irq].fn = fn;
+    irq_threads[irq].poll = poll;
+    irq_threads[irq].pid = pid;
+    irq_threads[irq].sem = sem;
+    irq_threads[irq].timer = -1;
+    irq_threads[irq].max_events = 1;
+    irq_threads[irq].max_delay = 0;
+    irq_threads[irq].pending = 0;
+    irq_threads[irq].kicked = false;
+    irq_threads[irq].wakeups = 0;
+    irq_threads[irq].events = 0;
+    irq_threads[irq].threaded = true;
+    interrupt_handlers[irq] = irq_thread_event;
     restore(mask);
+    
+    resume(pid);
+    return pid;
+}
+
+/**
+ * irq_coalesce - Batch several interrupts into one thread wakeup
+ * 
+ * @param irq: Threaded IRQ number
+ * @param max_events: Wake after this many events (at least 1)
+ * @param max_delay: Or this many ticks after the first one; 0 for no bound
+ * 
+ * Returns: OK on success, SYSERR on error
+ */
+syscall irq_coalesce(int irq, uint32_t max_events, uint32_t max_delay) {
+    intmask mask;
+    int32_t timer;
+    
+    if (irq < 0 || irq >= MAX_INTERRUPTS || !irq_threads[irq].threaded ||
+        max_events == 0) {
+        return SYSERR;
+    }
+    
+    timer = irq_threads[irq].timer;
+    if (max_delay > 0 && timer == -1) {
+        timer = timer_create(irq_coalesce_timeout, (void *)(intptr_t)irq,
+                             max_delay, 0);
+        if (timer == SYSERR) {
+            return SYSERR;
+        }
+        timer_stop(timer);
+    }
+    
+    mask = disable();
+    irq_threads[irq].max_events = max_events;
+    irq_threads[irq].max_delay = max_delay;
+    irq_threads[irq].timer = (max_delay > 0) ? timer : -1;
+    restore(mask);
+    
+    if (max_delay == 0 && timer != -1) {
+        timer_delete(timer);
+    }
+    
+    return OK;
 }
 
 typedef struct interrupt_frame {
@@ -291,40 +724,18 @@ void init_exception_handlers(void) {
     set_exception_handler(13, general_protection_handler);
 }
 
-/* oftware Interrupts / System Calls */
-
-typedef syscall (*syscall_handler_t)(uint32_t, uint32_t, uint32_t, uint32_t);
-static syscall_handler_t syscall_table[128];
-static int num_syscalls = 0;
-
-syscall register_syscall(int num, syscall (*handler)(uint32_t, uint32_t, 
-                                                      uint32_t, uint32_t)) {
-    if (num < 0 || num >= 128) {
-        return SYSERR;
-    }
-    
-    syscall_table[num] = handler;
-    if (num >= num_syscalls) {
-        num_syscalls = num + 1;
-    }
-    
-    return OK;
-}
-
-syscall syscall_dispatch(uint32_t num, uint32_t arg1, uint32_t arg2,
-                         uint32_t arg3, uint32_t arg4) {
-    if (num >= 128 || syscall_table[num] == NULL) {
-        return SYSERR;
+uint32_t get_irq_count(int irq) {
+    if (irq < 0 || irq >= MAX_INTERRUPTS) {
+        return 0;
     }
-    
-    return syscall_table[num](arg1, arg2, arg3, arg4);
+    return interrupt_counts[irq];
 }
 
-uint32_t get_irq_count(int irq) {
+uint64_t get_irq_cycles(int irq) {
     if (irq < 0 || irq >= MAX_INTERRUPTS) {
         return 0;
     }
-    return interrupt_counts[irq];
+    return interrupt_cycles[irq];
 }
 
 uint32_t get_total_irq_count(void) {
@@ -346,11 +757,46 @@ void clear_irq_counts(void) {
     
     for (i = 0; i < MAX_INTERRUPTS; i++) {
         interrupt_counts[i] = 0;
+        interrupt_cycles[i] = 0;
+    }
+    for (i = 0; i < NCPU; i++) {
+        softirq_cpu[i].queued = 0;
+        softirq_cpu[i].overflows = 0;
+        softirq_cpu[i].cycles = 0;
     }
     
     restore(mask);
 }
 
+/* Print per-IRQ counts and handler time, plus deferred-work totals */
+void irq_stats_print(void) {
+    uint32_t queued = 0, overflows = 0;
+    uint64_t cycles = 0;
+    int i;
+    
+    kprintf("\n IRQ Statistics \n");
+    for (i = 0; i < MAX_INTERRUPTS; i++) {
+        if (interrupt_counts[i] > 0) {
+            kprintf("  [%3d] count=%lu cycles=%llu avg=%llu\n", i,
+                    interrupt_counts[i], interrupt_cycles[i],
+                    interrupt_cycles[i] / interrupt_counts[i]);
+        }
+        if (irq_threads[i].threaded) {
+            kprintf("        thread pid=%d events=%lu wakeups=%lu%s\n",
+                    irq_threads[i].pid, irq_threads[i].events,
+                    irq_threads[i].wakeups,
+                    irq_threads[i].poll ? " (poll)" : "");
+        }
+    }
+    for (i = 0; i < NCPU; i++) {
+        queued += softirq_cpu[i].queued;
+        overflows += softirq_cpu[i].overflows;
+        cycles += softirq_cpu[i].cycles;
+    }
+    kprintf("Deferred work: queued=%lu overflows=%lu cycles=%llu\n",
+            queued, overflows, cycles);
+}
+
 /* Interrupt Controller Interface */
 
 void pic_init(void) {
@@ -403,21 +849,81 @@ void send_eoi(int irq) {
     (void)irq;
 }
 
-typedef volatile int spinlock_t;
+/* Multiprocessor Primitives */
+
+/* Hint to the CPU that we are in a spin-wait loop */
+void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile("pause");
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ volatile("yield");
+#else
+    __asm__ volatile("nop");
+#endif
+}
+
+/* Get the index of the executing CPU */
+int32_t cpuid(void) {
+#if defined(__aarch64__)
+    uint64_t mpidr;
+    __asm__ volatile("mrs %0, mpidr_el1" : "=r" (mpidr));
+    return (int32_t)(mpidr & 0xFF);
+#elif defined(__arm__) && defined(__ARM_ARCH_7A__)
+    uint32_t mpidr;
+    __asm__ volatile("mrc p15, 0, %0, c0, c0, 5" : "=r" (mpidr));
+    return (int32_t)(mpidr & 0xFF);
+#else
+    /*
+     * x86: read the local APIC ID register
+     *   return *(volatile uint32_t*)(APIC_BASE + 0x20) >> 24;
+     */
+    return 0;
+#endif
+}
+
+/* Send an inter-processor interrupt to another CPU */
+void send_ipi(int32_t cpu, int irq) {
+    /*
+     * x86 APIC:
+     *   *(volatile uint32_t*)APIC_ICR_HIGH = apic_id(cpu) << 24;
+     *   *(volatile uint32_t*)APIC_ICR_LOW  = irq;
+     * 
+     * ARM GIC (SGI):
+     *   GICD_SGIR = (1 << (16 + cpu)) | irq;
+     */
+    (void)cpu;
+    (void)irq;
+}
+
+/* Acquire a spinlock with an atomic exchange (test-and-test-and-set) */
+void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        /* Spin on a plain load so the cache line stays shared */
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+            cpu_relax();
+        }
+    }
+}
+
+/* Try once to acquire a spinlock; returns true on success */
+bool spin_trylock(spinlock_t *lock) {
+    return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+/* Release a spinlock */
+void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 intmask spin_lock_irqsave(spinlock_t *lock) {
     intmask mask = disable();
     
-    while (*lock != 0) {
-        /* Busy-wait */
-    }
-    *lock = 1;
+    spin_lock(lock);
     
     return mask;
 }
 
 void spin_unlock_irqrestore(spinlock_t *lock, intmask mask) {
-    *lock = 0;
+    spin_unlock(lock);
     restore(mask);
 }
-
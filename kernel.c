@@ -4,13 +4,14 @@
 #include "../include/process.h"
 #include "../include/memory.h"
 #include "../include/interrupts.h"
+#include "sched.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 
 proc_t proctab[NPROC];
-pid32 currpid = 0;
 sem_t semtab[NSEM];
 
 static int32_t numproc = 0;
@@ -18,10 +19,173 @@ static pid32 nextpid = 1;
 static uint32_t boot_time = 0;
 static volatile uint32_t system_ticks = 0;
 static bool kernel_initialized = false;
-static pid32 readylist_head = -1;
-static pid32 readylist_tail = -1;
 static pid32 sleepq_head = -1;
 
+/*
+ * Per-CPU scheduling state. Each CPU owns a ready queue: one FIFO per
+ * priority level plus a bitmap of non-empty levels, so enqueue, dequeue
+ * and removal of an arbitrary PID are constant time. A queue is guarded
+ * by its CPU's spinlock; other CPUs only take it to queue a wakeup there
+ * or to steal work when they run out of their own.
+ */
+#ifndef NCPU
+#define NCPU            4
+#endif
+
+#define NREADYQ         (PRIORITY_MAX - PRIORITY_MIN + 1)
+#define READYQ_WORDS    ((NREADYQ + 31) / 32)
+
+#define IPI_RESCHED     255             /* IRQ used for reschedule IPIs */
+
+typedef volatile int spinlock_t;
+
+extern intmask spin_lock_irqsave(spinlock_t *lock);
+extern void spin_unlock_irqrestore(spinlock_t *lock, intmask mask);
+extern int32_t cpuid(void);
+extern void send_ipi(int32_t cpu, int irq);
+extern bool mutex_setbase(pid32 pid, int32_t prio);
+extern pid32 create(void *funcaddr, uint32_t ssize, uint32_t priority,
+                    char *name, uint32_t nargs, ...);
+
+typedef struct cpu {
+    spinlock_t  rqlock;                 /* Protects the fields below */
+    bool        online;
+    pid32       currpid;                /* Process running on this CPU */
+    pid32       idlepid;                /* This CPU's null process */
+    int32_t     nready;                 /* Processes on this ready queue */
+    uint32_t    bitmap[READYQ_WORDS];
+    struct {
+        pid32 head;
+        pid32 tail;
+    } readyq[NREADYQ];
+    pid32       edfq;                   /* Deadline queue, earliest first */
+    pid32       fairheap[NPROC];        /* Fair class min-heap on vruntime */
+    int32_t     nfair;
+    uint32_t    fair_weight;            /* Summed weight of fair processes */
+    uint64_t    min_vruntime;           /* Monotonic floor of the heap */
+    uint32_t    steals;                 /* Processes taken from other CPUs */
+    uint32_t    ipis;                   /* Reschedule IPIs received */
+} cpu_t;
+
+static cpu_t cputab[NCPU];
+static int32_t ncpu_online = 0;
+
+/*
+ * Per-process scheduler state, kept apart from proctab so that queue
+ * operations and resched() touch one 32-byte entry per process (two to
+ * a cache line) instead of a whole PCB plus a line from each of several
+ * parallel arrays. prio caches ready_level_of(pprio); it is refreshed
+ * whenever the priority changes through sched_setprio() or a new
+ * process is set up by create(). Cold per-process data (names, stacks,
+ * saved registers, accounting) stays in proctab and schedacct.
+ */
+#if NCPU > 127
+#error "NCPU too large for schedent_t"
+#endif
+
+typedef struct schedent {
+    pid32       next;                   /* Ready FIFO or edfq link */
+    pid32       prev;                   /* Ready FIFO link */
+    int16_t     level;                  /* Queued level, -1 if not queued */
+    int8_t      cpu;                    /* CPU queue holding it, -1 if none */
+    int8_t      last_cpu;               /* CPU it last ran on, -1 if never */
+    uint8_t     cls;                    /* SCHED_CLASS_* */
+    uint8_t     prio;                   /* Cached ready_level_of(pprio) */
+    int16_t     fair_idx;               /* Fair heap slot, -1 if not queued */
+    uint64_t    ready_since;            /* Cycle count when last made ready */
+    uint64_t    vruntime;               /* Fair-class virtual runtime */
+} __attribute__((aligned(32))) schedent_t;
+
+static schedent_t schedtab[NPROC];
+
+/*
+ * Deadline class. A process given (runtime, period, deadline) with
+ * sched_setdeadline() is scheduled earliest-deadline-first ahead of
+ * every priority level. Each period it may run for runtime ticks; once
+ * that budget is spent it is throttled until its next period begins.
+ * A process that wakes after its deadline has passed starts a fresh
+ * period from now. Admission keeps the summed density
+ * runtime / min(deadline, period) within EDF_CAPACITY per online CPU.
+ * The test is global and best-effort: deadline tasks are not
+ * partitioned, so select_cpu() and stealing can still pile more than
+ * one CPU's worth onto a single queue, and a task admitted here may
+ * miss deadlines there.
+ */
+#define RQ_EDF              NREADYQ     /* schedtab[].level of an EDF entry */
+#define EDF_UNIT            1024        /* Fixed-point 1.0 for density */
+#define EDF_CAPACITY        (EDF_UNIT * 95 / 100)
+
+enum { SCHED_CLASS_PRIO = 0, SCHED_CLASS_EDF };
+
+static struct {
+    uint32_t    runtime;                /* Budget per period, ticks */
+    uint32_t    period;
+    uint32_t    deadline;               /* Relative to period start */
+    uint32_t    density;                /* runtime / min(deadline, period) */
+    uint64_t    release;                /* Start of the next period */
+    uint64_t    abs_deadline;
+    int32_t     remaining;              /* Budget left this period */
+    bool        throttled;
+    uint32_t    overruns;
+    pid32       next;                   /* Link in edf_tasks */
+} edf[NPROC];
+
+static pid32 edf_tasks = -1;            /* All deadline-class processes */
+static uint32_t edf_density_total = 0;
+
+/*
+ * Fair-share class. Processes placed in it with sched_setclass() run
+ * below the fixed-priority levels and are picked by least virtual
+ * runtime from a per-CPU binary heap. Running time is charged to
+ * vruntime scaled by FAIR_WEIGHT_BASE / weight, where weight grows
+ * with priority, so higher-priority work earns proportionally more CPU
+ * and a longer slice of the FAIR_LATENCY period. vruntime is kept in
+ * units of 1/FAIR_WEIGHT_BASE tick.
+ */
+#define RQ_FAIR             (NREADYQ + 1)
+#define FAIR_WEIGHT_BASE    1024
+#define FAIR_LATENCY        20          /* Ticks to cycle all runnable */
+#define FAIR_MIN_SLICE      2
+#define FAIR_WAKEUP_GRAN    (FAIR_WEIGHT_BASE * 1)  /* 1 tick of vruntime */
+
+enum { SCHED_CLASS_FAIR = SCHED_CLASS_EDF + 1 };
+
+/* Weight each queued fair process added to its CPU's fair_weight */
+static uint32_t fair_queued_w[NPROC];
+
+
+/* Per-process and per-priority slices; 0 falls back to the global quantum */
+static uint32_t slice_pid[NPROC];
+static uint32_t slice_prio[NREADYQ];
+
+extern volatile uint64_t clkticks;
+extern void irq_resched(void);
+extern void clock_set_slice(uint32_t ticks);
+
+/* Scheduler accounting; see sched.h for the latency histogram */
+static struct {
+    uint64_t    cputicks;               /* Clock ticks charged while running */
+    uint32_t    nvcsw;                  /* Voluntary switches (blocked) */
+    uint32_t    nivcsw;                 /* Involuntary switches (preempted) */
+    uint32_t    latency[SCHED_LATBUCKETS];
+} schedacct[NPROC];
+
+static struct {
+    uint64_t    resched_calls;
+    uint64_t    ctxsw;
+    uint64_t    preemptions;
+} sched_stats;
+
+extern uint64_t get_cycles(void);
+
+void smp_init(void);
+void null_process(void);
+void sched_acct_reset(pid32 pid);
+extern void pid_init(void);
+static void sched_record_latency(pid32 pid);
+uint32_t sched_timeslice(pid32 pid);
+static int32_t ready_level_of(uint32_t prio);
+
 void kernel_init(void) {
     int i;
     intmask mask;
@@ -44,6 +208,7 @@ void kernel_init(void) {
         proctab[i].paddr = 0;
         proctab[i].pargs = 0;
     }
+    pid_init();
     
     /* Initialize semaphore table */
     for (i = 0; i < NSEM; i++) {
@@ -53,8 +218,7 @@ void kernel_init(void) {
     
     init_memory();
     
-    /* Create null process */
-    currpid = 0;
+    /* Create null process; smp_init() makes it CPU 0's current process */
     numproc = 1;
     
     proctab[0].pstate = PR_CURR;
@@ -65,8 +229,31 @@ void kernel_init(void) {
     proctab[0].pwait = -1;
     proctab[0].phasmsg = false;
     
-    readylist_head = -1;
-    readylist_tail = -1;
+    for (i = 0; i < NPROC; i++) {
+        schedtab[i].next = -1;
+        schedtab[i].prev = -1;
+        schedtab[i].level = -1;
+        schedtab[i].cpu = -1;
+        schedtab[i].last_cpu = -1;
+        schedtab[i].cls = SCHED_CLASS_PRIO;
+        schedtab[i].prio = (uint8_t)ready_level_of(proctab[i].pprio);
+        edf[i].throttled = false;
+        schedtab[i].vruntime = 0;
+        schedtab[i].fair_idx = -1;
+        slice_pid[i] = 0;
+    }
+    for (i = 0; i < NREADYQ; i++) {
+        slice_prio[i] = 0;
+    }
+    edf_tasks = -1;
+    edf_density_total = 0;
+    for (i = 0; i < NPROC; i++) {
+        sched_acct_reset(i);
+    }
+    sched_stats.resched_calls = 0;
+    sched_stats.ctxsw = 0;
+    sched_stats.preemptions = 0;
+    smp_init();
     sleepq_head = -1;
     
     system_ticks = 0;
@@ -76,83 +263,525 @@ void kernel_init(void) {
     restore(mask);
 }
 
-/* Add process to ready queue (priority ordered) */
-static void enqueue_ready(pid32 pid) {
-    pid32 prev = -1;
-    pid32 curr = readylist_head;
-    uint32_t prio = proctab[pid].pprio;
+/* Map a priority to its ready queue level */
+static int32_t ready_level_of(uint32_t prio) {
+    if (prio < PRIORITY_MIN) {
+        return 0;
+    }
+    if (prio > PRIORITY_MAX) {
+        return NREADYQ - 1;
+    }
+    return (int32_t)(prio - PRIORITY_MIN);
+}
+
+/* Find the highest non-empty level on a CPU, or -1 (rqlock held) */
+static int32_t rq_highest(cpu_t *c) {
+    int32_t w;
+    
+    for (w = READYQ_WORDS - 1; w >= 0; w--) {
+        if (c->bitmap[w] != 0) {
+            return w * 32 + (31 - __builtin_clz(c->bitmap[w]));
+        }
+    }
+    
+    return -1;
+}
+
+/* Fair-class weight of a process, from its priority */
+static uint32_t fair_weight_of(pid32 pid) {
+    return FAIR_WEIGHT_BASE * (uint32_t)(schedtab[pid].prio + 1) /
+           (uint32_t)(ready_level_of(PRIORITY_DEFAULT) + 1);
+}
+
+static void fairheap_swap(cpu_t *c, int32_t i, int32_t j) {
+    pid32 t = c->fairheap[i];
+    
+    c->fairheap[i] = c->fairheap[j];
+    c->fairheap[j] = t;
+    schedtab[c->fairheap[i]].fair_idx = i;
+    schedtab[c->fairheap[j]].fair_idx = j;
+}
+
+static void fairheap_up(cpu_t *c, int32_t i) {
+    int32_t parent;
+    
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (schedtab[c->fairheap[parent]].vruntime <= schedtab[c->fairheap[i]].vruntime) {
+            break;
+        }
+        fairheap_swap(c, i, parent);
+        i = parent;
+    }
+}
+
+static void fairheap_down(cpu_t *c, int32_t i) {
+    int32_t l, r, min;
+    
+    while (true) {
+        l = 2 * i + 1;
+        r = l + 1;
+        min = i;
+        if (l < c->nfair && schedtab[c->fairheap[l]].vruntime < schedtab[c->fairheap[min]].vruntime) {
+            min = l;
+        }
+        if (r < c->nfair && schedtab[c->fairheap[r]].vruntime < schedtab[c->fairheap[min]].vruntime) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        fairheap_swap(c, i, min);
+        i = min;
+    }
+}
+
+/* Insert into a CPU's fair heap (rqlock held) */
+static void rq_insert_fair(int32_t cpu, pid32 pid) {
+    cpu_t *c = &cputab[cpu];
+    uint64_t floor = c->min_vruntime;
     
-    while (curr != -1 && proctab[curr].pprio >= prio) {
-        prev = curr;
-        curr = proctab[curr].pwait;
+    /* A sleeper re-enters near the front, not with banked credit */
+    if (floor > FAIR_LATENCY * FAIR_WEIGHT_BASE) {
+        floor -= FAIR_LATENCY * FAIR_WEIGHT_BASE / 2;
+    }
+    if (schedtab[pid].vruntime < floor) {
+        schedtab[pid].vruntime = floor;
     }
     
-    proctab[pid].pwait = curr;
+    c->fairheap[c->nfair] = pid;
+    schedtab[pid].fair_idx = c->nfair;
+    c->nfair++;
+    fairheap_up(c, schedtab[pid].fair_idx);
+    fair_queued_w[pid] = fair_weight_of(pid);
+    c->fair_weight += fair_queued_w[pid];
+    
+    schedtab[pid].level = RQ_FAIR;
+    schedtab[pid].cpu = cpu;
+    schedtab[pid].ready_since = get_cycles();
+    c->nready++;
+}
+
+/* Remove from a CPU's fair heap (rqlock held) */
+static void rq_unlink_fair(cpu_t *c, pid32 pid) {
+    int32_t i = schedtab[pid].fair_idx;
+    
+    c->nfair--;
+    if (i != c->nfair) {
+        fairheap_swap(c, i, c->nfair);
+        fairheap_up(c, i);
+        fairheap_down(c, i);
+    }
+    schedtab[pid].fair_idx = -1;
+    c->fair_weight -= fair_queued_w[pid];
+    fair_queued_w[pid] = 0;
+    
+    if (c->nfair > 0 && schedtab[c->fairheap[0]].vruntime > c->min_vruntime) {
+        c->min_vruntime = schedtab[c->fairheap[0]].vruntime;
+    }
+}
+
+/* Insert into a CPU's deadline queue in deadline order (rqlock held) */
+static void rq_insert_edf(int32_t cpu, pid32 pid) {
+    cpu_t *c = &cputab[cpu];
+    pid32 *link = &c->edfq;
+    
+    while (*link != -1 && edf[*link].abs_deadline <= edf[pid].abs_deadline) {
+        link = &schedtab[*link].next;
+    }
+    schedtab[pid].next = *link;
+    *link = pid;
+    
+    schedtab[pid].level = RQ_EDF;
+    schedtab[pid].cpu = cpu;
+    schedtab[pid].ready_since = get_cycles();
+    c->nready++;
+}
+
+/* Add process to tail of its level on a CPU (rqlock held) */
+static void rq_insert(int32_t cpu, pid32 pid) {
+    cpu_t *c = &cputab[cpu];
+    int32_t level;
+    pid32 tail;
+    
+    if (schedtab[pid].cls == SCHED_CLASS_EDF) {
+        rq_insert_edf(cpu, pid);
+        return;
+    }
+    
+    if (schedtab[pid].cls == SCHED_CLASS_FAIR) {
+        rq_insert_fair(cpu, pid);
+        return;
+    }
+    
+    level = schedtab[pid].prio;
+    tail = c->readyq[level].tail;
+    
+    schedtab[pid].level = level;
+    schedtab[pid].cpu = cpu;
+    schedtab[pid].next = -1;
+    schedtab[pid].prev = tail;
+    schedtab[pid].ready_since = get_cycles();
+    
+    if (tail == -1) {
+        c->readyq[level].head = pid;
+        c->bitmap[level / 32] |= (1U << (level % 32));
+    } else {
+        schedtab[tail].next = pid;
+    }
+    c->readyq[level].tail = pid;
+    c->nready++;
+}
+
+/* Unlink process from the CPU queue holding it (that rqlock held) */
+static void rq_unlink(pid32 pid) {
+    cpu_t *c = &cputab[schedtab[pid].cpu];
+    int32_t level = schedtab[pid].level;
+    pid32 prev = schedtab[pid].prev;
+    pid32 next = schedtab[pid].next;
+    pid32 *link;
+    
+    if (level == RQ_EDF) {
+        link = &c->edfq;
+        while (*link != pid) {
+            link = &schedtab[*link].next;
+        }
+        *link = schedtab[pid].next;
+        schedtab[pid].next = -1;
+        schedtab[pid].level = -1;
+        schedtab[pid].cpu = -1;
+        c->nready--;
+        return;
+    }
+    
+    if (level == RQ_FAIR) {
+        rq_unlink_fair(c, pid);
+        schedtab[pid].level = -1;
+        schedtab[pid].cpu = -1;
+        c->nready--;
+        return;
+    }
     
     if (prev == -1) {
-        readylist_head = pid;
+        c->readyq[level].head = next;
     } else {
-        proctab[prev].pwait = pid;
+        schedtab[prev].next = next;
     }
     
-    if (curr == -1) {
-        readylist_tail = pid;
+    if (next == -1) {
+        c->readyq[level].tail = prev;
+    } else {
+        schedtab[next].prev = prev;
     }
+    
+    if (c->readyq[level].head == -1) {
+        c->bitmap[level / 32] &= ~(1U << (level % 32));
+    }
+    
+    schedtab[pid].next = -1;
+    schedtab[pid].prev = -1;
+    schedtab[pid].level = -1;
+    schedtab[pid].cpu = -1;
+    c->nready--;
 }
 
-/* Remove and return highest priority process from ready queue */
-static pid32 dequeue_ready(void) {
-    pid32 pid = readylist_head;
+/* Best process queued on a CPU without removing it, or -1 (rqlock held) */
+static pid32 rq_peek(cpu_t *c) {
+    int32_t level;
     
-    if (pid == -1) {
-        return -1;
+    if (c->edfq != -1) {
+        return c->edfq;
     }
     
-    readylist_head = proctab[pid].pwait;
-    proctab[pid].pwait = -1;
+    level = rq_highest(c);
+    if (level != -1) {
+        return c->readyq[level].head;
+    }
     
-    if (readylist_head == -1) {
-        readylist_tail = -1;
+    return (c->nfair > 0) ? c->fairheap[0] : -1;
+}
+
+/* Should process a run in preference to process b on CPU c? */
+static bool sched_outranks(cpu_t *c, pid32 a, pid32 b) {
+    bool a_edf = (schedtab[a].cls == SCHED_CLASS_EDF && !edf[a].throttled);
+    bool b_edf = (schedtab[b].cls == SCHED_CLASS_EDF && !edf[b].throttled);
+    
+    if (b == c->idlepid) {
+        return true;            /* Anything beats the null process */
     }
     
-    return pid;
+    if (a_edf || b_edf) {
+        if (a_edf && b_edf) {
+            return edf[a].abs_deadline < edf[b].abs_deadline;
+        }
+        return a_edf;
+    }
+    
+    if (schedtab[a].cls == SCHED_CLASS_FAIR || schedtab[b].cls == SCHED_CLASS_FAIR) {
+        if (schedtab[a].cls == schedtab[b].cls) {
+            return schedtab[a].vruntime + FAIR_WAKEUP_GRAN < schedtab[b].vruntime;
+        }
+        return schedtab[b].cls == SCHED_CLASS_FAIR;
+    }
+    
+    return schedtab[a].prio > schedtab[b].prio;
 }
 
-/* Remove specific process from ready queue */
+/* Pick the CPU a newly ready process should queue on */
+static int32_t select_cpu(pid32 pid) {
+    int32_t cpu, best;
+    
+    /* Stay where the cache is warm if that CPU is still up */
+    cpu = schedtab[pid].last_cpu;
+    if (cpu >= 0 && cputab[cpu].online) {
+        return cpu;
+    }
+    
+    best = cpuid();
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        if (cputab[cpu].online && cputab[cpu].nready < cputab[best].nready) {
+            best = cpu;
+        }
+    }
+    
+    return best;
+}
+
+/* Add process to a ready queue, kicking the target CPU if it should preempt */
+static void enqueue_ready(pid32 pid) {
+    intmask mask;
+    int32_t cpu;
+    cpu_t *c;
+    bool kick;
+    
+    if (schedtab[pid].cls == SCHED_CLASS_EDF) {
+        if (edf[pid].throttled) {
+            return;     /* Queued again when its budget is replenished */
+        }
+        if (edf[pid].abs_deadline <= clkticks) {
+            /* Woke after its deadline: start a fresh period from now */
+            edf[pid].abs_deadline = clkticks + edf[pid].deadline;
+            edf[pid].release = clkticks + edf[pid].period;
+            edf[pid].remaining = edf[pid].runtime;
+        }
+    }
+    
+    cpu = select_cpu(pid);
+    c = &cputab[cpu];
+    
+    mask = spin_lock_irqsave(&c->rqlock);
+    rq_insert(cpu, pid);
+    kick = (cpu != cpuid() && sched_outranks(c, pid, c->currpid));
+    spin_unlock_irqrestore(&c->rqlock, mask);
+    
+    if (kick) {
+        send_ipi(cpu, IPI_RESCHED);
+    }
+}
+
+/* Remove specific process from whichever ready queue holds it */
 static void remove_from_ready(pid32 pid) {
-    pid32 prev = -1;
-    pid32 curr = readylist_head;
+    intmask mask;
+    int32_t cpu;
 
     if (pid < 0 || pid >= NPROC) {
         return;
     }
     
-    while (curr != -1 && curr != pid) {
-        if (curr < 0 || curr >= NPROC) {
+    /* Retry if a stealing CPU migrates it between the check and the lock */
+    while ((cpu = schedtab[pid].cpu) >= 0) {
+        mask = spin_lock_irqsave(&cputab[cpu].rqlock);
+        if (schedtab[pid].cpu == cpu) {
+            rq_unlink(pid);
+            spin_unlock_irqrestore(&cputab[cpu].rqlock, mask);
             return;
         }
-         prev = curr;
-         curr = proctab[curr].pwait;
-     }
+        spin_unlock_irqrestore(&cputab[cpu].rqlock, mask);
+    }
+}
+
+/* Take the best ready process from the busiest other CPU, or -1 */
+static pid32 steal_work(int32_t self) {
+    intmask mask;
+    int32_t cpu, victim = -1;
+    pid32 pid = -1;
     
-    if (curr == pid) {
-        if (prev == -1) {
-            readylist_head = proctab[pid].pwait;
-        } else {
-            proctab[prev].pwait = proctab[pid].pwait;
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        if (cpu != self && cputab[cpu].online && cputab[cpu].nready > 0 &&
+            (victim == -1 || cputab[cpu].nready > cputab[victim].nready)) {
+            victim = cpu;
         }
-        
-        if (readylist_tail == pid) {
-            readylist_tail = prev;
+    }
+    
+    if (victim == -1) {
+        return -1;
+    }
+    
+    mask = spin_lock_irqsave(&cputab[victim].rqlock);
+    pid = rq_peek(&cputab[victim]);
+    if (pid != -1) {
+        rq_unlink(pid);
+    }
+    spin_unlock_irqrestore(&cputab[victim].rqlock, mask);
+    
+    if (pid != -1) {
+        cputab[self].steals++;
+    }
+    
+    return pid;
+}
+
+/* Remove and return highest priority process for this CPU, or -1 */
+static pid32 dequeue_ready(void) {
+    intmask mask;
+    int32_t self = cpuid();
+    cpu_t *c = &cputab[self];
+    pid32 pid = -1;
+    
+    mask = spin_lock_irqsave(&c->rqlock);
+    pid = rq_peek(c);
+    if (pid != -1) {
+        rq_unlink(pid);
+    }
+    spin_unlock_irqrestore(&c->rqlock, mask);
+    
+    if (pid == -1) {
+        pid = steal_work(self);
+    }
+    
+    return pid;
+}
+
+/* Get number of processes waiting on this CPU's ready queue */
+int32_t readycount(void) {
+    return cputab[cpuid()].nready;
+}
+
+/* True if no online CPU has anything to run besides its null process */
+bool sched_all_idle(void) {
+    int32_t cpu;
+    
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        if (!cputab[cpu].online) {
+            continue;
         }
-        
-        proctab[pid].pwait = -1;
+        if (__atomic_load_n(&cputab[cpu].nready, __ATOMIC_RELAXED) > 0 ||
+            __atomic_load_n(&cputab[cpu].currpid, __ATOMIC_RELAXED) !=
+            cputab[cpu].idlepid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * cpu_currpid - Get the process running on this CPU
+ * 
+ * This is the calling process in process context, so the answer stays
+ * valid if the caller migrates afterwards. Interrupts are masked for
+ * the lookup so that a switch can't land between cpuid() and the read.
+ */
+pid32 cpu_currpid(void) {
+    intmask mask;
+    pid32 pid;
+    
+    mask = disable();
+    pid = cputab[cpuid()].currpid;
+    restore(mask);
+    return pid;
+}
+
+/*------------------------------------------------------------------------
+ * Multiprocessor Support
+ *------------------------------------------------------------------------*/
+
+/* Reschedule IPI: another CPU queued a process that should preempt ours */
+static void ipi_resched_handler(int irq) {
+    (void)irq;
+    cputab[cpuid()].ipis++;
+    resched();
+}
+
+/* Initialize per-CPU state; the boot CPU comes up running PID 0 */
+void smp_init(void) {
+    int32_t cpu;
+    int32_t i;
+    
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        cputab[cpu].rqlock = 0;
+        cputab[cpu].online = false;
+        cputab[cpu].currpid = -1;
+        cputab[cpu].idlepid = -1;
+        cputab[cpu].nready = 0;
+        for (i = 0; i < READYQ_WORDS; i++) {
+            cputab[cpu].bitmap[i] = 0;
+        }
+        for (i = 0; i < NREADYQ; i++) {
+            cputab[cpu].readyq[i].head = -1;
+            cputab[cpu].readyq[i].tail = -1;
+        }
+        cputab[cpu].edfq = -1;
+        cputab[cpu].nfair = 0;
+        cputab[cpu].fair_weight = 0;
+        cputab[cpu].min_vruntime = 0;
+        cputab[cpu].steals = 0;
+        cputab[cpu].ipis = 0;
+    }
+    
+    cputab[0].online = true;
+    cputab[0].currpid = 0;
+    cputab[0].idlepid = 0;
+    schedtab[0].last_cpu = 0;
+    ncpu_online = 1;
+    
+    set_irq_handler(IPI_RESCHED, ipi_resched_handler);
+    enable_irq(IPI_RESCHED);
+}
+
+/**
+ * smp_cpu_start - Entry point for a secondary CPU
+ * 
+ * @param cpu: Index of the CPU being brought up
+ * 
+ * Called by the platform bring-up code on the new CPU once it has a
+ * stack. Gives the CPU its own null process, marks it online so it
+ * takes wakeups and steals work, then idles. Never returns.
+ */
+void smp_cpu_start(int32_t cpu) {
+    intmask mask;
+    pid32 pid;
+    
+    if (cpu <= 0 || cpu >= NCPU || cputab[cpu].online) {
+        return;
     }
+    
+    pid = create((void *)null_process, 1024, PRIORITY_MIN, "null", 0);
+    if (pid == SYSERR) {
+        panic("smp_cpu_start: no null process");
+    }
+    
+    mask = disable();
+    proctab[pid].pstate = PR_CURR;
+    schedtab[pid].last_cpu = cpu;
+    cputab[cpu].idlepid = pid;
+    cputab[cpu].currpid = pid;
+    cputab[cpu].online = true;
+    ncpu_online++;
+    restore(mask);
+    
+    enable();
+    null_process();
+}
+
+/* Get number of CPUs currently scheduling */
+int32_t smp_ncpus(void) {
+    return ncpu_online;
 }
 
 /* Switch execution context between processes */
 void context_switch(pid32 oldpid, pid32 newpid) {
     proc_t *oldproc, *newproc;
+    int32_t self = cpuid();
     
     if (oldpid == newpid) {
         return;
@@ -160,57 +789,474 @@ void context_switch(pid32 oldpid, pid32 newpid) {
     
     oldproc = &proctab[oldpid];
     newproc = &proctab[newpid];
+    TRACE(TRACE_CTXSW, oldpid, newpid);
     
-    currpid = newpid;
+    cputab[self].currpid = newpid;
+    schedtab[newpid].last_cpu = self;
     newproc->pstate = PR_CURR;
 }
 
-/* Low-level context switch */
 /* Low-level context switch */
 void ctxsw(uint32_t *old_sp, uint32_t new_sp) {
     (void)old_sp;
     (void)new_sp;
 }
 
-/* Reschedule processes */
+/* Reschedule processes on this CPU */
 void resched(void) {
-    intmask mask;
-    pid32 oldpid, newpid;
+    intmask mask, lmask;
+    pid32 oldpid, newpid = -1;
     proc_t *oldproc, *newproc;
+    int32_t self;
+    cpu_t *c;
+    pid32 best;
+    bool preempt;
+    bool involuntary;
     
     mask = disable();
     
-    oldpid = currpid;
+    sched_stats.resched_calls++;
+    
+    self = cpuid();
+    c = &cputab[self];
+    oldpid = c->currpid;
     oldproc = &proctab[oldpid];
+    involuntary = (oldproc->pstate == PR_CURR);
+    TRACE(TRACE_RESCHED, oldpid, involuntary);
+    
+    if (oldproc->pstate == PR_CURR && schedtab[oldpid].cls == SCHED_CLASS_EDF &&
+        edf[oldpid].throttled) {
+        /* Out of budget: off the CPU until replenished, not requeued */
+        oldproc->pstate = PR_READY;
+    }
     
     if (oldproc->pstate == PR_CURR) {
-        if (readylist_head != -1 && 
-            proctab[readylist_head].pprio > oldproc->pprio) {
+        lmask = spin_lock_irqsave(&c->rqlock);
+        best = rq_peek(c);
+        preempt = (best != -1 && 
+                   sched_outranks(c, best, oldpid));
+        if (preempt && oldpid != c->idlepid) {
+            oldproc->pstate = PR_READY;
+            rq_insert(self, oldpid);
+        }
+        spin_unlock_irqrestore(&c->rqlock, lmask);
+        
+        if (!preempt) {
+            /* An idle CPU looks for work elsewhere before giving up */
+            if (oldpid == c->idlepid) {
+                newpid = steal_work(self);
+            }
+            if (newpid == -1) {
+                restore(mask);
+                return;
+            }
+        }
+        
+        if (oldpid == c->idlepid) {
+            /* The null process is never queued; it is the fallback */
             oldproc->pstate = PR_READY;
-            enqueue_ready(oldpid);
-        } else {
-            restore(mask);
-            return;
         }
     }
     
-    newpid = dequeue_ready();
+    if (newpid == -1) {
+        newpid = dequeue_ready();
+    }
     
     if (newpid == -1) {
-        newpid = 0;
+        newpid = c->idlepid;
     }
     
     newproc = &proctab[newpid];
     newproc->pstate = PR_CURR;
-    currpid = newpid;
     
     if (oldpid != newpid) {
+        sched_stats.ctxsw++;
+        if (involuntary) {
+            schedacct[oldpid].nivcsw++;
+            sched_stats.preemptions++;
+        } else {
+            schedacct[oldpid].nvcsw++;
+        }
+        if (newpid != c->idlepid) {
+            sched_record_latency(newpid);
+        }
+        clock_set_slice(sched_timeslice(newpid));
         context_switch(oldpid, newpid);
     }
     
     restore(mask);
 }
 
+/*------------------------------------------------------------------------
+ * Scheduler Accounting
+ *------------------------------------------------------------------------*/
+
+/* Record how long a process waited between becoming ready and running */
+static void sched_record_latency(pid32 pid) {
+    uint64_t wait = get_cycles() - schedtab[pid].ready_since;
+    int32_t bucket = 0;
+    
+    if (wait > 0) {
+        bucket = 63 - __builtin_clzll(wait);
+        if (bucket >= SCHED_LATBUCKETS) {
+            bucket = SCHED_LATBUCKETS - 1;
+        }
+    }
+    
+    schedacct[pid].latency[bucket]++;
+}
+
+/* Clear accounting for a process slot (called when a PID is created) */
+void sched_acct_reset(pid32 pid) {
+    int i;
+    
+    if (pid < 0 || pid >= NPROC) {
+        return;
+    }
+    
+    schedacct[pid].cputicks = 0;
+    schedacct[pid].nvcsw = 0;
+    schedacct[pid].nivcsw = 0;
+    schedtab[pid].ready_since = 0;
+    for (i = 0; i < SCHED_LATBUCKETS; i++) {
+        schedacct[pid].latency[i] = 0;
+    }
+    
+    /* A recycled PID starts back in the priority class with no slice */
+    if (schedtab[pid].cls == SCHED_CLASS_FAIR) {
+        schedtab[pid].cls = SCHED_CLASS_PRIO;
+    }
+    schedtab[pid].vruntime = 0;
+    schedtab[pid].prio = (uint8_t)ready_level_of(proctab[pid].pprio);
+    slice_pid[pid] = 0;
+}
+
+/* Start new periods for deadline tasks whose release time has come */
+static void edf_replenish(void) {
+    pid32 pid;
+    bool wake = false;
+    
+    for (pid = edf_tasks; pid != -1; pid = edf[pid].next) {
+        if (edf[pid].release > clkticks) {
+            continue;
+        }
+        
+        edf[pid].release += edf[pid].period;
+        if (edf[pid].release <= clkticks) {
+            edf[pid].release = clkticks + edf[pid].period;   /* Missed periods */
+        }
+        edf[pid].abs_deadline = edf[pid].release - edf[pid].period +
+                                edf[pid].deadline;
+        edf[pid].remaining = edf[pid].runtime;
+        
+        if (edf[pid].throttled) {
+            edf[pid].throttled = false;
+            if (proctab[pid].pstate == PR_READY && schedtab[pid].cpu < 0) {
+                enqueue_ready(pid);
+                wake = true;
+            }
+        }
+    }
+    
+    if (wake) {
+        irq_resched();
+    }
+}
+
+/**
+ * sched_timeslice - Ticks a process may run before the clock preempts it
+ * 
+ * @param pid: Process ID
+ * 
+ * Returns: Slice in ticks, or 0 for the global quantum
+ */
+uint32_t sched_timeslice(pid32 pid) {
+    cpu_t *c;
+    uint32_t slice, total;
+    
+    if (pid < 0 || pid >= NPROC) {
+        return 0;
+    }
+    
+    if (slice_pid[pid] != 0) {
+        return slice_pid[pid];
+    }
+    
+    switch (schedtab[pid].cls) {
+    case SCHED_CLASS_EDF:
+        return (edf[pid].remaining > 0) ? (uint32_t)edf[pid].remaining : 1;
+        
+    case SCHED_CLASS_FAIR:
+        /* Share of the latency period in proportion to weight */
+        c = &cputab[cpuid()];
+        total = c->fair_weight + fair_weight_of(pid);
+        slice = FAIR_LATENCY * fair_weight_of(pid) / total;
+        return (slice < FAIR_MIN_SLICE) ? FAIR_MIN_SLICE : slice;
+        
+    default:
+        return slice_prio[schedtab[pid].prio];
+    }
+}
+
+/**
+ * setquantum_pid - Set a per-process time slice
+ * 
+ * @param pid: Process ID
+ * @param ticks: Slice in ticks, 0 to use the class default
+ * 
+ * Returns: OK on success, SYSERR on error
+ */
+syscall setquantum_pid(pid32 pid, uint32_t ticks) {
+    if (pid < 0 || pid >= NPROC) {
+        return SYSERR;
+    }
+    
+    slice_pid[pid] = ticks;
+    return OK;
+}
+
+/**
+ * setquantum_prio - Set the time slice for a fixed-priority level
+ * 
+ * @param prio: Priority
+ * @param ticks: Slice in ticks, 0 to use the global quantum
+ * 
+ * Returns: OK on success, SYSERR on error
+ */
+syscall setquantum_prio(int32_t prio, uint32_t ticks) {
+    if (prio < PRIORITY_MIN || prio > PRIORITY_MAX) {
+        return SYSERR;
+    }
+    
+    slice_prio[ready_level_of(prio)] = ticks;
+    return OK;
+}
+
+/**
+ * sched_setclass - Move a process between priority and fair-share
+ * 
+ * @param pid: Process ID
+ * @param fair: true for the fair-share class, false for fixed priority
+ * 
+ * Returns: OK on success, SYSERR on error (including deadline-class
+ *          processes, which leave via sched_setdeadline())
+ */
+syscall sched_setclass(pid32 pid, bool fair) {
+    intmask mask;
+    bool queued;
+    uint8_t cls = fair ? SCHED_CLASS_FAIR : SCHED_CLASS_PRIO;
+    
+    if (pid <= 0 || pid >= NPROC) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (proctab[pid].pstate == PR_FREE ||
+        schedtab[pid].cls == SCHED_CLASS_EDF) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    if (schedtab[pid].cls != cls) {
+        queued = (schedtab[pid].cpu >= 0);
+        if (queued) {
+            remove_from_ready(pid);
+        }
+        schedtab[pid].cls = cls;
+        schedtab[pid].vruntime = 0;      /* Placed at the CPU's floor on insert */
+        if (queued) {
+            enqueue_ready(pid);
+        }
+    }
+    
+    restore(mask);
+    return OK;
+}
+
+/**
+ * sched_setdeadline - Move a process into or out of the deadline class
+ * 
+ * @param pid: Process ID
+ * @param runtime: Ticks of CPU per period; 0 returns it to priority
+ *                 scheduling
+ * @param period: Period in ticks
+ * @param deadline: Relative deadline in ticks, 0 for the period
+ * 
+ * Returns: OK on success, SYSERR if invalid or admission would push the
+ *          deadline class past EDF_CAPACITY of the online CPUs (summed
+ *          over all of them; see the deadline class notes)
+ */
+syscall sched_setdeadline(pid32 pid, uint32_t runtime, uint32_t period,
+                          uint32_t deadline) {
+    intmask mask;
+    uint32_t density = 0, limit;
+    pid32 *link;
+    bool queued;
+    
+    if (pid <= 0 || pid >= NPROC) {
+        return SYSERR;
+    }
+    
+    if (deadline == 0) {
+        deadline = period;
+    }
+    
+    if (runtime != 0) {
+        if (period == 0 || runtime > deadline || deadline > period) {
+            return SYSERR;
+        }
+        density = (uint32_t)(((uint64_t)runtime * EDF_UNIT + deadline - 1) /
+                             deadline);
+    }
+    
+    mask = disable();
+    
+    if (proctab[pid].pstate == PR_FREE && runtime != 0) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    /* Admission: swap out the old reservation before testing the new */
+    limit = EDF_CAPACITY * (uint32_t)(ncpu_online > 0 ? ncpu_online : 1);
+    if (edf_density_total - (schedtab[pid].cls == SCHED_CLASS_EDF ?
+                             edf[pid].density : 0) + density > limit) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    /* A throttled task is ready but on no queue; it must be requeued too */
+    queued = (schedtab[pid].cpu >= 0);
+    if (queued) {
+        remove_from_ready(pid);
+    } else if (proctab[pid].pstate == PR_READY &&
+               schedtab[pid].cls == SCHED_CLASS_EDF && edf[pid].throttled) {
+        queued = true;
+    }
+    
+    if (schedtab[pid].cls == SCHED_CLASS_EDF) {
+        edf_density_total -= edf[pid].density;
+        link = &edf_tasks;
+        while (*link != pid) {
+            link = &edf[*link].next;
+        }
+        *link = edf[pid].next;
+        schedtab[pid].cls = SCHED_CLASS_PRIO;
+        edf[pid].throttled = false;
+    }
+    
+    if (runtime != 0) {
+        edf[pid].runtime = runtime;
+        edf[pid].period = period;
+        edf[pid].deadline = deadline;
+        edf[pid].density = density;
+        edf[pid].release = clkticks + period;
+        edf[pid].abs_deadline = clkticks + deadline;
+        edf[pid].remaining = (int32_t)runtime;
+        edf[pid].throttled = false;
+        edf[pid].overruns = 0;
+        edf[pid].next = edf_tasks;
+        edf_tasks = pid;
+        edf_density_total += density;
+        schedtab[pid].cls = SCHED_CLASS_EDF;
+    }
+    
+    if (queued) {
+        enqueue_ready(pid);
+    }
+    
+    restore(mask);
+    return OK;
+}
+
+/* Charge clock ticks to the process running on this CPU */
+void sched_charge(uint32_t nticks) {
+    pid32 pid = cputab[cpuid()].currpid;
+    
+    if (pid >= 0 && pid < NPROC) {
+        schedacct[pid].cputicks += nticks;
+        
+        if (schedtab[pid].cls == SCHED_CLASS_FAIR) {
+            schedtab[pid].vruntime += (uint64_t)nticks * FAIR_WEIGHT_BASE *
+                             FAIR_WEIGHT_BASE / fair_weight_of(pid);
+        }
+        
+        if (schedtab[pid].cls == SCHED_CLASS_EDF && !edf[pid].throttled) {
+            edf[pid].remaining -= (int32_t)nticks;
+            if (edf[pid].remaining <= 0) {
+                edf[pid].throttled = true;
+                edf[pid].overruns++;
+                irq_resched();
+            }
+        }
+    }
+    
+    if (edf_tasks != -1) {
+        edf_replenish();
+    }
+}
+
+/**
+ * sched_getacct - Get scheduler accounting for a process
+ * 
+ * @param pid: Process ID
+ * @param cputicks: Ticks run (can be NULL)
+ * @param nvcsw: Voluntary switches (can be NULL)
+ * @param nivcsw: Involuntary switches (can be NULL)
+ * @param latency: Latency histogram, SCHED_LATBUCKETS entries (can be NULL)
+ * 
+ * Returns: OK on success, SYSERR on error
+ */
+syscall sched_getacct(pid32 pid, uint64_t *cputicks, uint32_t *nvcsw,
+                      uint32_t *nivcsw, uint32_t *latency) {
+    intmask mask;
+    int i;
+    
+    if (pid < 0 || pid >= NPROC) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (proctab[pid].pstate == PR_FREE) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    if (cputicks != NULL) *cputicks = schedacct[pid].cputicks;
+    if (nvcsw != NULL) *nvcsw = schedacct[pid].nvcsw;
+    if (nivcsw != NULL) *nivcsw = schedacct[pid].nivcsw;
+    if (latency != NULL) {
+        for (i = 0; i < SCHED_LATBUCKETS; i++) {
+            latency[i] = schedacct[pid].latency[i];
+        }
+    }
+    
+    restore(mask);
+    return OK;
+}
+
+/**
+ * sched_getstats - Get global scheduler counters
+ * 
+ * @param ctxsw: Context switches (can be NULL)
+ * @param preemptions: Involuntary switches (can be NULL)
+ * @param rescheds: Calls to resched() (can be NULL)
+ * 
+ * Returns: OK
+ */
+syscall sched_getstats(uint64_t *ctxsw, uint64_t *preemptions,
+                       uint64_t *rescheds) {
+    intmask mask = disable();
+    
+    if (ctxsw != NULL) *ctxsw = sched_stats.ctxsw;
+    if (preemptions != NULL) *preemptions = sched_stats.preemptions;
+    if (rescheds != NULL) *rescheds = sched_stats.resched_calls;
+    
+    restore(mask);
+    return OK;
+}
+
 /* Control rescheduling behavior */
 static bool resched_deferred = false;
 static bool resched_pending = false;
@@ -305,6 +1351,36 @@ int32_t getprio(pid32 pid) {
     return prio;
 }
 
+/*
+ * Set a process's priority and requeue it if it is sitting in a ready
+ * queue. No reschedule; callers decide. Caller has interrupts disabled.
+ */
+void sched_setprio(pid32 pid, int32_t prio) {
+    if (proctab[pid].pprio == prio) {
+        return;
+    }
+    
+    proctab[pid].pprio = prio;
+    
+    /* Requeue with the cached level changed only while off the queue */
+    if (proctab[pid].pstate == PR_READY && schedtab[pid].cpu >= 0) {
+        remove_from_ready(pid);
+        schedtab[pid].prio = (uint8_t)ready_level_of(prio);
+        enqueue_ready(pid);
+    } else {
+        schedtab[pid].prio = (uint8_t)ready_level_of(prio);
+    }
+}
+
+/*
+ * Make a process that sits on no queue ready and queue it. No
+ * reschedule; callers decide. Caller has interrupts disabled.
+ */
+void sched_ready(pid32 pid) {
+    proctab[pid].pstate = PR_READY;
+    enqueue_ready(pid);
+}
+
 /* Change priority of a process */
 int32_t chprio(pid32 pid, int32_t newprio) {
     intmask mask;
@@ -328,14 +1404,13 @@ int32_t chprio(pid32 pid, int32_t newprio) {
     }
     
     oldprio = pptr->pprio;
-    pptr->pprio = newprio;
     
-    if (pptr->pstate == PR_READY) {
-        remove_from_ready(pid);
-        enqueue_ready(pid);
+    /* A mutex holder keeps any boost; the new value becomes its base */
+    if (!mutex_setbase(pid, newprio)) {
+        sched_setprio(pid, newprio);
     }
     
-    if (pid == currpid || pptr->pstate == PR_READY) {
+    if (pid == cpu_currpid() || pptr->pstate == PR_READY) {
         resched();
     }
     
@@ -445,18 +1520,29 @@ void dump_proc_table(void) {
         "FREE", "CURR", "READY", "RECV", "SLEEP", "SUSP", "WAIT"
     };
     
+    kprintf("\n PID  STATE  PRIO  CPUTICKS      VCSW     IVCSW  NAME\n");
     for (i = 0; i < NPROC; i++) {
         if (proctab[i].pstate != PR_FREE) {
             const char *state = (proctab[i].pstate < 7) ? 
                                 state_names[proctab[i].pstate] : "???";
-            (void)state;
+            kprintf("%4d  %-5s  %4lu  %8llu  %8lu  %8lu  %s\n",
+                    i, state, proctab[i].pprio, schedacct[i].cputicks,
+                    schedacct[i].nvcsw, schedacct[i].nivcsw,
+                    proctab[i].pname);
         }
     }
+    kprintf("Context switches: %llu (%llu preemptions, %llu rescheds)\n",
+            sched_stats.ctxsw, sched_stats.preemptions,
+            sched_stats.resched_calls);
 }
 
 /* The null (idle) process */
 void null_process(void) {
     while (1) {
+        /* Pick up work queued here or stealable from a busy CPU */
+        if (ncpu_online > 1) {
+            resched();
+        }
         __asm__("nop");
     }
 }
@@ -11,11 +11,19 @@
 
 
 extern proc_t proctab[];
-extern pid32 currpid;
 extern void kernel_init(void);
 extern void irq_init(void);
 extern void init_exception_handlers(void);
 extern void clkhandler(void);
+extern bool clock_idle_enter(void);
+extern void clock_idle_exit(void);
+extern void bench_process(void);
+extern uint64_t get_cycles(void);
+extern uint64_t getticks(void);
+extern sid32 semcreate(int32_t count);
+
+static bool boot_option(const char *opt);
+static void create_system_processes(void);
 
 /*------------------------------------------------------------------------
  * Boot Configuration
@@ -32,6 +40,13 @@ typedef struct boot_params {
 
 static boot_params_t boot_info;
 
+/* Run the microbenchmark suite at boot without a command line option */
+#ifdef KERNEL_BENCH
+#define BENCH_AT_BOOT   true
+#else
+#define BENCH_AT_BOOT   false
+#endif
+
 /*------------------------------------------------------------------------
  * System Initialization Stages
  *------------------------------------------------------------------------*/
@@ -195,6 +210,300 @@ static void net_init(void) {
      */
 }
 
+/* Stage wrapper; scheduler_init() takes the policy as an argument */
+static void sched_init_stage(void) {
+    scheduler_init(SCHED_PRIORITY);
+}
+
+/*------------------------------------------------------------------------
+ * Boot Stages
+ *------------------------------------------------------------------------*/
+
+/*
+ * Every init stage runs through boot_run(), which records its cycles
+ * and ticks. A stage marked BOOT_DEFER is skipped by kernel_main() and
+ * started instead as a kernel process by boot_spawn(), so that the
+ * shell doesn't wait for devices, file systems or the network. The
+ * process first waits for each stage in its deps mask. When a
+ * deferred stage finishes it signals its gate semaphore once, and each
+ * waiter signals the gate again on its way out, so any number of later
+ * stages can wait on it. Inline stages are checked against their deps
+ * too, which catches a reordering in kernel_main(). The "bootsync"
+ * option runs every stage inline, and "boottime" prints the profile
+ * once the last deferred stage is done.
+ */
+#define STAGE_EARLY     0
+#define STAGE_ARCH      1
+#define STAGE_MEM       2
+#define STAGE_KERNEL    3
+#define STAGE_INTR      4
+#define STAGE_CLOCK     5
+#define STAGE_DEV       6
+#define STAGE_FS        7
+#define STAGE_NET       8
+#define STAGE_SCHED     9
+#define STAGE_PROCS     10
+#define BOOT_NSTAGES    11
+
+#define STAGE_BIT(s)    (1u << (s))
+
+/* boot_stat() indices past the last stage */
+#define BOOT_STAT_TOTAL (BOOT_NSTAGES)      /* Entry to end of the last stage */
+#define BOOT_STAT_SHELL (BOOT_NSTAGES + 1)  /* Entry to the shell's first run */
+
+/* Stage states, as returned by boot_stat() */
+#define BOOT_PENDING    0
+#define BOOT_RUNNING    1
+#define BOOT_DONE       2
+
+#define BOOT_DEFER      0x01            /* Run as a process after enable() */
+#define BOOT_PRIO       40              /* Below the shell */
+#define BOOT_STK        8192
+
+typedef struct boot_stage {
+    const char      *name;
+    void            (*fn)(void);
+    uint32_t        deps;               /* STAGE_BITs that must finish first */
+    uint32_t        flags;
+    volatile uint32_t state;
+    sid32           gate;               /* Deferred only: signalled when done */
+    uint64_t        cycles;
+    uint64_t        ticks;
+} boot_stage_t;
+
+static boot_stage_t boot_stages[BOOT_NSTAGES] = {
+    [STAGE_EARLY]  = { "early",  early_init,        0,                       0 },
+    [STAGE_ARCH]   = { "arch",   arch_init,         STAGE_BIT(STAGE_EARLY),  0 },
+    [STAGE_MEM]    = { "mem",    mem_init,          STAGE_BIT(STAGE_ARCH),   0 },
+    [STAGE_KERNEL] = { "kernel", kernel_init,       STAGE_BIT(STAGE_MEM),    0 },
+    [STAGE_INTR]   = { "intr",   intr_init,         STAGE_BIT(STAGE_KERNEL), 0 },
+    [STAGE_CLOCK]  = { "clock",  clock_init,        STAGE_BIT(STAGE_INTR),   0 },
+    [STAGE_DEV]    = { "dev",    dev_init,          STAGE_BIT(STAGE_CLOCK),  BOOT_DEFER },
+    [STAGE_FS]     = { "fs",     fs_init,           STAGE_BIT(STAGE_DEV),    BOOT_DEFER },
+    [STAGE_NET]    = { "net",    net_init,          STAGE_BIT(STAGE_DEV),    BOOT_DEFER },
+    [STAGE_SCHED]  = { "sched",  sched_init_stage,  STAGE_BIT(STAGE_KERNEL), 0 },
+    [STAGE_PROCS]  = { "procs",  create_system_processes,
+                                                    STAGE_BIT(STAGE_SCHED),  0 },
+};
+
+static uint64_t boot_start;             /* Cycles at kernel_main() entry */
+static uint64_t boot_shell;             /* Cycles when the shell first ran */
+static uint64_t boot_end;               /* Cycles when the last stage finished */
+static int32_t boot_ndeferred;          /* Deferred stages not yet done */
+
+/* True if every stage in mask has finished */
+static bool boot_deps_done(uint32_t mask) {
+    int32_t i;
+    
+    for (i = 0; i < BOOT_NSTAGES; i++) {
+        if ((mask & STAGE_BIT(i)) && boot_stages[i].state != BOOT_DONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Run one stage in the caller's context and record its cost */
+static void boot_exec(int32_t id) {
+    boot_stage_t *st = &boot_stages[id];
+    uint64_t c0, t0;
+    
+    st->state = BOOT_RUNNING;
+    t0 = getticks();
+    c0 = get_cycles();
+    st->fn();
+    st->cycles = get_cycles() - c0;
+    st->ticks = getticks() - t0;
+    st->state = BOOT_DONE;
+}
+
+/**
+ * boot_run - Run a boot stage from kernel_main()
+ * 
+ * @param id: STAGE_* index
+ * 
+ * Deferred stages are left pending for boot_spawn() unless the
+ * "bootsync" option is set.
+ */
+static void boot_run(int32_t id) {
+    boot_stage_t *st = &boot_stages[id];
+    
+    if ((st->flags & BOOT_DEFER) && !boot_option("bootsync")) {
+        return;
+    }
+    if (!boot_deps_done(st->deps)) {
+        panic("boot: stage run before its dependencies");
+    }
+    boot_exec(id);
+}
+
+void boot_report(void);
+
+/* Process body for a deferred stage */
+static void boot_stage_process(int32_t id) {
+    boot_stage_t *st = &boot_stages[id];
+    intmask mask;
+    int32_t i, left;
+    
+    if (st->state != BOOT_PENDING) {
+        return;                 /* boot_spawn() had to run it inline */
+    }
+    
+    for (i = 0; i < BOOT_NSTAGES; i++) {
+        if ((st->deps & STAGE_BIT(i)) && boot_stages[i].state != BOOT_DONE) {
+            wait(boot_stages[i].gate);
+            signal(boot_stages[i].gate);        /* Pass it on */
+        }
+    }
+    
+    boot_exec(id);
+    
+    mask = disable();
+    left = --boot_ndeferred;
+    if (left == 0) {
+        boot_end = get_cycles();
+    }
+    restore(mask);
+    
+    signal(st->gate);
+    if (left == 0 && boot_option("boottime")) {
+        boot_report();
+    }
+}
+
+/*
+ * Run a pending deferred stage from boot_spawn(), first running inline
+ * any deferred stage it depends on that hasn't run yet. Such a stage
+ * may already have a process; that process finds it done and returns.
+ */
+static void boot_inline(int32_t id) {
+    boot_stage_t *st = &boot_stages[id];
+    int32_t i;
+    
+    for (i = 0; i < BOOT_NSTAGES; i++) {
+        if ((st->deps & STAGE_BIT(i)) && (boot_stages[i].flags & BOOT_DEFER) &&
+            boot_stages[i].state == BOOT_PENDING) {
+            boot_inline(i);
+        }
+    }
+    if (!boot_deps_done(st->deps)) {
+        panic("boot: cannot start deferred stage");
+    }
+    
+    boot_exec(id);
+    boot_ndeferred--;
+    if (st->gate != SYSERR) {
+        signal(st->gate);
+    }
+}
+
+/**
+ * boot_spawn - Start a process for each pending deferred stage
+ * 
+ * Called before enable(), so none of them run until scheduling starts.
+ * A stage whose process can't be created runs inline, after the
+ * deferred stages it depends on, which then run inline as well.
+ */
+static void boot_spawn(void) {
+    boot_stage_t *st;
+    pid32 pid;
+    int32_t i;
+    
+    for (i = 0; i < BOOT_NSTAGES; i++) {
+        st = &boot_stages[i];
+        if ((st->flags & BOOT_DEFER) && st->state == BOOT_PENDING) {
+            st->gate = semcreate(0);
+            boot_ndeferred++;
+        }
+    }
+    
+    for (i = 0; i < BOOT_NSTAGES; i++) {
+        st = &boot_stages[i];
+        if (!(st->flags & BOOT_DEFER) || st->state != BOOT_PENDING) {
+            continue;
+        }
+        
+        pid = SYSERR;
+        if (st->gate != SYSERR) {
+            pid = create((void *)boot_stage_process, BOOT_STK, BOOT_PRIO,
+                         (char *)st->name, 1, i);
+        }
+        if (pid != SYSERR) {
+            resume(pid);
+            continue;
+        }
+        
+        boot_inline(i);
+    }
+    
+    if (boot_ndeferred == 0) {
+        boot_end = get_cycles();
+    }
+}
+
+/**
+ * boot_stat - Get the profile of one boot stage
+ * 
+ * @param stage: Stage index, 0 to BOOT_NSTAGES - 1 in boot_report()
+ *               order, or BOOT_STAT_TOTAL / BOOT_STAT_SHELL
+ * @param cycles: Cycles spent in the stage (can be NULL)
+ * @param ticks: Clock ticks spent in the stage (can be NULL)
+ * 
+ * Returns: BOOT_PENDING, BOOT_RUNNING or BOOT_DONE, or SYSERR if stage
+ *          is out of range
+ * 
+ * BOOT_STAT_TOTAL gives the cycles from kernel_main() entry to the end
+ * of the last stage, and BOOT_STAT_SHELL the cycles until the shell
+ * first ran; both report 0 ticks. Stages that ran before clock_init()
+ * report 0 ticks too.
+ */
+syscall boot_stat(int32_t stage, uint64_t *cycles, uint64_t *ticks) {
+    boot_stage_t *st;
+    uint64_t end;
+    
+    if (stage == BOOT_STAT_TOTAL || stage == BOOT_STAT_SHELL) {
+        end = (stage == BOOT_STAT_TOTAL) ? boot_end : boot_shell;
+        if (cycles != NULL) {
+            *cycles = end ? end - boot_start : 0;
+        }
+        if (ticks != NULL) {
+            *ticks = 0;
+        }
+        return end ? BOOT_DONE : BOOT_RUNNING;
+    }
+    if (stage < 0 || stage >= BOOT_NSTAGES) {
+        return SYSERR;
+    }
+    
+    st = &boot_stages[stage];
+    if (cycles != NULL) {
+        *cycles = st->cycles;
+    }
+    if (ticks != NULL) {
+        *ticks = st->ticks;
+    }
+    return st->state;
+}
+
+/**
+ * boot_report - Print the per-stage boot profile
+ */
+void boot_report(void) {
+    static const char *state_name[] = { "pending", "running", "done" };
+    boot_stage_t *st;
+    int32_t i;
+    
+    kprintf("  stage          cycles    ticks  state\n");
+    for (i = 0; i < BOOT_NSTAGES; i++) {
+        st = &boot_stages[i];
+        kprintf("  %-8s %12llu %8llu  %s%s\n", st->name, st->cycles, st->ticks,
+                state_name[st->state],
+                (st->flags & BOOT_DEFER) ? " (deferred)" : "");
+    }
+    kprintf("  %-8s %12llu\n", "to shell", boot_shell ? boot_shell - boot_start : 0);
+    kprintf("  %-8s %12llu\n", "total", boot_end ? boot_end - boot_start : 0);
+}
+
 /*------------------------------------------------------------------------
  * System Process Creation
  *------------------------------------------------------------------------*/
@@ -206,7 +515,12 @@ static void net_init(void) {
  * It should never exit.
  */
 static void idle_process(void) {
+    bool tickless;
+    
     while (1) {
+        /* Stop the periodic tick if dynamic-tick mode allows it */
+        tickless = clock_idle_enter();
+        
         /*
          * x86: hlt instruction (wait for interrupt)
          * ARM: wfi instruction (wait for interrupt)
@@ -221,6 +535,11 @@ static void idle_process(void) {
         #else
         __asm__ volatile("nop");
         #endif
+        
+        /* Any interrupt ends the idle period; fold the skipped ticks */
+        if (tickless) {
+            clock_idle_exit();
+        }
     }
 }
 
@@ -233,15 +552,39 @@ static void init_process(void) {
 
 /* Shell process */
 static void shell_process(void) {
+    if (boot_shell == 0) {
+        boot_shell = get_cycles();
+    }
+    
     while (1) {
         sleep(1000);
     }
 }
 
+/* True if the kernel command line contains the given word */
+static bool boot_option(const char *opt) {
+    const char *p = boot_info.cmdline;
+    size_t len = strlen(opt);
+    
+    while (p != NULL && *p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
+        if (strncmp(p, opt, len) == 0 && (p[len] == ' ' || p[len] == '\0')) {
+            return true;
+        }
+        while (*p != ' ' && *p != '\0') {
+            p++;
+        }
+    }
+    return false;
+}
+
 /* Create initial system processes */
 static void create_system_processes(void) {
     pid32 init_pid;
     pid32 shell_pid;
+    pid32 bench_pid;
     
     init_pid = create((void *)init_process, 4096, 80, "init", 0);
     if (init_pid != SYSERR) {
@@ -253,6 +596,17 @@ static void create_system_processes(void) {
         resume(shell_pid);
     }
     
+    /* Microbenchmarks; priority must match BENCH_PRIO in bench.c */
+    if (BENCH_AT_BOOT || boot_option("bench")) {
+        bench_pid = create((void *)bench_process, 8192, 20, "bench", 0);
+        if (bench_pid != SYSERR) {
+            resume(bench_pid);
+        }
+    }
+    
+    /* Deferred init stages, below the shell's priority */
+    boot_spawn();
+    
     /*
      * Additional system processes could be created here:
      * - Network daemon
@@ -281,6 +635,11 @@ static void print_banner(void) {
      *         boot_info.mem_lower, boot_info.mem_upper);
      * kprintf("========================================\n\n");
      */
+    
+    /* Inline stages so far; deferred ones report when they finish */
+    if (boot_option("boottime")) {
+        boot_report();
+    }
 }
 
 /*------------------------------------------------------------------------
@@ -292,23 +651,27 @@ static void print_banner(void) {
  * 
  * This is the first C function called after the boot assembly code.
  * It performs all system initialization and starts the scheduler.
+ * Stages 7-9 are deferred to kernel processes unless "bootsync" is
+ * given; see boot_run().
  * 
  * This function never returns.
  */
 void kernel_main(void) {
+    boot_start = get_cycles();
+    
     /*
      * Stage 1: Very early initialization
      * - Minimal hardware setup
      * - Clear BSS, set up stack
      */
-    early_init();
+    boot_run(STAGE_EARLY);
     
     /*
      * Stage 2: Architecture-specific initialization
      * - CPU mode setup
      * - Descriptor tables (GDT/IDT on x86)
      */
-    arch_init();
+    boot_run(STAGE_ARCH);
     
     /*
      * Stage 3: Memory initialization
@@ -316,7 +679,7 @@ void kernel_main(void) {
      * - Virtual memory / paging
      * - Heap allocator
      */
-    mem_init();
+    boot_run(STAGE_MEM);
     
     /*
      * Stage 4: Kernel initialization
@@ -324,7 +687,7 @@ void kernel_main(void) {
      * - Semaphore table
      * - System variables
      */
-    kernel_init();
+    boot_run(STAGE_KERNEL);
     
     /*
      * Stage 5: Interrupt initialization
@@ -332,14 +695,14 @@ void kernel_main(void) {
      * - Exception handlers
      * - Interrupt handlers
      */
-    intr_init();
+    boot_run(STAGE_INTR);
     
     /*
      * Stage 6: Clock initialization
      * - System timer
      * - Clock interrupt handler
      */
-    clock_init();
+    boot_run(STAGE_CLOCK);
     
     /*
      * Stage 7: Device initialization
@@ -347,26 +710,26 @@ void kernel_main(void) {
      * - Disk
      * - Other hardware
      */
-    dev_init();
+    boot_run(STAGE_DEV);
     
     /*
      * Stage 8: File system initialization
      * - VFS layer
      * - Root mount
      */
-    fs_init();
+    boot_run(STAGE_FS);
     
     /*
      * Stage 9: Network initialization
      * - Protocol stack
      * - Network interfaces
      */
-    net_init();
+    boot_run(STAGE_NET);
     
     /*
      * Stage 10: Scheduler initialization
      */
-    scheduler_init(SCHED_PRIORITY);
+    boot_run(STAGE_SCHED);
     
     /* Print startup banner */
     print_banner();
@@ -376,8 +739,9 @@ void kernel_main(void) {
      * - Init (PID 1)
      * - Shell
      * - System daemons
+     * - Deferred init stages
      */
-    create_system_processes();
+    boot_run(STAGE_PROCS);
     
     /*
      * Stage 12: Enable interrupts and start scheduling
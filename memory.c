@@ -4,10 +4,19 @@
 #include "../include/memory.h"
 #include "../include/process.h"
 #include "../include/interrupts.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdbool.h>
 
+#if defined(MEM_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define MEM_SIMD_SSE2
+#elif defined(MEM_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MEM_SIMD_NEON
+#endif
+
 extern char _heap_start;
 extern char _heap_end;
 extern char _stack_start;
@@ -31,6 +40,12 @@ static struct {
     uint32_t    mtotal;
     uint32_t    mallocs;
     uint32_t    frees;
+    char        *mbase;     /* Heap bounds, for header checks */
+    char        *mlimit;
+    uint32_t    nblocks;    /* Blocks on the free list */
+    uint32_t    largest;    /* Largest free-list block, if largest_ok */
+    bool        largest_ok;
+    uint32_t    gen;        /* Bumped on every free-list change */
 } memlist;
 
 static struct {
@@ -44,11 +59,150 @@ static struct {
 #define ROUNDDOWN(x, align) ((x) & ~((align) - 1))
 #define MEM_ALIGNMENT       8
 
-/* Initialize heap */
+/*
+ * Recently freed stacks are kept per exact length so a create/kill
+ * cycle with the same stack size skips the first-fit walk and the
+ * sorted insert. A slot is rebound to a new length once it empties.
+ */
+#define NSTKCACHE           8
+#define STKCACHE_DEPTH      4
+
+static struct {
+    uint32_t    length;     /* Block length cached here, 0 if unbound */
+    memblk_t    *mhead;
+    uint32_t    ncached;
+    uint32_t    hits;
+} stkcache[NSTKCACHE];
+
+/*
+ * Size classes for small requests. Blocks of a class keep their header
+ * and are recycled through a per-class LIFO instead of going back to the
+ * address-ordered free list, so small getmem/freemem pairs are O(1).
+ */
+#define NMEMCLASS           5
+#define MEMCLASS_MIN        16
+#define MEMCLASS_MAX        (MEMCLASS_MIN << (NMEMCLASS - 1))
+#define MEMCLASS_LEN(c)     ROUNDUP((MEMCLASS_MIN << (c)) + sizeof(memblk_t), \
+                                    MEM_ALIGNMENT)
+
+static struct {
+    memblk_t    *mhead;     /* Cached free blocks of this class */
+    uint32_t    ncached;    /* Blocks currently cached */
+    uint32_t    hits;       /* Allocations served from the cache */
+    uint32_t    misses;     /* Allocations carved from the free list */
+    uint32_t    frees;      /* Blocks returned to the cache */
+} memclass[NMEMCLASS];
+
+/*
+ * Buddy region for getbuf(). Blocks are powers of two from
+ * BUDDY_MINBLK to BUDDY_MAXBLK, and the region base is aligned to
+ * BUDDY_MAXBLK, so every block is naturally aligned to its own size and
+ * an aligned request needs no padding and no header. Free blocks carry
+ * their list links inline; buddy_order[] records, per minimum-size
+ * unit, the order of a free block starting there, or BUDDY_TAKEN plus
+ * the order of an allocated one (0 if neither). A merge tests the
+ * buddy's entry against the bare order, and freebuf() requires the
+ * tagged one, so a double free or a size that does not match the
+ * allocation is refused even after the block has been merged away.
+ *
+ * The region is set up by buddyinit(). mem_init_default() hands it a
+ * static arena of MEM_BUDDY_SIZE bytes; building with MEM_BUDDY_SIZE=0
+ * leaves getbuf() on the over-allocating getmem() path.
+ */
+#define BUDDY_MIN_ORDER     5                       /* 32 bytes */
+#define BUDDY_MAX_ORDER     14                      /* 16 KiB */
+#define BUDDY_NORDERS       (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_MINBLK        (1u << BUDDY_MIN_ORDER)
+#define BUDDY_MAXBLK        (1u << BUDDY_MAX_ORDER)
+#define BUDDY_TAKEN         0x80                    /* buddy_order[] tag */
+
+#ifndef MEM_BUDDY_SIZE
+#define MEM_BUDDY_SIZE      (32 * 1024)
+#endif
+#define BUDDY_MAXUNITS      ((MEM_BUDDY_SIZE + BUDDY_MAXBLK) / BUDDY_MINBLK)
+
+typedef struct buddyblk {
+    struct buddyblk *next;
+    struct buddyblk *prev;
+} buddyblk_t;
+
+#if MEM_BUDDY_SIZE > 0
+static char buddy_memory[MEM_BUDDY_SIZE] __attribute__((aligned(BUDDY_MAXBLK)));
+#endif
+
+static struct {
+    char        *base;                      /* Aligned to BUDDY_MAXBLK */
+    uint32_t    size;                       /* Whole top-level blocks only */
+    buddyblk_t  *freeq[BUDDY_NORDERS];      /* Indexed by order - min */
+    uint32_t    nfree[BUDDY_NORDERS];
+    uint32_t    allocs;
+    uint32_t    fails;
+    uint32_t    splits;
+    uint32_t    merges;
+} buddy;
+
+static uint8_t buddy_order[BUDDY_MAXUNITS];
+
+/*
+ * Allocation profile, kept up to date by getmem() and freemem() so that
+ * reading it never walks the heap. Live allocations are counted by
+ * block length (header included) in power-of-two buckets from 16 bytes
+ * up, and by call site: the caller's return address is hashed into a
+ * small table and the slot is stored in the block's link word, which is
+ * unused while the block is allocated. The tag also lets freemem()
+ * reject pointers that getmem() did not hand out, and double frees.
+ */
+#define MEMPROF_NBUCKETS    12
+#define MEMPROF_NSITES      32
+#define MEMPROF_PROBE       4
+#define MEMPROF_OTHER       (MEMPROF_NSITES - 1)    /* Overflow slot */
+
+#define MEMTAG_MAGIC        ((uintptr_t)0xA1100000)
+#define MEMTAG_MASK         ((uintptr_t)0xFFFFFF00)
+#define MEMTAG(site)        ((memblk_t *)(MEMTAG_MAGIC | (uintptr_t)(site)))
+#define MEMTAG_OK(blk)      (((uintptr_t)(blk)->mnext & MEMTAG_MASK) == MEMTAG_MAGIC)
+#define MEMTAG_SITE(blk)    ((uint32_t)((uintptr_t)(blk)->mnext & 0xFF))
+
+static struct {
+    uint32_t    live_bytes;
+    uint32_t    live_blocks;
+    uint32_t    peak_bytes;
+    uint32_t    failed;                 /* getmem() returning SYSERR */
+    uint32_t    badfree;                /* freemem() of an untagged block */
+    uint32_t    hist[MEMPROF_NBUCKETS]; /* Live blocks by size bucket */
+} memprof;
+
+static struct {
+    uintptr_t   pc;                     /* First caller seen in this slot */
+    uint32_t    allocs;
+    uint32_t    live_bytes;
+} memsite[MEMPROF_NSITES];
+
+/* Resumable position of memvalidate_step() in the free list */
+static struct {
+    memblk_t    *prev;
+    memblk_t    *curr;
+    uint32_t    gen;
+    uint32_t    passes;                 /* Complete passes without error */
+} memcheck;
+
+/*
+ * Block copy and fill work a machine word at a time once the
+ * destination is aligned. MEM_SIMD adds a 16-byte SSE2 or NEON inner
+ * loop; it is a build option because the kernel only uses it when the
+ * context switch saves vector registers.
+ */
+typedef uintptr_t __attribute__((__may_alias__)) memword_t;
+
+#define MEMWORD         sizeof(memword_t)
+#define MEMWORD_MASK    (MEMWORD - 1)
+#define MEM_ALIGNED(a, b)   ((((uintptr_t)(a) ^ (uintptr_t)(b)) & MEMWORD_MASK) == 0)
+
 /* Initialize heap */
 syscall meminit(void *heapstart, void *heapend) {
     memblk_t *block;
     uint32_t heapsize;
+    int i;
     
     if (heapstart == NULL || heapend == NULL || heapstart >= heapend) {
         return SYSERR;
@@ -72,6 +226,27 @@ syscall meminit(void *heapstart, void *heapend) {
     memlist.mtotal = heapsize;
     memlist.mallocs = 0;
     memlist.frees = 0;
+    memlist.mbase = (char *)heapstart;
+    memlist.mlimit = (char *)heapend;
+    memlist.nblocks = 1;
+    memlist.largest = heapsize;
+    memlist.largest_ok = true;
+    memlist.gen = 0;
+    
+    memset(&memprof, 0, sizeof(memprof));
+    memset(memsite, 0, sizeof(memsite));
+    memcheck.prev = NULL;
+    memcheck.curr = NULL;
+    memcheck.gen = 0;
+    memcheck.passes = 0;
+    
+    for (i = 0; i < NMEMCLASS; i++) {
+        memclass[i].mhead = NULL;
+        memclass[i].ncached = 0;
+        memclass[i].hits = 0;
+        memclass[i].misses = 0;
+        memclass[i].frees = 0;
+    }
     
     return OK;
 }
@@ -80,6 +255,7 @@ syscall meminit(void *heapstart, void *heapend) {
 syscall stkinit(void *stkstart, void *stkend) {
     memblk_t *block;
     uint32_t stksize;
+    int i;
     
     if (stkstart == NULL || stkend == NULL || stkstart >= stkend) {
         return SYSERR;
@@ -102,9 +278,18 @@ syscall stkinit(void *stkstart, void *stkend) {
     stkpool.mfree = stksize;
     stkpool.mtotal = stksize;
     
+    for (i = 0; i < NSTKCACHE; i++) {
+        stkcache[i].length = 0;
+        stkcache[i].mhead = NULL;
+        stkcache[i].ncached = 0;
+        stkcache[i].hits = 0;
+    }
+    
     return OK;
 }
 
+syscall buddyinit(void *start, void *end);
+
 /* Initialize with default memory regions */
 void mem_init_default(void) {
 #ifndef __LINKER_DEFINED_HEAP__
@@ -114,27 +299,55 @@ void mem_init_default(void) {
     meminit(&_heap_start, &_heap_end);
     stkinit(&_stack_start, &_stack_end);
 #endif
+#if MEM_BUDDY_SIZE > 0
+    buddyinit(buddy_memory, buddy_memory + MEM_BUDDY_SIZE);
+#endif
 }
 
-/* Allocate heap memory (first-fit) */
-void *getmem(uint32_t nbytes) {
-    intmask mask;
-    memblk_t *prev, *curr, *leftover;
-    uint32_t length;
+/* Map a request size to its size class, or -1 for large requests */
+static int memclass_of(uint32_t nbytes) {
+    int c;
     
-    if (nbytes == 0) {
-        return (void *)SYSERR;
+    if (nbytes > MEMCLASS_MAX) {
+        return -1;
     }
     
-    length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
+    for (c = 0; c < NMEMCLASS; c++) {
+        if (nbytes <= ((uint32_t)MEMCLASS_MIN << c)) {
+            return c;
+        }
+    }
     
-    mask = disable();
+    return -1;
+}
+
+/* Map a block length back to its size class, or -1 if not a class block */
+static int memclass_of_len(uint32_t length) {
+    int c;
+    
+    for (c = 0; c < NMEMCLASS; c++) {
+        if (length == MEMCLASS_LEN(c)) {
+            return c;
+        }
+    }
+    
+    return -1;
+}
+
+/* First-fit carve from the free list (interrupts must be disabled) */
+static memblk_t *memlist_alloc(uint32_t length) {
+    memblk_t *prev, *curr, *leftover;
     
     prev = NULL;
     curr = memlist.mhead;
     
     while (curr != NULL) {
         if (curr->mlength >= length) {
+            memlist.gen++;
+            if (curr->mlength == memlist.largest) {
+                memlist.largest_ok = false;     /* Recomputed on demand */
+            }
+            
             if (curr->mlength >= length + MIN_BLOCK_SIZE) {
                 leftover = (memblk_t *)((char *)curr + length);
                 leftover->mnext = curr->mnext;
@@ -154,55 +367,25 @@ void *getmem(uint32_t nbytes) {
                 } else {
                     memlist.mhead = curr->mnext;
                 }
+                memlist.nblocks--;
             }
             
             memlist.mfree -= curr->mlength;
-            memlist.mallocs++;
-            
-            restore(mask);
-            
-            /* Return pointer past header */
-            return (void *)((char *)curr + sizeof(memblk_t));
+            return curr;
         }
         
         prev = curr;
         curr = curr->mnext;
     }
     
-    restore(mask);
-    return (void *)SYSERR;  /* No suitable block found */
+    return NULL;
 }
 
-/**
- * freemem - Free previously allocated heap memory
- * 
- * @param block: Pointer to memory block (from getmem)
- * @param nbytes: Number of bytes to free (must match allocation)
- * 
- * Returns: OK on success, SYSERR on error
- * 
- * Coalesces adjacent free blocks.
- */
-syscall freemem(void *block, uint32_t nbytes) {
-    intmask mask;
-    memblk_t *blk, *prev, *curr, *next;
-    uint32_t length;
-    
-    if (block == NULL || nbytes == 0) {
-        return SYSERR;
-    }
-    
-    /* Get block header */
-    blk = (memblk_t *)((char *)block - sizeof(memblk_t));
-    length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
-    
-    /* Validate block length matches */
-    if (blk->mlength != length) {
-        /* Size mismatch - use stored size */
-        length = blk->mlength;
-    }
-    
-    mask = disable();
+/* Insert into the free list in address order and coalesce (ints disabled) */
+static void memlist_insert(memblk_t *blk) {
+    memblk_t *prev, *curr, *next;
+    uint32_t length = blk->mlength;
+    memblk_t *merged = blk;
     
     /* Find insertion point (maintain sorted order by address) */
     prev = NULL;
@@ -223,26 +406,389 @@ syscall freemem(void *block, uint32_t nbytes) {
         prev->mnext = blk;
     }
     
+    memlist.nblocks++;
+    memlist.gen++;
+    
     /* Try to coalesce with next block */
     next = blk->mnext;
     if (next != NULL && (char *)blk + blk->mlength == (char *)next) {
         blk->mlength += next->mlength;
         blk->mnext = next->mnext;
+        memlist.nblocks--;
     }
     
     /* Try to coalesce with previous block */
     if (prev != NULL && (char *)prev + prev->mlength == (char *)blk) {
         prev->mlength += blk->mlength;
         prev->mnext = blk->mnext;
+        memlist.nblocks--;
+        merged = prev;
+    }
+    
+    if (memlist.largest_ok && merged->mlength > memlist.largest) {
+        memlist.largest = merged->mlength;
     }
     
     memlist.mfree += length;
+}
+
+/* Size bucket of a block length for the allocation histogram */
+static int memprof_bucket(uint32_t length) {
+    int b = 0;
+    
+    if (length > MEMCLASS_MIN) {
+        b = (32 - __builtin_clz(length - 1)) - 4;     /* ceil(log2) - 4 */
+    }
+    return (b < MEMPROF_NBUCKETS) ? b : MEMPROF_NBUCKETS - 1;
+}
+
+/* Find or claim the site slot for a caller address */
+static uint32_t memprof_site(uintptr_t pc) {
+    uint32_t h = (uint32_t)(pc >> 2) * 2654435761u;
+    uint32_t i, slot;
+    
+    for (i = 0; i < MEMPROF_PROBE; i++) {
+        slot = (h + i) % MEMPROF_OTHER;
+        if (memsite[slot].pc == pc) {
+            return slot;
+        }
+        if (memsite[slot].pc == 0) {
+            memsite[slot].pc = pc;
+            return slot;
+        }
+    }
+    return MEMPROF_OTHER;
+}
+
+/* Account for a block handed out by getmem() (ints disabled) */
+static void memprof_alloc(memblk_t *blk, uintptr_t pc) {
+    uint32_t site = memprof_site(pc);
+    
+    blk->mnext = MEMTAG(site);
+    memsite[site].allocs++;
+    memsite[site].live_bytes += blk->mlength;
+    
+    memprof.hist[memprof_bucket(blk->mlength)]++;
+    memprof.live_blocks++;
+    memprof.live_bytes += blk->mlength;
+    if (memprof.live_bytes > memprof.peak_bytes) {
+        memprof.peak_bytes = memprof.live_bytes;
+    }
+}
+
+/* Account for a block coming back through freemem() (ints disabled) */
+static void memprof_free(memblk_t *blk) {
+    memsite[MEMTAG_SITE(blk)].live_bytes -= blk->mlength;
+    memprof.hist[memprof_bucket(blk->mlength)]--;
+    memprof.live_blocks--;
+    memprof.live_bytes -= blk->mlength;
+}
+
+/* Return all cached class blocks to the free list (ints disabled) */
+static void memclass_drain(void) {
+    memblk_t *blk;
+    int c;
+    
+    for (c = 0; c < NMEMCLASS; c++) {
+        while ((blk = memclass[c].mhead) != NULL) {
+            memclass[c].mhead = blk->mnext;
+            memclass[c].ncached--;
+            memlist.mfree -= blk->mlength;
+            memlist_insert(blk);
+        }
+    }
+}
+
+/* Allocate heap memory (size-class cache, then first-fit) */
+void *getmem(uint32_t nbytes) {
+    intmask mask;
+    memblk_t *blk;
+    uint32_t length;
+    int c;
+    uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+    
+    if (nbytes == 0) {
+        return (void *)SYSERR;
+    }
+    
+    c = memclass_of(nbytes);
+    if (c >= 0) {
+        length = MEMCLASS_LEN(c);
+    } else {
+        length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
+    }
+    
+    mask = disable();
+    
+    if (c >= 0 && memclass[c].mhead != NULL) {
+        /* Fast path: pop a cached block of this class */
+        blk = memclass[c].mhead;
+        memclass[c].mhead = blk->mnext;
+        memclass[c].ncached--;
+        memclass[c].hits++;
+        memlist.mfree -= blk->mlength;
+    } else {
+        if (c >= 0) {
+            memclass[c].misses++;
+        }
+        
+        blk = memlist_alloc(length);
+        if (blk == NULL) {
+            /* Cached small blocks may be hiding a usable region */
+            memclass_drain();
+            blk = memlist_alloc(length);
+        }
+        
+        if (blk == NULL) {
+            memprof.failed++;
+            restore(mask);
+            return (void *)SYSERR;  /* No suitable block found */
+        }
+    }
+    
+    memlist.mallocs++;
+    memprof_alloc(blk, pc);
+    
+    restore(mask);
+    
+    TRACE(TRACE_GETMEM, nbytes, (uintptr_t)blk + sizeof(memblk_t));
+    
+    /* Return pointer past header */
+    return (void *)((char *)blk + sizeof(memblk_t));
+}
+
+/**
+ * freemem - Free previously allocated heap memory
+ * 
+ * @param block: Pointer to memory block (from getmem)
+ * @param nbytes: Number of bytes to free (must match allocation)
+ * 
+ * Returns: OK on success, SYSERR on error
+ * 
+ * Blocks of a size class go back to that class's cache; everything
+ * else is returned to the free list and coalesced with its neighbours.
+ */
+syscall freemem(void *block, uint32_t nbytes) {
+    intmask mask;
+    memblk_t *blk;
+    int c;
+    
+    if (block == NULL || nbytes == 0) {
+        return SYSERR;
+    }
+    
+    /* Get block header; the stored length is authoritative */
+    blk = (memblk_t *)((char *)block - sizeof(memblk_t));
+    TRACE(TRACE_FREEMEM, (uintptr_t)block, nbytes);
+    
+    mask = disable();
+    
+    if (!MEMTAG_OK(blk)) {
+        /* Not from getmem(), or already freed */
+        memprof.badfree++;
+        restore(mask);
+        return SYSERR;
+    }
+    memprof_free(blk);
+    
+    c = memclass_of_len(blk->mlength);
+    if (c >= 0) {
+        blk->mnext = memclass[c].mhead;
+        memclass[c].mhead = blk;
+        memclass[c].ncached++;
+        memclass[c].frees++;
+        memlist.mfree += blk->mlength;
+    } else {
+        memlist_insert(blk);
+    }
+    
     memlist.frees++;
     
     restore(mask);
     return OK;
 }
 
+/*------------------------------------------------------------------------
+ * Buddy Allocator
+ *------------------------------------------------------------------------*/
+
+#define BUDDY_UNIT(blk)     ((uint32_t)(((char *)(blk) - buddy.base) >> BUDDY_MIN_ORDER))
+
+/* Push a free block of the given order (ints disabled) */
+static void buddy_push(buddyblk_t *blk, int order) {
+    int i = order - BUDDY_MIN_ORDER;
+    
+    blk->prev = NULL;
+    blk->next = buddy.freeq[i];
+    if (blk->next != NULL) {
+        blk->next->prev = blk;
+    }
+    buddy.freeq[i] = blk;
+    buddy.nfree[i]++;
+    buddy_order[BUDDY_UNIT(blk)] = (uint8_t)order;
+}
+
+/* Unlink a free block of the given order (ints disabled) */
+static void buddy_unlink(buddyblk_t *blk, int order) {
+    int i = order - BUDDY_MIN_ORDER;
+    
+    if (blk->prev != NULL) {
+        blk->prev->next = blk->next;
+    } else {
+        buddy.freeq[i] = blk->next;
+    }
+    if (blk->next != NULL) {
+        blk->next->prev = blk->prev;
+    }
+    buddy.nfree[i]--;
+    buddy_order[BUDDY_UNIT(blk)] = 0;
+}
+
+/* Order of the block that serves nbytes at the given alignment, or -1 */
+static int buddy_order_of(uint32_t nbytes, uint32_t align) {
+    uint32_t size = (nbytes > align) ? nbytes : align;
+    int order;
+    
+    if (size > BUDDY_MAXBLK) {
+        return -1;
+    }
+    if (size <= BUDDY_MINBLK) {
+        return BUDDY_MIN_ORDER;
+    }
+    order = 32 - __builtin_clz(size - 1);       /* ceil(log2(size)) */
+    return order;
+}
+
+/* True if ptr lies in the buddy region */
+static bool buddy_owns(void *ptr) {
+    return buddy.size != 0 && (char *)ptr >= buddy.base &&
+           (char *)ptr < buddy.base + buddy.size;
+}
+
+/**
+ * buddyinit - Set up the buddy region used by getbuf()
+ * 
+ * @param start: Start of the region
+ * @param end: End of the region
+ * 
+ * Returns: OK on success, SYSERR if no whole top-level block fits
+ * 
+ * The region is trimmed to a run of BUDDY_MAXBLK-aligned top-level
+ * blocks. Any blocks handed out from a previous region must be freed
+ * before calling this again.
+ */
+syscall buddyinit(void *start, void *end) {
+    intmask mask;
+    char *base;
+    uint32_t size, off;
+    int i;
+    
+    if (start == NULL || end == NULL || start >= end) {
+        return SYSERR;
+    }
+    
+    base = (char *)ROUNDUP((uintptr_t)start, (uintptr_t)BUDDY_MAXBLK);
+    if (base >= (char *)end) {
+        return SYSERR;
+    }
+    size = ROUNDDOWN((uint32_t)((char *)end - base), BUDDY_MAXBLK);
+    if (size > (uint32_t)BUDDY_MAXUNITS * BUDDY_MINBLK) {
+        size = ROUNDDOWN((uint32_t)BUDDY_MAXUNITS * BUDDY_MINBLK, BUDDY_MAXBLK);
+    }
+    if (size == 0) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    buddy.base = base;
+    buddy.size = size;
+    buddy.allocs = 0;
+    buddy.fails = 0;
+    buddy.splits = 0;
+    buddy.merges = 0;
+    for (i = 0; i < BUDDY_NORDERS; i++) {
+        buddy.freeq[i] = NULL;
+        buddy.nfree[i] = 0;
+    }
+    memset(buddy_order, 0, sizeof(buddy_order));
+    
+    for (off = 0; off < size; off += BUDDY_MAXBLK) {
+        buddy_push((buddyblk_t *)(base + off), BUDDY_MAX_ORDER);
+    }
+    
+    restore(mask);
+    return OK;
+}
+
+/* Take a block of the given order, splitting larger ones (ints disabled) */
+static void *buddy_alloc(int order) {
+    buddyblk_t *blk;
+    int o;
+    
+    for (o = order; o <= BUDDY_MAX_ORDER; o++) {
+        if (buddy.freeq[o - BUDDY_MIN_ORDER] != NULL) {
+            break;
+        }
+    }
+    if (o > BUDDY_MAX_ORDER) {
+        buddy.fails++;
+        return NULL;
+    }
+    
+    blk = buddy.freeq[o - BUDDY_MIN_ORDER];
+    buddy_unlink(blk, o);
+    
+    /* Hand the upper halves back until the block is the right size */
+    while (o > order) {
+        o--;
+        buddy_push((buddyblk_t *)((char *)blk + (1u << o)), o);
+        buddy.splits++;
+    }
+    
+    buddy_order[BUDDY_UNIT(blk)] = (uint8_t)(BUDDY_TAKEN | order);
+    buddy.allocs++;
+    return blk;
+}
+
+/* Return a block, merging with free buddies (ints disabled) */
+static void buddy_free(void *ptr, int order) {
+    char *blk = (char *)ptr;
+    char *mate;
+    uint32_t off;
+    
+    buddy_order[BUDDY_UNIT(blk)] = 0;
+    while (order < BUDDY_MAX_ORDER) {
+        off = (uint32_t)(blk - buddy.base);
+        mate = buddy.base + (off ^ (1u << order));
+        if (buddy_order[BUDDY_UNIT(mate)] != order) {
+            break;
+        }
+        buddy_unlink((buddyblk_t *)mate, order);
+        if (mate < blk) {
+            blk = mate;
+        }
+        order++;
+        buddy.merges++;
+    }
+    
+    buddy_push((buddyblk_t *)blk, order);
+}
+
+/**
+ * buddyinfo - Free blocks of one order in the buddy region
+ * 
+ * @param order: Block order (log2 of the size in bytes)
+ * 
+ * Returns: Number of free blocks, or SYSERR for an order out of range
+ */
+int32_t buddyinfo(int32_t order) {
+    if (order < BUDDY_MIN_ORDER || order > BUDDY_MAX_ORDER) {
+        return SYSERR;
+    }
+    return (int32_t)buddy.nfree[order - BUDDY_MIN_ORDER];
+}
+
 /**
  * getbuf - Allocate aligned buffer memory
  * 
@@ -250,15 +796,31 @@ syscall freemem(void *block, uint32_t nbytes) {
  * @param align: Required alignment (must be power of 2)
  * 
  * Returns: Aligned pointer, or NULL on error
+ * 
+ * Served from the buddy region when it is set up and can hold the
+ * request; otherwise over-allocated from the heap and adjusted.
  */
 void *getbuf(uint32_t nbytes, uint32_t align) {
     void *ptr, *aligned;
     uint32_t extra;
+    intmask mask;
+    int order;
     
     if (nbytes == 0 || align == 0 || (align & (align - 1)) != 0) {
         return NULL;
     }
     
+    /* Buddy blocks are aligned to their size; no padding needed */
+    order = buddy_order_of(nbytes, align);
+    if (buddy.size != 0 && order >= 0) {
+        mask = disable();
+        ptr = buddy_alloc(order);
+        restore(mask);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    
     /* Allocate extra space for alignment */
     extra = align + sizeof(void *);
     ptr = getmem(nbytes + extra);
@@ -268,7 +830,7 @@ void *getbuf(uint32_t nbytes, uint32_t align) {
     }
     
     /* Align the pointer */
-    aligned = (void *)ROUNDUP((uintptr_t)ptr + sizeof(void *), align);
+    aligned = (void *)ROUNDUP((uintptr_t)ptr + sizeof(void *), (uintptr_t)align);
     
     /* Store original pointer before aligned address */
     *((void **)aligned - 1) = ptr;
@@ -288,11 +850,30 @@ void *getbuf(uint32_t nbytes, uint32_t align) {
 syscall freebuf(void *buf, uint32_t nbytes, uint32_t align) {
     void *ptr;
     uint32_t extra;
+    intmask mask;
+    int order;
     
     if (buf == NULL) {
         return SYSERR;
     }
     
+    if (buddy_owns(buf)) {
+        order = buddy_order_of(nbytes, align);
+        if (order < 0 ||
+            ((uint32_t)((char *)buf - buddy.base) & ((1u << order) - 1)) != 0) {
+            return SYSERR;
+        }
+        
+        mask = disable();
+        if (buddy_order[BUDDY_UNIT(buf)] != (uint8_t)(BUDDY_TAKEN | order)) {
+            restore(mask);
+            return SYSERR;              /* Free, or not this size */
+        }
+        buddy_free(buf, order);
+        restore(mask);
+        return OK;
+    }
+    
     /* Retrieve original pointer */
     ptr = *((void **)buf - 1);
     extra = align + sizeof(void *);
@@ -301,33 +882,278 @@ syscall freebuf(void *buf, uint32_t nbytes, uint32_t align) {
 }
 
 /*------------------------------------------------------------------------
- * Stack Memory Allocation
+ * Buffer Pools
  *------------------------------------------------------------------------*/
 
+/*
+ * A pool is a run of equal-sized buffers carved from the heap in one
+ * getmem() and threaded on an intrusive free list. Each buffer carries
+ * a small header naming its pool, so poolfree() needs only the pointer.
+ * A counting semaphore tracks free buffers for the blocking poolget().
+ */
+#define NPOOLS          16
+#define POOL_MAXBUFS    1024
+#define POOL_INUSE      ((poolbuf_t *)1)    /* Header link of a taken buffer */
+
+typedef struct poolbuf {
+    struct poolbuf  *next;      /* Free list link, or POOL_INUSE */
+    int32_t         poolid;
+} poolbuf_t;
+
+#define POOL_HDRSIZE    ROUNDUP(sizeof(poolbuf_t), MEM_ALIGNMENT)
+
+static struct {
+    bool        used;
+    char        *base;          /* Start of the carved region */
+    uint32_t    regionsize;
+    uint32_t    bufsize;        /* Usable bytes per buffer */
+    uint32_t    nbufs;
+    uint32_t    nfree;
+    uint32_t    minfree;        /* Low-water mark of nfree */
+    uint32_t    gets;
+    uint32_t    fails;          /* Non-blocking gets that found it empty */
+    poolbuf_t   *freelist;
+    sid32       sem;
+} pooltab[NPOOLS];
+
+extern sid32 semcreate(int32_t count);
+extern syscall semdelete(sid32 sem);
+extern syscall wait(sid32 sem);
+extern syscall signal(sid32 sem);
+extern syscall trywait(sid32 sem);
+
 /**
- * getstk - Allocate stack memory from stack pool
+ * poolcreate - Create a pool of fixed-size buffers
  * 
- * @param nbytes: Stack size in bytes
+ * @param bufsize: Bytes per buffer
+ * @param nbufs: Number of buffers
  * 
- * Returns: Pointer to TOP of stack (highest address), or SYSERR
+ * Returns: Pool ID, or SYSERR on error
+ */
+int32_t poolcreate(uint32_t bufsize, uint32_t nbufs) {
+    intmask mask;
+    int32_t poolid;
+    uint32_t stride, i;
+    char *region;
+    poolbuf_t *buf;
+    sid32 sem;
+    
+    if (bufsize == 0 || nbufs == 0 || nbufs > POOL_MAXBUFS) {
+        return SYSERR;
+    }
+    
+    /* Neither the rounding nor stride * nbufs may wrap */
+    if (bufsize > UINT32_MAX / nbufs - POOL_HDRSIZE - (MEM_ALIGNMENT - 1)) {
+        return SYSERR;
+    }
+    
+    bufsize = ROUNDUP(bufsize, MEM_ALIGNMENT);
+    stride = POOL_HDRSIZE + bufsize;
+    
+    mask = disable();
+    
+    for (poolid = 0; poolid < NPOOLS; poolid++) {
+        if (!pooltab[poolid].used) {
+            break;
+        }
+    }
+    if (poolid == NPOOLS) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    region = (char *)getmem(stride * nbufs);
+    if (region == (char *)SYSERR) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    sem = semcreate(nbufs);
+    if (sem == SYSERR) {
+        freemem(region, stride * nbufs);
+        restore(mask);
+        return SYSERR;
+    }
+    
+    /* Thread buffers in address order */
+    pooltab[poolid].freelist = NULL;
+    for (i = nbufs; i > 0; i--) {
+        buf = (poolbuf_t *)(region + (i - 1) * stride);
+        buf->poolid = poolid;
+        buf->next = pooltab[poolid].freelist;
+        pooltab[poolid].freelist = buf;
+    }
+    
+    pooltab[poolid].used = true;
+    pooltab[poolid].base = region;
+    pooltab[poolid].regionsize = stride * nbufs;
+    pooltab[poolid].bufsize = bufsize;
+    pooltab[poolid].nbufs = nbufs;
+    pooltab[poolid].nfree = nbufs;
+    pooltab[poolid].minfree = nbufs;
+    pooltab[poolid].gets = 0;
+    pooltab[poolid].fails = 0;
+    pooltab[poolid].sem = sem;
+    
+    restore(mask);
+    return poolid;
+}
+
+/* Pop a buffer; caller holds a unit of the pool semaphore */
+static void *pool_take(int32_t poolid) {
+    intmask mask = disable();
+    poolbuf_t *buf = pooltab[poolid].freelist;
+    
+    pooltab[poolid].freelist = buf->next;
+    buf->next = POOL_INUSE;
+    pooltab[poolid].nfree--;
+    pooltab[poolid].gets++;
+    if (pooltab[poolid].nfree < pooltab[poolid].minfree) {
+        pooltab[poolid].minfree = pooltab[poolid].nfree;
+    }
+    
+    restore(mask);
+    return (char *)buf + POOL_HDRSIZE;
+}
+
+/**
+ * poolget - Take a buffer from a pool, blocking while it is empty
  * 
- * Note: Stacks grow downward, so we return the high address.
+ * @param poolid: Pool ID
+ * 
+ * Returns: Buffer pointer, or NULL on error
  */
-void *getstk(uint32_t nbytes) {
+void *poolget(int32_t poolid) {
+    if (poolid < 0 || poolid >= NPOOLS || !pooltab[poolid].used) {
+        return NULL;
+    }
+    
+    if (wait(pooltab[poolid].sem) != OK) {
+        return NULL;    /* Pool deleted while waiting */
+    }
+    
+    return pool_take(poolid);
+}
+
+/**
+ * poolget_nb - Take a buffer from a pool without blocking
+ * 
+ * @param poolid: Pool ID
+ * 
+ * Returns: Buffer pointer, or NULL if the pool is empty or invalid
+ */
+void *poolget_nb(int32_t poolid) {
+    if (poolid < 0 || poolid >= NPOOLS || !pooltab[poolid].used) {
+        return NULL;
+    }
+    
+    if (trywait(pooltab[poolid].sem) != OK) {
+        pooltab[poolid].fails++;
+        return NULL;
+    }
+    
+    return pool_take(poolid);
+}
+
+/**
+ * poolfree - Return a buffer to the pool it came from
+ * 
+ * @param ptr: Buffer from poolget()
+ * 
+ * Returns: OK on success, SYSERR on a bad or already-free buffer
+ */
+syscall poolfree(void *ptr) {
     intmask mask;
-    memblk_t *prev, *curr, *leftover;
-    uint32_t length;
-    void *stktop;
+    poolbuf_t *buf;
+    int32_t poolid;
     
-    if (nbytes == 0) {
-        return (void *)SYSERR;
+    if (ptr == NULL) {
+        return SYSERR;
     }
     
-    length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
+    buf = (poolbuf_t *)((char *)ptr - POOL_HDRSIZE);
     
     mask = disable();
     
-    /* First-fit search */
+    poolid = buf->poolid;
+    if (poolid < 0 || poolid >= NPOOLS || !pooltab[poolid].used ||
+        (char *)buf < pooltab[poolid].base ||
+        (char *)buf >= pooltab[poolid].base + pooltab[poolid].regionsize ||
+        buf->next != POOL_INUSE) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    buf->next = pooltab[poolid].freelist;
+    pooltab[poolid].freelist = buf;
+    pooltab[poolid].nfree++;
+    
+    restore(mask);
+    
+    signal(pooltab[poolid].sem);
+    return OK;
+}
+
+/**
+ * pooldelete - Delete a pool and return its memory to the heap
+ * 
+ * @param poolid: Pool ID
+ * 
+ * Returns: OK on success, SYSERR if invalid or buffers are outstanding
+ */
+syscall pooldelete(int32_t poolid) {
+    intmask mask;
+    
+    if (poolid < 0 || poolid >= NPOOLS) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (!pooltab[poolid].used ||
+        pooltab[poolid].nfree != pooltab[poolid].nbufs) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    pooltab[poolid].used = false;
+    semdelete(pooltab[poolid].sem);
+    freemem(pooltab[poolid].base, pooltab[poolid].regionsize);
+    
+    restore(mask);
+    return OK;
+}
+
+/**
+ * poolinfo - Get pool usage statistics
+ * 
+ * @param poolid: Pool ID
+ * @param nfree: Buffers currently free (can be NULL)
+ * @param highwater: Most buffers ever taken at once (can be NULL)
+ * 
+ * Returns: OK on success, SYSERR on error
+ */
+syscall poolinfo(int32_t poolid, uint32_t *nfree, uint32_t *highwater) {
+    if (poolid < 0 || poolid >= NPOOLS || !pooltab[poolid].used) {
+        return SYSERR;
+    }
+    
+    if (nfree != NULL) *nfree = pooltab[poolid].nfree;
+    if (highwater != NULL) {
+        *highwater = pooltab[poolid].nbufs - pooltab[poolid].minfree;
+    }
+    
+    return OK;
+}
+
+/*------------------------------------------------------------------------
+ * Stack Memory Allocation
+ *------------------------------------------------------------------------*/
+
+/* First-fit from the stack pool, taking from the high end; NULL if none */
+static memblk_t *stkpool_alloc(uint32_t length) {
+    memblk_t *prev, *curr, *leftover;
+    
     prev = NULL;
     curr = stkpool.mhead;
     
@@ -348,50 +1174,20 @@ void *getstk(uint32_t nbytes) {
                     stkpool.mhead = curr->mnext;
                 }
             }
-            
-            stkpool.mfree -= curr->mlength;
-            
-            restore(mask);
-            
-            /* Return top of stack */
-            stktop = (char *)curr + curr->mlength - sizeof(memblk_t);
-            return stktop;
+            return curr;
         }
         
         prev = curr;
         curr = curr->mnext;
     }
     
-    restore(mask);
-    return (void *)SYSERR;
+    return NULL;
 }
 
-/**
- * freestk - Free stack memory back to stack pool
- * 
- * @param stktop: Top of stack (from getstk)
- * @param nbytes: Stack size
- * 
- * Returns: OK on success, SYSERR on error
- */
-syscall freestk(void *stktop, uint32_t nbytes) {
-    intmask mask;
-    memblk_t *blk, *prev, *curr, *next;
-    uint32_t length;
-    
-    if (stktop == NULL || nbytes == 0) {
-        return SYSERR;
-    }
-    
-    length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
-    
-    /* Calculate block start from stack top */
-    blk = (memblk_t *)((char *)stktop - length + sizeof(memblk_t));
-    blk->mlength = length;
-    
-    mask = disable();
+/* Insert a block into the stack pool in address order and coalesce */
+static void stkpool_insert(memblk_t *blk) {
+    memblk_t *prev, *curr, *next;
     
-    /* Insert into free list (sorted by address) */
     prev = NULL;
     curr = stkpool.mhead;
     
@@ -420,7 +1216,144 @@ syscall freestk(void *stktop, uint32_t nbytes) {
         prev->mlength += blk->mlength;
         prev->mnext = blk->mnext;
     }
+}
+
+/* Take a cached stack of exactly this length, or NULL */
+static memblk_t *stkcache_get(uint32_t length) {
+    memblk_t *blk;
+    int i;
+    
+    for (i = 0; i < NSTKCACHE; i++) {
+        if (stkcache[i].length == length && stkcache[i].mhead != NULL) {
+            blk = stkcache[i].mhead;
+            stkcache[i].mhead = blk->mnext;
+            stkcache[i].ncached--;
+            stkcache[i].hits++;
+            return blk;
+        }
+    }
+    
+    return NULL;
+}
+
+/* Cache a freed stack; false if its slot is full or no slot is free */
+static bool stkcache_put(memblk_t *blk) {
+    int i, spare = -1;
+    
+    for (i = 0; i < NSTKCACHE; i++) {
+        if (stkcache[i].length == blk->mlength) {
+            break;
+        }
+        if (spare == -1 && stkcache[i].ncached == 0) {
+            spare = i;
+        }
+    }
+    
+    if (i == NSTKCACHE) {
+        if (spare == -1) {
+            return false;
+        }
+        i = spare;
+        stkcache[i].length = blk->mlength;
+    }
+    
+    if (stkcache[i].ncached >= STKCACHE_DEPTH) {
+        return false;
+    }
+    
+    blk->mnext = stkcache[i].mhead;
+    stkcache[i].mhead = blk;
+    stkcache[i].ncached++;
+    return true;
+}
+
+/* Return every cached stack to the pool */
+static void stkcache_drain(void) {
+    memblk_t *blk;
+    int i;
+    
+    for (i = 0; i < NSTKCACHE; i++) {
+        while ((blk = stkcache[i].mhead) != NULL) {
+            stkcache[i].mhead = blk->mnext;
+            stkcache[i].ncached--;
+            stkpool_insert(blk);
+        }
+    }
+}
+
+/**
+ * getstk - Allocate stack memory from stack pool
+ * 
+ * @param nbytes: Stack size in bytes
+ * 
+ * Returns: Pointer to TOP of stack (highest address), or SYSERR
+ * 
+ * Note: Stacks grow downward, so we return the high address.
+ */
+void *getstk(uint32_t nbytes) {
+    intmask mask;
+    memblk_t *blk;
+    uint32_t length;
+    
+    if (nbytes == 0) {
+        return (void *)SYSERR;
+    }
+    
+    length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
+    
+    mask = disable();
+    
+    blk = stkcache_get(length);
+    if (blk == NULL) {
+        blk = stkpool_alloc(length);
+    }
+    if (blk == NULL) {
+        /* Cached stacks may be hiding the space; give them back and retry */
+        stkcache_drain();
+        blk = stkpool_alloc(length);
+    }
     
+    if (blk == NULL) {
+        restore(mask);
+        return (void *)SYSERR;
+    }
+    
+    stkpool.mfree -= blk->mlength;
+    
+    restore(mask);
+    
+    /* Return top of stack */
+    return (char *)blk + blk->mlength - sizeof(memblk_t);
+}
+
+/**
+ * freestk - Free stack memory back to stack pool
+ * 
+ * @param stktop: Top of stack (from getstk)
+ * @param nbytes: Stack size
+ * 
+ * Returns: OK on success, SYSERR on error
+ */
+syscall freestk(void *stktop, uint32_t nbytes) {
+    intmask mask;
+    memblk_t *blk;
+    uint32_t length;
+    
+    if (stktop == NULL || nbytes == 0) {
+        return SYSERR;
+    }
+    
+    length = ROUNDUP(nbytes + sizeof(memblk_t), MEM_ALIGNMENT);
+    
+    /* Calculate block start from stack top */
+    blk = (memblk_t *)((char *)stktop - length + sizeof(memblk_t));
+    blk->mlength = length;
+    
+    mask = disable();
+    
+    if (!stkcache_put(blk)) {
+        stkpool_insert(blk);
+    }
     stkpool.mfree += length;
     
     restore(mask);
@@ -482,20 +1415,7 @@ uint32_t stktotal(void) {
  * Returns: Number of free blocks
  */
 int32_t memcount_blocks(void) {
-    memblk_t *curr;
-    int32_t count = 0;
-    intmask mask;
-    
-    mask = disable();
-    
-    curr = memlist.mhead;
-    while (curr != NULL) {
-        count++;
-        curr = curr->mnext;
-    }
-    
-    restore(mask);
-    return count;
+    return (int32_t)memlist.nblocks;
 }
 
 /**
@@ -510,12 +1430,19 @@ uint32_t memlargest(void) {
     
     mask = disable();
     
-    curr = memlist.mhead;
-    while (curr != NULL) {
-        if (curr->mlength > largest) {
-            largest = curr->mlength;
+    /* Only an allocation from the largest block forces a rescan */
+    if (memlist.largest_ok) {
+        largest = memlist.largest;
+    } else {
+        curr = memlist.mhead;
+        while (curr != NULL) {
+            if (curr->mlength > largest) {
+                largest = curr->mlength;
+            }
+            curr = curr->mnext;
         }
-        curr = curr->mnext;
+        memlist.largest = largest;
+        memlist.largest_ok = true;
     }
     
     restore(mask);
@@ -527,28 +1454,125 @@ uint32_t memlargest(void) {
     return 0;
 }
 
+/* Copy low to high; safe when dest is below src */
+static void memcopy_fwd(uint8_t *d, const uint8_t *s, uint32_t n) {
+    memword_t *wd;
+    const memword_t *ws;
+    memword_t w0, w1, w2, w3;
+    
+    if (n >= 2 * MEMWORD && MEM_ALIGNED(d, s)) {
+        while ((uintptr_t)d & MEMWORD_MASK) {
+            *d++ = *s++;
+            n--;
+        }
+        
+#if defined(MEM_SIMD_SSE2)
+        while (n >= 16) {
+            _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+            d += 16;
+            s += 16;
+            n -= 16;
+        }
+#elif defined(MEM_SIMD_NEON)
+        while (n >= 16) {
+            vst1q_u8(d, vld1q_u8(s));
+            d += 16;
+            s += 16;
+            n -= 16;
+        }
+#endif
+        
+        /* Each store lands only on source bytes already loaded */
+        wd = (memword_t *)d;
+        ws = (const memword_t *)s;
+        while (n >= 4 * MEMWORD) {
+            w0 = ws[0]; w1 = ws[1]; w2 = ws[2]; w3 = ws[3];
+            wd[0] = w0; wd[1] = w1; wd[2] = w2; wd[3] = w3;
+            wd += 4;
+            ws += 4;
+            n -= 4 * MEMWORD;
+        }
+        while (n >= MEMWORD) {
+            *wd++ = *ws++;
+            n -= MEMWORD;
+        }
+        d = (uint8_t *)wd;
+        s = (const uint8_t *)ws;
+    }
+    
+    while (n-- > 0) {
+        *d++ = *s++;
+    }
+}
+
+/* Copy high to low; d and s point one past the end. Safe when dest is above src */
+static void memcopy_bwd(uint8_t *d, const uint8_t *s, uint32_t n) {
+    memword_t *wd;
+    const memword_t *ws;
+    memword_t w0, w1, w2, w3;
+    
+    if (n >= 2 * MEMWORD && MEM_ALIGNED(d, s)) {
+        while ((uintptr_t)d & MEMWORD_MASK) {
+            *--d = *--s;
+            n--;
+        }
+        
+#if defined(MEM_SIMD_SSE2)
+        while (n >= 16) {
+            d -= 16;
+            s -= 16;
+            n -= 16;
+            _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        }
+#elif defined(MEM_SIMD_NEON)
+        while (n >= 16) {
+            d -= 16;
+            s -= 16;
+            n -= 16;
+            vst1q_u8(d, vld1q_u8(s));
+        }
+#endif
+        
+        wd = (memword_t *)d;
+        ws = (const memword_t *)s;
+        while (n >= 4 * MEMWORD) {
+            wd -= 4;
+            ws -= 4;
+            w3 = ws[3]; w2 = ws[2]; w1 = ws[1]; w0 = ws[0];
+            wd[3] = w3; wd[2] = w2; wd[1] = w1; wd[0] = w0;
+            n -= 4 * MEMWORD;
+        }
+        while (n >= MEMWORD) {
+            *--wd = *--ws;
+            n -= MEMWORD;
+        }
+        d = (uint8_t *)wd;
+        s = (const uint8_t *)ws;
+    }
+    
+    while (n-- > 0) {
+        *--d = *--s;
+    }
+}
+
 /**
  * memcopy - Copy memory regions
  * 
  * @param dest: Destination address
  * @param src: Source address
  * @param nbytes: Number of bytes to copy
+ * 
+ * Overlapping regions are handled by picking the copy direction.
  */
 void memcopy(void *dest, const void *src, uint32_t nbytes) {
-    char *d = (char *)dest;
-    const char *s = (const char *)src;
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
     
     /* Handle overlapping regions */
     if (d < s) {
-        while (nbytes-- > 0) {
-            *d++ = *s++;
-        }
+        memcopy_fwd(d, s, nbytes);
     } else if (d > s) {
-        d += nbytes;
-        s += nbytes;
-        while (nbytes-- > 0) {
-            *--d = *--s;
-        }
+        memcopy_bwd(d + nbytes, s + nbytes, nbytes);
     }
 }
 
@@ -561,6 +1585,48 @@ void memcopy(void *dest, const void *src, uint32_t nbytes) {
  */
 void memset_block(void *dest, uint8_t value, uint32_t nbytes) {
     uint8_t *d = (uint8_t *)dest;
+    memword_t *wd;
+    memword_t pattern;
+    
+    if (nbytes >= 2 * MEMWORD) {
+        while ((uintptr_t)d & MEMWORD_MASK) {
+            *d++ = value;
+            nbytes--;
+        }
+        
+#if defined(MEM_SIMD_SSE2)
+        {
+            __m128i v = _mm_set1_epi8((char)value);
+            while (nbytes >= 16) {
+                _mm_storeu_si128((__m128i *)d, v);
+                d += 16;
+                nbytes -= 16;
+            }
+        }
+#elif defined(MEM_SIMD_NEON)
+        {
+            uint8x16_t v = vdupq_n_u8(value);
+            while (nbytes >= 16) {
+                vst1q_u8(d, v);
+                d += 16;
+                nbytes -= 16;
+            }
+        }
+#endif
+        
+        pattern = (memword_t)-1 / 0xff * value;
+        wd = (memword_t *)d;
+        while (nbytes >= 4 * MEMWORD) {
+            wd[0] = pattern; wd[1] = pattern; wd[2] = pattern; wd[3] = pattern;
+            wd += 4;
+            nbytes -= 4 * MEMWORD;
+        }
+        while (nbytes >= MEMWORD) {
+            *wd++ = pattern;
+            nbytes -= MEMWORD;
+        }
+        d = (uint8_t *)wd;
+    }
     
     while (nbytes-- > 0) {
         *d++ = value;
@@ -577,10 +1643,217 @@ void memzero(void *dest, uint32_t nbytes) {
     memset_block(dest, 0, nbytes);
 }
 
+/**
+ * membench - Measure memcopy/memset_block throughput
+ * 
+ * Copies and fills power-of-two sizes from 16 bytes to 4 KB on a
+ * scratch buffer from getmem() and prints bytes per cycle (x100) for
+ * each size, aligned and with the source misaligned by one byte.
+ */
+#define MEMBENCH_MAX    4096
+#define MEMBENCH_ITERS  64
+
+extern uint64_t get_cycles(void);
+
+static uint32_t membench_rate(uint32_t nbytes, uint64_t cycles) {
+    if (cycles == 0) {
+        cycles = 1;
+    }
+    return (uint32_t)((uint64_t)nbytes * MEMBENCH_ITERS * 100 / cycles);
+}
+
+void membench(void) {
+    uint8_t *buf;
+    uint64_t t0, tcopy, tmis, tset;
+    uint32_t size;
+    int i;
+    
+    buf = (uint8_t *)getmem(2 * MEMBENCH_MAX + 16);
+    if (buf == (uint8_t *)SYSERR) {
+        kprintf("membench: no memory\n");
+        return;
+    }
+    
+    kprintf("\n===== memcopy/memset_block (bytes/cycle x100) =====\n");
+    kprintf("  Size    copy  copy+1     set\n");
+    
+    for (size = 16; size <= MEMBENCH_MAX; size <<= 1) {
+        t0 = get_cycles();
+        for (i = 0; i < MEMBENCH_ITERS; i++) {
+            memcopy(buf + MEMBENCH_MAX + 8, buf, size);
+        }
+        tcopy = get_cycles() - t0;
+        
+        t0 = get_cycles();
+        for (i = 0; i < MEMBENCH_ITERS; i++) {
+            memcopy(buf + MEMBENCH_MAX + 8, buf + 1, size);
+        }
+        tmis = get_cycles() - t0;
+        
+        t0 = get_cycles();
+        for (i = 0; i < MEMBENCH_ITERS; i++) {
+            memset_block(buf, (uint8_t)i, size);
+        }
+        tset = get_cycles() - t0;
+        
+        kprintf("  %4lu  %6lu  %6lu  %6lu\n", size,
+                membench_rate(size, tcopy), membench_rate(size, tmis),
+                membench_rate(size, tset));
+    }
+    
+    freemem(buf, 2 * MEMBENCH_MAX + 16);
+}
+
+/*------------------------------------------------------------------------
+ * Allocation Profile
+ *------------------------------------------------------------------------*/
+
+/**
+ * memfrag - Heap fragmentation index
+ * 
+ * Returns: 0 when all free-list memory is one block, rising towards
+ *          100 as it is split into pieces smaller than the total
+ * 
+ * Blocks parked in the size-class caches are not counted as free here,
+ * since a large request cannot use them until they are drained.
+ */
+uint32_t memfrag(void) {
+    uint32_t listfree = memlist.mfree;
+    uint32_t largest;
+    int c;
+    
+    for (c = 0; c < NMEMCLASS; c++) {
+        listfree -= memclass[c].ncached * MEMCLASS_LEN(c);
+    }
+    
+    largest = memlargest() + sizeof(memblk_t);
+    if (listfree == 0 || largest >= listfree) {
+        return 0;
+    }
+    return 100 - (uint32_t)((uint64_t)largest * 100 / listfree);
+}
+
+/**
+ * mempeak - Highest heap usage since meminit()
+ * 
+ * @param reset: If true, restart the peak from current usage
+ * 
+ * Returns: Peak bytes allocated, headers included
+ */
+uint32_t mempeak(bool reset) {
+    uint32_t peak = memprof.peak_bytes;
+    
+    if (reset) {
+        memprof.peak_bytes = memprof.live_bytes;
+    }
+    return peak;
+}
+
+/* Print the allocation profile */
+void memprof_print(void) {
+    int i;
+    
+    kprintf("\nAllocation Profile:\n");
+    kprintf("  Live:        %lu bytes in %lu blocks\n",
+            memprof.live_bytes, memprof.live_blocks);
+    kprintf("  Peak:        %lu bytes\n", memprof.peak_bytes);
+    kprintf("  Fragmentation: %lu%%\n", memfrag());
+    kprintf("  Failed:      %lu  Bad frees: %lu\n",
+            memprof.failed, memprof.badfree);
+    for (i = 0; i < MEMPROF_NBUCKETS; i++) {
+        if (memprof.hist[i] != 0) {
+            kprintf("  <=%6lu bytes: %lu live\n",
+                    (uint32_t)MEMCLASS_MIN << i, memprof.hist[i]);
+        }
+    }
+    kprintf("  Sites:\n");
+    for (i = 0; i < MEMPROF_NSITES; i++) {
+        if (memsite[i].allocs != 0) {
+            kprintf("    %s%p: allocs=%lu live=%lu bytes\n",
+                    (i == MEMPROF_OTHER) ? "other " : "", (void *)memsite[i].pc,
+                    memsite[i].allocs, memsite[i].live_bytes);
+        }
+    }
+}
+
+/**
+ * memvalidate_step - Incremental heap consistency check
+ * 
+ * @param budget: Maximum free-list blocks to examine in this call
+ * 
+ * Returns: OK if nothing was wrong, SYSERR if corruption was detected
+ * 
+ * Checks the profile counters against the heap totals, then resumes a
+ * walk of the free list where the previous call stopped. Interrupts are
+ * masked for at most budget blocks, so this can run from a periodic
+ * timer or idle loop. A pass restarts from the head if the free list
+ * changed since the last call.
+ */
+syscall memvalidate_step(uint32_t budget) {
+    memblk_t *prev, *curr;
+    intmask mask;
+    
+    mask = disable();
+    
+    if (memprof.live_bytes + memlist.mfree != memlist.mtotal) {
+        kprintf("ERROR: Heap accounting off: live=%lu free=%lu total=%lu\n",
+                memprof.live_bytes, memlist.mfree, memlist.mtotal);
+        restore(mask);
+        return SYSERR;
+    }
+    
+    if (memcheck.curr == NULL || memcheck.gen != memlist.gen) {
+        memcheck.prev = NULL;
+        memcheck.curr = memlist.mhead;
+        memcheck.gen = memlist.gen;
+    }
+    
+    prev = memcheck.prev;
+    curr = memcheck.curr;
+    
+    while (curr != NULL && budget-- > 0) {
+        if ((char *)curr < memlist.mbase || (char *)curr >= memlist.mlimit ||
+            ((uintptr_t)curr & (MEM_ALIGNMENT - 1)) != 0) {
+            kprintf("ERROR: Free block outside heap at %p\n", curr);
+            restore(mask);
+            return SYSERR;
+        }
+        
+        if (curr->mlength < sizeof(memblk_t) ||
+            curr->mlength > (uint32_t)(memlist.mlimit - (char *)curr)) {
+            kprintf("ERROR: Bad block length at %p\n", curr);
+            restore(mask);
+            return SYSERR;
+        }
+        
+        /* Sorted, disjoint and fully coalesced */
+        if (prev != NULL && (char *)prev + prev->mlength >= (char *)curr) {
+            kprintf("ERROR: Free list order or coalescing broken at %p\n",
+                    prev);
+            restore(mask);
+            return SYSERR;
+        }
+        
+        prev = curr;
+        curr = curr->mnext;
+    }
+    
+    if (curr == NULL) {
+        memcheck.passes++;
+    }
+    memcheck.prev = prev;
+    memcheck.curr = curr;
+    
+    restore(mask);
+    return OK;
+}
+
 /**
  * meminfo - Print memory subsystem information
  */
 void meminfo(void) {
+    int i;
+    
     kprintf("\n===== Memory Information =====\n");
     kprintf("Heap Memory:\n");
     kprintf("  Total:      %lu bytes\n", memlist.mtotal);
@@ -590,10 +1863,42 @@ void meminfo(void) {
     kprintf("  Largest block: %lu bytes\n", memlargest());
     kprintf("  Allocations: %lu\n", memlist.mallocs);
     kprintf("  Frees:       %lu\n", memlist.frees);
+    memprof_print();
+    kprintf("\nSize Classes:\n");
+    for (i = 0; i < NMEMCLASS; i++) {
+        kprintf("  %4lu bytes: cached=%lu hits=%lu misses=%lu frees=%lu\n",
+                (uint32_t)MEMCLASS_MIN << i, memclass[i].ncached,
+                memclass[i].hits, memclass[i].misses, memclass[i].frees);
+    }
+    if (buddy.size != 0) {
+        kprintf("\nBuddy Region: %lu bytes at %p\n", buddy.size, buddy.base);
+        kprintf("  allocs=%lu fails=%lu splits=%lu merges=%lu\n",
+                buddy.allocs, buddy.fails, buddy.splits, buddy.merges);
+        for (i = 0; i < BUDDY_NORDERS; i++) {
+            kprintf("  %6lu bytes: %lu free\n",
+                    (uint32_t)BUDDY_MINBLK << i, buddy.nfree[i]);
+        }
+    }
+    kprintf("\nBuffer Pools:\n");
+    for (i = 0; i < NPOOLS; i++) {
+        if (pooltab[i].used) {
+            kprintf("  %2d: %lu x %lu bytes, free=%lu high-water=%lu "
+                    "gets=%lu fails=%lu\n", i, pooltab[i].nbufs,
+                    pooltab[i].bufsize, pooltab[i].nfree,
+                    pooltab[i].nbufs - pooltab[i].minfree,
+                    pooltab[i].gets, pooltab[i].fails);
+        }
+    }
     kprintf("\nStack Pool:\n");
     kprintf("  Total:      %lu bytes\n", stkpool.mtotal);
     kprintf("  Free:       %lu bytes\n", stkpool.mfree);
     kprintf("  Used:       %lu bytes\n", stkpool.mtotal - stkpool.mfree);
+    for (i = 0; i < NSTKCACHE; i++) {
+        if (stkcache[i].length != 0) {
+            kprintf("  Cache %lu bytes: cached=%lu hits=%lu\n",
+                    stkcache[i].length, stkcache[i].ncached, stkcache[i].hits);
+        }
+    }
     kprintf("==============================\n\n");
 }
 
@@ -2,14 +2,67 @@
 
 #include "../include/kernel.h"
 #include "../include/process.h"
+#include "../include/memory.h"
 #include "../include/interrupts.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdbool.h>
 
+extern syscall deadline_arm(pid32 pid, uint32_t ticks, void (*expire)(pid32));
+extern bool deadline_cancel(pid32 pid);
+extern int32_t trywaitn(sid32 sem, int32_t max);
+extern pid32 cpu_currpid(void);
+
 #define MSG_BOX_SIZE        16
 #define MSG_TIMEOUT_INF     0xFFFFFFFF
 
+/* Ring mailbox modes */
+#define RING_NONE           0       /* Semaphore-protected msgbox */
+#define RING_SPSC           1       /* Single producer, single consumer */
+#define RING_MPSC           2       /* Multiple producers, single consumer */
+
+#define RING_MAX_DEPTH      4096
+
+/* Buffer descriptor: large payloads travel by reference */
+typedef struct msgdesc {
+    void        *buf;
+    uint32_t    len;
+} msgdesc_t;
+
+/* Ring cell; seq tells producers and the consumer who owns the slot */
+typedef struct ringcell {
+    volatile uint32_t seq;
+    msgdesc_t   desc;
+} ringcell_t;
+
+/* Lock-free bounded ring (Vyukov-style sequence numbers) */
+typedef struct msgring {
+    ringcell_t  *cells;
+    uint32_t    mask;               /* depth - 1 (depth is a power of 2) */
+    volatile uint32_t head;         /* Next cell to consume */
+    volatile uint32_t tail;         /* Next cell to produce */
+    volatile bool waiting;          /* Owner parked on an empty ring */
+    volatile uint32_t refs;         /* 1 for the mailbox, +1 per user */
+} msgring_t;
+
+/*
+ * Senders and the owner touch the cells without a lock, so the ring
+ * is reference counted. mailbox_delete() sets RING_DEAD and drops the
+ * mailbox's own reference; whoever then drops the count to RING_DEAD
+ * frees the cells, and marks the ring RING_FREED so that a late
+ * caller that briefly took and dropped a reference can't free it too.
+ */
+#define RING_DEAD           0x80000000u
+#define RING_FREED          0xC0000000u
+
+struct msgbox;
+static bool ring_get(struct msgbox *mbox);
+static void ring_put(struct msgbox *mbox);
+static bool ring_pop(msgring_t *r, msgdesc_t *desc);
+syscall mailbox_send_ptr(pid32 pid, void *buf, uint32_t len);
+syscall mailbox_recv_ptr(void **buf, uint32_t *len);
+
 typedef struct msgbox {
     umsg32      messages[MSG_BOX_SIZE];
     uint32_t    head;
@@ -19,6 +72,8 @@ typedef struct msgbox {
     sid32       items;
     sid32       slots;
     bool        active;
+    uint8_t     ringmode;           /* RING_NONE, RING_SPSC or RING_MPSC */
+    msgring_t   ring;
 } msgbox_t;
 
 static msgbox_t mailboxes[NPROC];
@@ -59,6 +114,7 @@ syscall send(pid32 pid, umsg32 msg) {
     
     pptr->prmsg = msg;
     pptr->prhasmsg = true;
+    TRACE(TRACE_SEND, pid, msg);
     
     /* Wake receiver if waiting */
     if (pptr->prstate == PR_RECV) {
@@ -76,18 +132,21 @@ umsg32 receive(void) {
     intmask mask;
     struct procent *pptr;
     umsg32 msg;
+    bool blocked = false;
     
     mask = disable();
     
-    pptr = &proctab[currpid];
+    pptr = &proctab[cpu_currpid()];
     
     while (!pptr->prhasmsg) {
         pptr->prstate = PR_RECV;
+        blocked = true;
         resched();
     }
     
     msg = pptr->prmsg;
     pptr->prhasmsg = false;
+    TRACE(TRACE_RECEIVE, msg, blocked);
     
     msg_stats.received++;
     
@@ -103,7 +162,7 @@ umsg32 recvclr(void) {
     
     mask = disable();
     
-    pptr = &proctab[currpid];
+    pptr = &proctab[cpu_currpid()];
     
     if (pptr->prhasmsg) {
         msg = pptr->prmsg;
@@ -117,15 +176,24 @@ umsg32 recvclr(void) {
     return msg;
 }
 
-/* Receive a message with timeout */
+/* Deadline expiry for recvtime(): wake the receiver empty-handed */
+static void recv_timeout(pid32 pid) {
+    if (proctab[pid].prstate == PR_RECV) {
+        ready(pid);
+    }
+}
+
+/* Receive a message with timeout (in milliseconds) */
 umsg32 recvtime(uint32_t maxwait) {
     intmask mask;
     struct procent *pptr;
     umsg32 msg;
+    uint32_t ticks;
+    pid32 self = cpu_currpid();
     
     mask = disable();
     
-    pptr = &proctab[currpid];
+    pptr = &proctab[self];
     
     if (pptr->prhasmsg) {
         msg = pptr->prmsg;
@@ -140,31 +208,23 @@ umsg32 recvtime(uint32_t maxwait) {
         return TIMEOUT;
     }
     
-    /* Convert to ticks and set up timed wait */
-    /* Insert into sleep queue and wait for message or timeout */
+    ticks = ms_to_ticks(maxwait);
+    if (ticks == 0) {
+        ticks = 1;
+    }
     
-    /* Simplified implementation - use sleep with periodic checks */
-    uint32_t elapsed = 0;
-    uint32_t interval = (maxwait < 10) ? maxwait : 10;
+    /* Block for a message with a deadline; send() or the wheel wakes us */
+    pptr->prstate = PR_RECV;
+    deadline_arm(self, ticks, recv_timeout);
+    resched();
+    deadline_cancel(self);
     
-    while (elapsed < maxwait) {
-        pptr->prstate = PR_RECV;
-        
-        /* Wait a short interval */
+    if (pptr->prhasmsg) {
+        msg = pptr->prmsg;
+        pptr->prhasmsg = false;
+        msg_stats.received++;
         restore(mask);
-        sleepms(interval);
-        mask = disable();
-        
-        /* Check for message */
-        if (pptr->prhasmsg) {
-            msg = pptr->prmsg;
-            pptr->prhasmsg = false;
-            msg_stats.received++;
-            restore(mask);
-            return msg;
-        }
-        
-        elapsed += interval;
+        return msg;
     }
     
     msg_stats.timeouts++;
@@ -185,6 +245,8 @@ void mailbox_init(void) {
         mailboxes[i].items = SYSERR;
         mailboxes[i].slots = SYSERR;
         mailboxes[i].active = false;
+        mailboxes[i].ringmode = RING_NONE;
+        mailboxes[i].ring.cells = NULL;
     }
     
     msg_stats.sent = 0;
@@ -259,6 +321,26 @@ syscall mailbox_delete(pid32 pid) {
     }
     
     mbox->active = false;
+    
+    if (mbox->ringmode != RING_NONE) {
+        mbox->ringmode = RING_NONE;
+        
+        /* Wake a parked owner; it sees the mailbox gone and fails */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (mbox->ring.waiting) {
+            mbox->ring.waiting = false;
+            if (proctab[pid].prstate == PR_RECV) {
+                ready(pid);
+            }
+        }
+        restore(mask);
+        
+        /* Cells are freed once in-flight senders are done with them */
+        __atomic_or_fetch(&mbox->ring.refs, RING_DEAD, __ATOMIC_ACQ_REL);
+        ring_put(mbox);
+        return OK;
+    }
+    
     semdelete(mbox->items);
     semdelete(mbox->slots);
     mbox->mutex = SYSERR;
@@ -287,6 +369,10 @@ syscall mailbox_send(pid32 pid, umsg32 msg) {
         return SYSERR;
     }
     
+    if (mbox->ringmode != RING_NONE) {
+        return mailbox_send_ptr(pid, (void *)(uintptr_t)msg, 0);
+    }
+    
     if (wait(mbox->slots) == SYSERR) {
         msg_stats.failed++;
         return SYSERR;
@@ -322,6 +408,10 @@ syscall mailbox_send_nb(pid32 pid, umsg32 msg) {
         return SYSERR;
     }
     
+    if (mbox->ringmode != RING_NONE) {
+        return mailbox_send_ptr(pid, (void *)(uintptr_t)msg, 0);
+    }
+    
     if (trywait(mbox->slots) == SYSERR) {
         msg_stats.failed++;
         return SYSERR;
@@ -346,13 +436,22 @@ umsg32 mailbox_recv(void) {
     msgbox_t *mbox;
     umsg32 msg;
     
-    mbox = &mailboxes[currpid];
+    mbox = &mailboxes[cpu_currpid()];
     
     if (!mbox->active) {
         msg_stats.failed++;
         return SYSERR;
     }
     
+    if (mbox->ringmode != RING_NONE) {
+        void *buf;
+        
+        if (mailbox_recv_ptr(&buf, NULL) == SYSERR) {
+            return SYSERR;
+        }
+        return (umsg32)(uintptr_t)buf;
+    }
+    
     if (wait(mbox->items) == SYSERR) {
         msg_stats.failed++;
         return SYSERR;
@@ -377,13 +476,30 @@ umsg32 mailbox_recv_nb(void) {
     msgbox_t *mbox;
     umsg32 msg;
     
-    mbox = &mailboxes[currpid];
+    mbox = &mailboxes[cpu_currpid()];
     
     if (!mbox->active) {
         msg_stats.failed++;
         return SYSERR;
     }
     
+    if (mbox->ringmode != RING_NONE) {
+        msgdesc_t desc;
+        bool got;
+        
+        if (!ring_get(mbox)) {
+            return SYSERR;
+        }
+        got = mbox->active && mbox->ringmode != RING_NONE &&
+              ring_pop(&mbox->ring, &desc);
+        ring_put(mbox);
+        if (!got) {
+            return SYSERR;
+        }
+        msg_stats.received++;
+        return (umsg32)(uintptr_t)desc.buf;
+    }
+    
     if (trywait(mbox->items) == SYSERR) {
         return SYSERR;
     }
@@ -408,7 +524,7 @@ umsg32 mailbox_recv_timeout(uint32_t timeout) {
     umsg32 msg;
     syscall status;
     
-    mbox = &mailboxes[currpid];
+    mbox = &mailboxes[cpu_currpid()];
     
     if (!mbox->active) {
         msg_stats.failed++;
@@ -457,7 +573,11 @@ int32_t mailbox_count(pid32 pid) {
     }
     
     mask = disable();
-    count = mbox->count;
+    if (mbox->ringmode != RING_NONE) {
+        count = mbox->ring.tail - mbox->ring.head;
+    } else {
+        count = mbox->count;
+    }
     restore(mask);
     
     return count;
@@ -470,18 +590,313 @@ bool mailbox_isempty(pid32 pid) {
 
 /* Check if mailbox is full */
 bool mailbox_isfull(pid32 pid) {
-    return (mailbox_count(pid) == MSG_BOX_SIZE);
+    int32_t depth = MSG_BOX_SIZE;
+    
+    if (pid >= 0 && pid < NPROC && mailboxes[pid].ringmode != RING_NONE) {
+        depth = mailboxes[pid].ring.mask + 1;
+    }
+    
+    return (mailbox_count(pid) == depth);
+}
+
+/*------------------------------------------------------------------------
+ * Lock-free Ring Mailboxes
+ *------------------------------------------------------------------------*/
+
+/* Take a reference on mbox's ring; false if it is being deleted */
+static bool ring_get(msgbox_t *mbox) {
+    if (__atomic_add_fetch(&mbox->ring.refs, 1, __ATOMIC_ACQUIRE) & RING_DEAD) {
+        ring_put(mbox);
+        return false;
+    }
+    return true;
+}
+
+/* Drop a reference, freeing the cells after the last one goes */
+static void ring_put(msgbox_t *mbox) {
+    uint32_t dead = RING_DEAD;
+    
+    if (__atomic_sub_fetch(&mbox->ring.refs, 1, __ATOMIC_ACQ_REL) == RING_DEAD &&
+        __atomic_compare_exchange_n(&mbox->ring.refs, &dead, RING_FREED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        freemem(mbox->ring.cells, (mbox->ring.mask + 1) * sizeof(ringcell_t));
+        mbox->ring.cells = NULL;
+    }
+}
+
+/* Push a descriptor; returns false if the ring is full */
+static bool ring_push(msgring_t *r, uint8_t mode, const msgdesc_t *desc) {
+    ringcell_t *cell;
+    uint32_t pos, seq;
+    int32_t dif;
+    
+    pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int32_t)(seq - pos);
+        
+        if (dif == 0) {
+            if (mode == RING_SPSC) {
+                /* Sole producer owns the tail */
+                __atomic_store_n(&r->tail, pos + 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, false,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* Lost the race; pos now holds the current tail */
+        } else if (dif < 0) {
+            return false;   /* Full */
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+    
+    cell->desc = *desc;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Pop a descriptor (owner only); returns false if the ring is empty */
+static bool ring_pop(msgring_t *r, msgdesc_t *desc) {
+    ringcell_t *cell;
+    uint32_t pos = r->head;
+    uint32_t seq;
+    
+    cell = &r->cells[pos & r->mask];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    
+    if ((int32_t)(seq - (pos + 1)) < 0) {
+        return false;
+    }
+    
+    *desc = cell->desc;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, pos + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * mailbox_create_ring - Create a lock-free ring mailbox for a process
+ * 
+ * @param pid: Owning (receiving) process
+ * @param depth: Ring depth, rounded up to a power of 2
+ * @param mode: RING_SPSC or RING_MPSC
+ * 
+ * Returns: OK on success, SYSERR on error
+ * 
+ * Senders never block or take a semaphore: they claim a cell with an
+ * atomic index update and fail if the ring is full. The owner only
+ * parks when the ring is empty.
+ */
+syscall mailbox_create_ring(pid32 pid, uint32_t depth, uint8_t mode) {
+    intmask mask;
+    msgbox_t *mbox;
+    ringcell_t *cells;
+    uint32_t size, i, refs;
+    
+    if (pid < 0 || pid >= NPROC || depth == 0 || depth > RING_MAX_DEPTH) {
+        return SYSERR;
+    }
+    
+    if (mode != RING_SPSC && mode != RING_MPSC) {
+        return SYSERR;
+    }
+    
+    size = 1;
+    while (size < depth) {
+        size <<= 1;
+    }
+    
+    cells = (ringcell_t *)getmem(size * sizeof(ringcell_t));
+    if (cells == (ringcell_t *)SYSERR) {
+        return SYSERR;
+    }
+    
+    for (i = 0; i < size; i++) {
+        cells[i].seq = i;
+        cells[i].desc.buf = NULL;
+        cells[i].desc.len = 0;
+    }
+    
+    mask = disable();
+    
+    mbox = &mailboxes[pid];
+    
+    /* The previous ring, if any, must be neither live nor still draining */
+    refs = __atomic_load_n(&mbox->ring.refs, __ATOMIC_ACQUIRE);
+    if (mbox->active || (refs != 0 && refs != RING_FREED) ||
+        !__atomic_compare_exchange_n(&mbox->ring.refs, &refs, 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        restore(mask);
+        freemem(cells, size * sizeof(ringcell_t));
+        return SYSERR;
+    }
+    
+    mbox->ring.cells = cells;
+    mbox->ring.mask = size - 1;
+    mbox->ring.head = 0;
+    mbox->ring.tail = 0;
+    mbox->ring.waiting = false;
+    mbox->ringmode = mode;
+    mbox->active = true;
+    
+    restore(mask);
+    return OK;
+}
+
+/**
+ * mailbox_send_ptr - Send a buffer by reference to a ring mailbox
+ * 
+ * @param pid: Destination process
+ * @param buf: Payload pointer (ownership passes to the receiver)
+ * @param len: Payload length in bytes
+ * 
+ * Returns: OK on success, SYSERR if the ring is full or invalid
+ */
+syscall mailbox_send_ptr(pid32 pid, void *buf, uint32_t len) {
+    intmask mask;
+    msgbox_t *mbox;
+    msgdesc_t desc;
+    
+    if (pid < 0 || pid >= NPROC) {
+        msg_stats.failed++;
+        return SYSERR;
+    }
+    
+    mbox = &mailboxes[pid];
+    
+    if (!ring_get(mbox)) {
+        msg_stats.failed++;
+        return SYSERR;
+    }
+    
+    if (!mbox->active || mbox->ringmode == RING_NONE) {
+        ring_put(mbox);
+        msg_stats.failed++;
+        return SYSERR;
+    }
+    
+    desc.buf = buf;
+    desc.len = len;
+    
+    if (!ring_push(&mbox->ring, mbox->ringmode, &desc)) {
+        ring_put(mbox);
+        msg_stats.failed++;
+        return SYSERR;
+    }
+    
+    msg_stats.sent++;
+    
+    /*
+     * Slow path only if the owner went to sleep on an empty ring. The
+     * push's release store doesn't order the load of waiting after it;
+     * the fence pairs with the one in mailbox_recv_ptr().
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&mbox->ring.waiting, __ATOMIC_RELAXED)) {
+        mask = disable();
+        if (mbox->ring.waiting) {
+            mbox->ring.waiting = false;
+            if (proctab[pid].prstate == PR_RECV) {
+                ready(pid);
+            }
+        }
+        restore(mask);
+    }
+    
+    ring_put(mbox);
+    return OK;
+}
+
+/**
+ * mailbox_recv_ptr - Receive a buffer descriptor from own ring mailbox
+ * 
+ * @param buf: Receives the payload pointer
+ * @param len: Receives the payload length (can be NULL)
+ * 
+ * Returns: OK on success, SYSERR if no ring mailbox exists
+ * 
+ * Blocks only while the ring is empty.
+ */
+syscall mailbox_recv_ptr(void **buf, uint32_t *len) {
+    intmask mask;
+    msgbox_t *mbox;
+    msgdesc_t desc;
+    pid32 self = cpu_currpid();
+    
+    if (buf == NULL) {
+        return SYSERR;
+    }
+    
+    mbox = &mailboxes[self];
+    
+    for (;;) {
+        if (!ring_get(mbox)) {
+            msg_stats.failed++;
+            return SYSERR;
+        }
+        if (!mbox->active || mbox->ringmode == RING_NONE) {
+            ring_put(mbox);
+            msg_stats.failed++;
+            return SYSERR;
+        }
+        if (ring_pop(&mbox->ring, &desc)) {
+            ring_put(mbox);
+            break;
+        }
+        
+        mask = disable();
+        
+        /* Publish the wait, then re-check to close the race with senders */
+        __atomic_store_n(&mbox->ring.waiting, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_pop(&mbox->ring, &desc)) {
+            mbox->ring.waiting = false;
+            restore(mask);
+            ring_put(mbox);
+            break;
+        }
+        
+        /* Park without holding the ring, so a delete can free it */
+        proctab[self].prstate = PR_RECV;
+        ring_put(mbox);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!mbox->active) {
+            proctab[self].prstate = PR_CURR;
+            mbox->ring.waiting = false;
+            restore(mask);
+            msg_stats.failed++;
+            return SYSERR;
+        }
+        resched();
+        restore(mask);
+    }
+    
+    *buf = desc.buf;
+    if (len != NULL) {
+        *len = desc.len;
+    }
+    
+    msg_stats.received++;
+    return OK;
 }
 
-#define NPORTS          32
+#define PORT_INIT_CAP   32          /* Ports available before any growth */
+#define PORT_MAX_CAP    1024
 #define PORT_MSG_SIZE   8
+#define PORT_NAMELEN    16
 
 #define PORT_FREE       0
 #define PORT_ALLOC      1
 
 typedef struct msgport {
     uint8_t     state;
-    char        name[16];
+    char        name[PORT_NAMELEN];
     pid32       owner;
     umsg32      messages[PORT_MSG_SIZE];
     uint32_t    head;
@@ -490,74 +905,261 @@ typedef struct msgport {
     sid32       mutex;
     sid32       items;
     sid32       slots;
+    int32_t     nextfree;           /* Next free port ID when PORT_FREE */
 } msgport_t;
 
-static msgport_t ports[NPORTS];
+/*
+ * Port table. It is an array of pointers so that ports never move when
+ * the table grows; the first PORT_INIT_CAP ports are static and later
+ * ones are carved from the heap in one chunk per doubling.
+ */
+static msgport_t port_storage[PORT_INIT_CAP];
+static msgport_t *port_initial[PORT_INIT_CAP];
+static msgport_t **ports = port_initial;
+static int32_t nports = 0;                  /* Table capacity */
+static int32_t nports_active = 0;
+static int32_t port_freelist = -1;
+
+/*
+ * Name index: open addressing with linear probing over port IDs.
+ * Kept at most half full by growing with the port table, so lookups
+ * touch a couple of slots instead of scanning every port.
+ */
+#define PHASH_EMPTY     -1
+#define PHASH_DELETED   -2
+
+static int32_t phash_initial[2 * PORT_INIT_CAP];
+static int32_t *phash = phash_initial;
+static uint32_t phash_size = 0;             /* Power of 2 */
+static uint32_t phash_used = 0;             /* Live entries + tombstones */
+
+/* FNV-1a over a port name (at most PORT_NAMELEN - 1 characters) */
+static uint32_t port_hash(const char *name) {
+    uint32_t h = 2166136261U;
+    int i;
+    
+    for (i = 0; i < PORT_NAMELEN - 1 && name[i] != '\0'; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619U;
+    }
+    
+    return h;
+}
+
+/* Find a port ID by name in the index, or SYSERR (ints disabled) */
+static int32_t phash_find(const char *name) {
+    uint32_t mask = phash_size - 1;
+    uint32_t i = port_hash(name) & mask;
+    int32_t id;
+    
+    while ((id = phash[i]) != PHASH_EMPTY) {
+        if (id >= 0 && strcmp(ports[id]->name, name) == 0) {
+            return id;
+        }
+        i = (i + 1) & mask;
+    }
+    
+    return SYSERR;
+}
+
+/* Add a port ID to the index (ints disabled) */
+static void phash_add(int32_t *table, uint32_t size, int32_t portid) {
+    uint32_t mask = size - 1;
+    uint32_t i = port_hash(ports[portid]->name) & mask;
+    
+    while (table[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    
+    if (table[i] == PHASH_EMPTY) {
+        phash_used++;
+    }
+    table[i] = portid;
+}
+
+/* Remove a port ID from the index, leaving a tombstone (ints disabled) */
+static void phash_del(int32_t portid) {
+    uint32_t mask = phash_size - 1;
+    uint32_t i = port_hash(ports[portid]->name) & mask;
+    
+    while (phash[i] != PHASH_EMPTY) {
+        if (phash[i] == portid) {
+            phash[i] = PHASH_DELETED;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+/* Rebuild the index into table, dropping tombstones (ints disabled) */
+static void phash_rebuild(int32_t *table, uint32_t size) {
+    uint32_t i;
+    int32_t id;
+    
+    for (i = 0; i < size; i++) {
+        table[i] = PHASH_EMPTY;
+    }
+    
+    phash_used = 0;
+    for (id = 0; id < nports; id++) {
+        if (ports[id]->state == PORT_ALLOC) {
+            phash_add(table, size, id);
+        }
+    }
+}
+
+/* Double the port table and its index (ints disabled) */
+static syscall port_grow(void) {
+    msgport_t **newtab;
+    msgport_t *chunk;
+    int32_t *newhash;
+    int32_t newcap, i;
+    
+    newcap = nports * 2;
+    if (newcap > PORT_MAX_CAP) {
+        return SYSERR;
+    }
+    
+    newtab = (msgport_t **)getmem(newcap * sizeof(msgport_t *));
+    chunk = (msgport_t *)getmem((newcap - nports) * sizeof(msgport_t));
+    newhash = (int32_t *)getmem(2 * newcap * sizeof(int32_t));
+    
+    if (newtab == (msgport_t **)SYSERR || chunk == (msgport_t *)SYSERR ||
+        newhash == (int32_t *)SYSERR) {
+        if (newtab != (msgport_t **)SYSERR) {
+            freemem(newtab, newcap * sizeof(msgport_t *));
+        }
+        if (chunk != (msgport_t *)SYSERR) {
+            freemem(chunk, (newcap - nports) * sizeof(msgport_t));
+        }
+        if (newhash != (int32_t *)SYSERR) {
+            freemem(newhash, 2 * newcap * sizeof(int32_t));
+        }
+        return SYSERR;
+    }
+    
+    for (i = 0; i < nports; i++) {
+        newtab[i] = ports[i];
+    }
+    
+    /* New ports go on the free list in ID order */
+    for (i = nports; i < newcap; i++) {
+        newtab[i] = &chunk[i - nports];
+        newtab[i]->state = PORT_FREE;
+        newtab[i]->name[0] = '\0';
+        newtab[i]->owner = -1;
+        newtab[i]->nextfree = (i + 1 < newcap) ? i + 1 : port_freelist;
+    }
+    port_freelist = nports;
+    
+    if (ports != port_initial) {
+        freemem(ports, nports * sizeof(msgport_t *));
+    }
+    if (phash != phash_initial) {
+        freemem(phash, phash_size * sizeof(int32_t));
+    }
+    
+    ports = newtab;
+    nports = newcap;
+    phash = newhash;
+    phash_size = 2 * newcap;
+    phash_rebuild(phash, phash_size);
+    
+    return OK;
+}
+
+/* Map a port ID to an allocated port, or NULL */
+static msgport_t *port_get(int32_t portid) {
+    msgport_t *port = NULL;
+    intmask mask;
+    
+    mask = disable();
+    if (portid >= 0 && portid < nports && ports[portid]->state == PORT_ALLOC) {
+        port = ports[portid];
+    }
+    restore(mask);
+    
+    return port;
+}
 
 /* Initialize port subsystem */
 void port_init(void) {
     int i;
     
-    for (i = 0; i < NPORTS; i++) {
-        ports[i].state = PORT_FREE;
-        ports[i].name[0] = '\0';
-        ports[i].owner = -1;
+    for (i = 0; i < PORT_INIT_CAP; i++) {
+        port_initial[i] = &port_storage[i];
+        port_storage[i].state = PORT_FREE;
+        port_storage[i].name[0] = '\0';
+        port_storage[i].owner = -1;
+        port_storage[i].nextfree = (i + 1 < PORT_INIT_CAP) ? i + 1 : -1;
     }
+    
+    ports = port_initial;
+    nports = PORT_INIT_CAP;
+    nports_active = 0;
+    port_freelist = 0;
+    
+    phash = phash_initial;
+    phash_size = 2 * PORT_INIT_CAP;
+    phash_rebuild(phash, phash_size);
 }
 
 /* Create a named message port */
 int32_t port_create(const char *name) {
-    int i;
+    int32_t i;
     intmask mask;
+    msgport_t *port;
     
-    if (name == NULL || name[0] == '\0') {
+    if (name == NULL || name[0] == '\0' ||
+        strnlen(name, PORT_NAMELEN) >= PORT_NAMELEN) {
         return SYSERR;
     }
     
     mask = disable();
     
-    for (i = 0; i < NPORTS; i++) {
-        if (ports[i].state == PORT_ALLOC) {
-            if (strcmp(ports[i].name, name) == 0) {
-                restore(mask);
-                return SYSERR;
-            }
-        }
-    }
-    
-    for (i = 0; i < NPORTS; i++) {
-        if (ports[i].state == PORT_FREE) {
-            break;
-        }
+    if (phash_find(name) != SYSERR) {
+        restore(mask);
+        return SYSERR;
     }
     
-    if (i >= NPORTS) {
+    if (port_freelist == -1 && port_grow() == SYSERR) {
         restore(mask);
         return SYSERR;
     }
     
-    ports[i].state = PORT_ALLOC;
-    strncpy(ports[i].name, name, 15);
-    ports[i].name[15] = '\0';
-    ports[i].owner = currpid;
-    ports[i].head = 0;
-    ports[i].tail = 0;
-    ports[i].count = 0;
+    i = port_freelist;
+    port = ports[i];
     
-    ports[i].mutex = semcreate(1);
-    ports[i].items = semcreate(0);
-    ports[i].slots = semcreate(PORT_MSG_SIZE);
+    port->mutex = semcreate(1);
+    port->items = semcreate(0);
+    port->slots = semcreate(PORT_MSG_SIZE);
     
-    if (ports[i].mutex == SYSERR || ports[i].items == SYSERR || 
-        ports[i].slots == SYSERR) {
-        if (ports[i].mutex != SYSERR) semdelete(ports[i].mutex);
-        if (ports[i].items != SYSERR) semdelete(ports[i].items);
-        if (ports[i].slots != SYSERR) semdelete(ports[i].slots);
-        ports[i].state = PORT_FREE;
+    if (port->mutex == SYSERR || port->items == SYSERR || 
+        port->slots == SYSERR) {
+        if (port->mutex != SYSERR) semdelete(port->mutex);
+        if (port->items != SYSERR) semdelete(port->items);
+        if (port->slots != SYSERR) semdelete(port->slots);
         restore(mask);
         return SYSERR;
     }
     
+    port_freelist = port->nextfree;
+    port->nextfree = -1;
+    port->state = PORT_ALLOC;
+    strncpy(port->name, name, PORT_NAMELEN - 1);
+    port->name[PORT_NAMELEN - 1] = '\0';
+    port->owner = cpu_currpid();
+    port->head = 0;
+    port->tail = 0;
+    port->count = 0;
+    
+    /* Keep probe chains short: purge tombstones past 3/4 occupancy */
+    if ((phash_used + 1) * 4 > phash_size * 3) {
+        phash_rebuild(phash, phash_size);
+    }
+    phash_add(phash, phash_size, i);
+    nports_active++;
+    
     restore(mask);
     return i;
 }
@@ -565,29 +1167,33 @@ int32_t port_create(const char *name) {
 /* Delete a message port */
 syscall port_delete(int32_t portid) {
     intmask mask;
-    
-    if (portid < 0 || portid >= NPORTS) {
-        return SYSERR;
-    }
+    msgport_t *port;
     
     mask = disable();
     
-    if (ports[portid].state == PORT_FREE) {
+    if (portid < 0 || portid >= nports || ports[portid]->state == PORT_FREE) {
         restore(mask);
         return SYSERR;
     }
     
-    if (ports[portid].owner != currpid) {
+    port = ports[portid];
+    
+    if (port->owner != cpu_currpid()) {
         restore(mask);
         return SYSERR;
     }
     
-    semdelete(ports[portid].mutex);
-    semdelete(ports[portid].items);
-    semdelete(ports[portid].slots);
+    phash_del(portid);
+    
+    semdelete(port->mutex);
+    semdelete(port->items);
+    semdelete(port->slots);
     
-    ports[portid].state = PORT_FREE;
-    ports[portid].name[0] = '\0';
+    port->state = PORT_FREE;
+    port->name[0] = '\0';
+    port->nextfree = port_freelist;
+    port_freelist = portid;
+    nports_active--;
     
     restore(mask);
     return OK;
@@ -595,82 +1201,183 @@ syscall port_delete(int32_t portid) {
 
 /* Find a port by name */
 int32_t port_lookup(const char *name) {
-    int i;
+    int32_t portid;
     intmask mask;
     
-    if (name == NULL || name[0] == '\0') {
+    if (name == NULL || name[0] == '\0' ||
+        strnlen(name, PORT_NAMELEN) >= PORT_NAMELEN) {
         return SYSERR;
     }
     
     mask = disable();
-    
-    for (i = 0; i < NPORTS; i++) {
-        if (ports[i].state == PORT_ALLOC) {
-            if (strcmp(ports[i].name, name) == 0) {
-                restore(mask);
-                return i;
-            }
-        }
-    }
-    
+    portid = phash_find(name);
     restore(mask);
-    return SYSERR;
+    
+    return portid;
 }
 
 /* Send message to a port */
 syscall port_send(int32_t portid, umsg32 msg) {
-    if (portid < 0 || portid >= NPORTS || ports[portid].state == PORT_FREE) {
+    msgport_t *port = port_get(portid);
+    
+    if (port == NULL) {
         return SYSERR;
     }
     
-    wait(ports[portid].slots);
-    wait(ports[portid].mutex);
+    wait(port->slots);
+    wait(port->mutex);
     
-    ports[portid].messages[ports[portid].tail] = msg;
-    ports[portid].tail = (ports[portid].tail + 1) % PORT_MSG_SIZE;
-    ports[portid].count++;
+    port->messages[port->tail] = msg;
+    port->tail = (port->tail + 1) % PORT_MSG_SIZE;
+    port->count++;
     
-    signal(ports[portid].mutex);
-    signal(ports[portid].items);
+    signal(port->mutex);
+    signal(port->items);
     
     return OK;
 }
 
 /* Receive message from a port */
 umsg32 port_recv(int32_t portid) {
+    msgport_t *port = port_get(portid);
     umsg32 msg;
     
-    if (portid < 0 || portid >= NPORTS || ports[portid].state == PORT_FREE) {
+    if (port == NULL) {
         return SYSERR;
     }
     
-    wait(ports[portid].items);
-    wait(ports[portid].mutex);
+    wait(port->items);
+    wait(port->mutex);
     
-    msg = ports[portid].messages[ports[portid].head];
-    ports[portid].head = (ports[portid].head + 1) % PORT_MSG_SIZE;
-    ports[portid].count--;
+    msg = port->messages[port->head];
+    port->head = (port->head + 1) % PORT_MSG_SIZE;
+    port->count--;
     
-    signal(ports[portid].mutex);
-    signal(ports[portid].slots);
+    signal(port->mutex);
+    signal(port->slots);
     
     return msg;
 }
 
+/**
+ * port_send_batch - Send several messages to a port at once
+ * 
+ * @param portid: Port ID
+ * @param msgs: Messages to send
+ * @param n: Number of messages
+ * 
+ * Returns: Number of messages sent, or SYSERR on error
+ * 
+ * Blocks only until one slot is free, then moves as many messages as
+ * fit under a single mutex hold and wakes the receiver once.
+ */
+int32_t port_send_batch(int32_t portid, const umsg32 *msgs, int32_t n) {
+    msgport_t *port;
+    int32_t count, i;
+    
+    port = port_get(portid);
+    if (port == NULL || msgs == NULL || n <= 0) {
+        return SYSERR;
+    }
+    
+    if (wait(port->slots) == SYSERR) {
+        return SYSERR;
+    }
+    
+    count = 1;
+    if (n > 1) {
+        i = trywaitn(port->slots, n - 1);
+        if (i > 0) {
+            count += i;
+        }
+    }
+    
+    wait(port->mutex);
+    
+    for (i = 0; i < count; i++) {
+        port->messages[port->tail] = msgs[i];
+        port->tail = (port->tail + 1) % PORT_MSG_SIZE;
+    }
+    port->count += count;
+    
+    signal(port->mutex);
+    signaln(port->items, count);
+    
+    msg_stats.sent += count;
+    
+    return count;
+}
+
+/**
+ * port_recv_batch - Receive several messages from a port at once
+ * 
+ * @param portid: Port ID
+ * @param buf: Buffer for received messages
+ * @param max: Capacity of buf
+ * @param timeout: Milliseconds to wait for the first message
+ *                 (0 = poll, MSG_TIMEOUT_INF = wait forever)
+ * 
+ * Returns: Number of messages received, TIMEOUT, or SYSERR
+ */
+int32_t port_recv_batch(int32_t portid, umsg32 *buf, int32_t max,
+                        uint32_t timeout) {
+    msgport_t *port;
+    syscall status;
+    int32_t count, i;
+    
+    port = port_get(portid);
+    if (port == NULL || buf == NULL || max <= 0) {
+        return SYSERR;
+    }
+    
+    if (timeout == MSG_TIMEOUT_INF) {
+        status = wait(port->items);
+    } else {
+        status = timedwait(port->items, timeout);
+    }
+    
+    if (status == TIMEOUT) {
+        msg_stats.timeouts++;
+        return TIMEOUT;
+    }
+    if (status == SYSERR) {
+        msg_stats.failed++;
+        return SYSERR;
+    }
+    
+    count = 1;
+    if (max > 1) {
+        i = trywaitn(port->items, max - 1);
+        if (i > 0) {
+            count += i;
+        }
+    }
+    
+    wait(port->mutex);
+    
+    for (i = 0; i < count; i++) {
+        buf[i] = port->messages[port->head];
+        port->head = (port->head + 1) % PORT_MSG_SIZE;
+    }
+    port->count -= count;
+    
+    signal(port->mutex);
+    signaln(port->slots, count);
+    
+    msg_stats.received += count;
+    
+    return count;
+}
+
 /* Print message subsystem information */
 void msg_info(void) {
     int i;
     int active_mailboxes = 0;
-    int active_ports = 0;
     
     for (i = 0; i < NPROC; i++) {
         if (mailboxes[i].active) active_mailboxes++;
     }
     
-    for (i = 0; i < NPORTS; i++) {
-        if (ports[i].state == PORT_ALLOC) active_ports++;
-    }
-    
     kprintf("\n===== Message System Information =====\n");
     kprintf("Statistics:\n");
     kprintf("  Messages sent:     %llu\n", msg_stats.sent);
@@ -678,14 +1385,15 @@ void msg_info(void) {
     kprintf("  Failed operations: %llu\n", msg_stats.failed);
     kprintf("  Timeouts:          %llu\n", msg_stats.timeouts);
     kprintf("\nMailboxes: %d active / %d max\n", active_mailboxes, NPROC);
-    kprintf("Ports: %d active / %d max\n", active_ports, NPORTS);
+    kprintf("Ports: %d active / %d allocated (max %d)\n",
+            nports_active, nports, PORT_MAX_CAP);
     
-    if (active_ports > 0) {
+    if (nports_active > 0) {
         kprintf("\nActive ports:\n");
-        for (i = 0; i < NPORTS; i++) {
-            if (ports[i].state == PORT_ALLOC) {
+        for (i = 0; i < nports; i++) {
+            if (ports[i]->state == PORT_ALLOC) {
                 kprintf("  [%2d] '%s' (owner=%d, msgs=%d)\n",
-                        i, ports[i].name, ports[i].owner, ports[i].count);
+                        i, ports[i]->name, ports[i]->owner, ports[i]->count);
             }
         }
     }
@@ -4,43 +4,74 @@
 #include "../include/kernel.h"
 #include "../include/memory.h"
 #include "../include/interrupts.h"
+#include "sched.h"
 
 #include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
 
 extern proc_t proctab[];
-extern pid32 currpid;
 extern sem_t semtab[];
 extern void resched(void);
+extern void irq_resched(void);
+extern pid32 cpu_currpid(void);
 
+/*
+ * Stack watermarking. The lowest word of every stack holds a canary,
+ * and unless STACK_NOFILL is defined the rest is pre-filled with a
+ * pattern so stkhighwater() can find the deepest word ever written.
+ */
+#define STK_CANARY      0xC0DEDBADU
+#define STK_FILLBYTE    0xA5
+#define STK_FILLWORD    0xA5A5A5A5U
+
+/* Lowest usable word of a process stack */
+#define STK_LOW(pptr)   ((uint32_t *)((pptr)->pstkbase - (pptr)->pstklen))
+
+extern void memset_block(void *dest, uint8_t value, uint32_t nbytes);
+extern void sysring_release(pid32 pid);
+extern syscall sched_setdeadline(pid32 pid, uint32_t runtime, uint32_t period,
+                                 uint32_t deadline);
+
+/*
+ * Free PIDs live on a stack so allocation and release are O(1)
+ * regardless of how full the process table is. PID 0 (null process)
+ * is never on it. pid_in_use[] guards against double release.
+ */
 static bool pid_in_use[NPROC];
-static pid32 next_pid_hint = 1;
+static pid32 pid_free[NPROC];
+static int32_t pid_nfree;
+
+/* Build the free-PID stack; lowest PIDs are handed out first */
+void pid_init(void) {
+    pid32 pid;
+    
+    pid_nfree = 0;
+    for (pid = NPROC - 1; pid > 0; pid--) {
+        pid_in_use[pid] = false;
+        pid_free[pid_nfree++] = pid;
+    }
+    pid_in_use[0] = true;
+}
 
 /* Allocate a new process ID */
 static pid32 allocate_pid(void) {
-    int i;
     pid32 pid;
     
-    /* Search from hint position */
-    for (i = 0; i < NPROC; i++) {
-        pid = (next_pid_hint + i) % NPROC;
-        if (pid == 0) continue;  /* Skip PID 0 (null process) */
-        
-        if (!pid_in_use[pid] && proctab[pid].pstate == PR_FREE) {
-            pid_in_use[pid] = true;
-            next_pid_hint = (pid + 1) % NPROC;
-            return pid;
-        }
+    if (pid_nfree == 0) {
+        return SYSERR;
     }
     
-    return SYSERR;
+    pid = pid_free[--pid_nfree];
+    pid_in_use[pid] = true;
+    return pid;
 }
 
 /* Release a process ID for reuse */
 static void release_pid(pid32 pid) {
-    if (pid > 0 && pid < NPROC) {
+    if (pid > 0 && pid < NPROC && pid_in_use[pid]) {
         pid_in_use[pid] = false;
+        pid_free[pid_nfree++] = pid;
     }
 }
 
@@ -72,26 +103,38 @@ pid32 create(void *funcaddr, uint32_t ssize, uint32_t priority,
     
     ssize = (ssize + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
     
+    /*
+     * Take and fill the stack before disabling interrupts: nothing else
+     * can see it until it has a PID, and the fill is the one part of
+     * create() whose cost grows with the request.
+     */
+    saddr = (uint32_t *)getstk(ssize);
+    if (saddr == NULL || saddr == (uint32_t *)SYSERR) {
+        return SYSERR;
+    }
+    
+    /* getstk() returns the top; the stack spans the ssize bytes below it */
+    stack_top = saddr;
+#ifndef STACK_NOFILL
+    memset_block(stack_top - ssize / sizeof(uint32_t), STK_FILLBYTE, ssize);
+#endif
+    *(stack_top - ssize / sizeof(uint32_t)) = STK_CANARY;
+    
     mask = disable();
     
     pid = allocate_pid();
     if (pid == SYSERR) {
         restore(mask);
+        freestk(stack_top, ssize);
         return SYSERR;
     }
     
     pptr = &proctab[pid];
     
-    saddr = (uint32_t *)getstk(ssize);
-    if (saddr == NULL || saddr == (uint32_t *)SYSERR) {
-        release_pid(pid);
-        restore(mask);
-        return SYSERR;
-    }
-    
     /* Initialize PCB */
     pptr->pstate = PR_SUSP;
     pptr->pprio = priority;
+    sched_acct_reset(pid);              /* Also caches the ready level */
     pptr->pstkbase = (uint32_t)saddr;
     pptr->pstklen = ssize;
     pptr->pwait = -1;
@@ -112,7 +155,6 @@ pid32 create(void *funcaddr, uint32_t ssize, uint32_t priority,
     memset(pptr->pregs, 0, sizeof(pptr->pregs));
     
     /* Build initial stack frame */
-    stack_top = saddr + (ssize / sizeof(uint32_t));
     saddr = stack_top;
     
     va_start(ap, nargs);
@@ -157,7 +199,11 @@ pid32 create(void *funcaddr, uint32_t ssize, uint32_t priority,
  * Returns: Available process ID, or SYSERR if none available
  */
 pid32 newpid(void) {
-    return allocate_pid();
+    intmask mask = disable();
+    pid32 pid = allocate_pid();
+    
+    restore(mask);
+    return pid;
 }
 
 /*------------------------------------------------------------------------
@@ -201,6 +247,10 @@ void kill(pid32 pid) {
     
     /* Release stack memory */
     if (pptr->pstkbase != 0) {
+        if (*STK_LOW(pptr) != STK_CANARY) {
+            kprintf("kill: stack overflow in process %d (%s)\n",
+                    pid, pptr->pname);
+        }
         freestk((void *)pptr->pstkbase, pptr->pstklen);
         pptr->pstkbase = 0;
         pptr->pstklen = 0;
@@ -220,11 +270,14 @@ void kill(pid32 pid) {
     pptr->pmsg = 0;
     pptr->phasmsg = false;
     
+    sysring_release(pid);
+    sched_setdeadline(pid, 0, 0, 0);    /* Return any deadline bandwidth */
+    
     /* Release PID */
     release_pid(pid);
     
     /* If killing current process, reschedule */
-    if (pid == currpid) {
+    if (pid == cpu_currpid()) {
         resched();
     }
     
@@ -238,7 +291,7 @@ void kill(pid32 pid) {
  * This function is placed on the stack as the return address.
  */
 void userret(void) {
-    kill(currpid);
+    kill(cpu_currpid());
 }
 
 /**
@@ -250,7 +303,7 @@ void userret(void) {
  */
 void exit(int exitcode) {
     (void)exitcode;  /* Could store for wait() */
-    kill(currpid);
+    kill(cpu_currpid());
 }
 
 /*------------------------------------------------------------------------
@@ -263,7 +316,7 @@ void exit(int exitcode) {
  * Returns: Process ID of the currently executing process
  */
 pid32 getpid(void) {
-    return currpid;
+    return cpu_currpid();
 }
 
 /**
@@ -305,7 +358,7 @@ void ready(pid32 pid, bool resched_flag) {
     /* Process will be added to ready queue by scheduler */
     
     if (resched_flag) {
-        resched();
+        irq_resched();              /* Deferred if called from a softirq */
     }
     
     restore(mask);
@@ -407,6 +460,7 @@ syscall resume(pid32 pid) {
  */
 void sleep(uint32_t delay) {
     intmask mask;
+    pid32 self = cpu_currpid();
     
     if (delay == 0) {
         yield();
@@ -416,8 +470,8 @@ void sleep(uint32_t delay) {
     mask = disable();
     
     /* Store wakeup time in process args field */
-    proctab[currpid].pargs = delay;
-    proctab[currpid].pstate = PR_SLEEP;
+    proctab[self].pargs = delay;
+    proctab[self].pstate = PR_SLEEP;
     
     /* Add to sleep queue (handled by clock handler) */
     /* In full implementation, would insert into delta list */
@@ -500,7 +554,7 @@ syscall wait(pid32 pid) {
     /* Wait for process to terminate */
     while (proctab[pid].pstate != PR_FREE) {
         /* Block current process */
-        proctab[currpid].pstate = PR_WAIT;
+        proctab[cpu_currpid()].pstate = PR_WAIT;
         resched();
     }
     
@@ -570,18 +624,19 @@ syscall send(pid32 pid, umsg32 msg) {
 umsg32 receive(void) {
     intmask mask;
     umsg32 msg;
+    pid32 self = cpu_currpid();
     
     mask = disable();
     
     /* If no message, block */
-    while (!proctab[currpid].phasmsg) {
-        proctab[currpid].pstate = PR_RECV;
+    while (!proctab[self].phasmsg) {
+        proctab[self].pstate = PR_RECV;
         resched();
     }
     
     /* Get message */
-    msg = proctab[currpid].pmsg;
-    proctab[currpid].phasmsg = false;
+    msg = proctab[self].pmsg;
+    proctab[self].phasmsg = false;
     
     restore(mask);
     return msg;
@@ -597,12 +652,13 @@ umsg32 receive(void) {
 umsg32 recvclr(void) {
     intmask mask;
     umsg32 msg;
+    pid32 self = cpu_currpid();
     
     mask = disable();
     
-    if (proctab[currpid].phasmsg) {
-        msg = proctab[currpid].pmsg;
-        proctab[currpid].phasmsg = false;
+    if (proctab[self].phasmsg) {
+        msg = proctab[self].pmsg;
+        proctab[self].phasmsg = false;
     } else {
         msg = 0;
     }
@@ -621,26 +677,27 @@ umsg32 recvclr(void) {
 umsg32 recvtime(uint32_t maxwait) {
     intmask mask;
     umsg32 msg;
+    pid32 self = cpu_currpid();
     
     mask = disable();
     
     /* Check for existing message */
-    if (proctab[currpid].phasmsg) {
-        msg = proctab[currpid].pmsg;
-        proctab[currpid].phasmsg = false;
+    if (proctab[self].phasmsg) {
+        msg = proctab[self].pmsg;
+        proctab[self].phasmsg = false;
         restore(mask);
         return msg;
     }
     
     /* Set timeout and wait */
-    proctab[currpid].pargs = maxwait;
-    proctab[currpid].pstate = PR_RECV;
+    proctab[self].pargs = maxwait;
+    proctab[self].pstate = PR_RECV;
     resched();
     
     /* Check if we got a message or timed out */
-    if (proctab[currpid].phasmsg) {
-        msg = proctab[currpid].pmsg;
-        proctab[currpid].phasmsg = false;
+    if (proctab[self].phasmsg) {
+        msg = proctab[self].pmsg;
+        proctab[self].phasmsg = false;
     } else {
         msg = (umsg32)TIMEOUT;
     }
@@ -685,6 +742,56 @@ int32_t prcount(void) {
     return count;
 }
 
+/**
+ * stkhighwater - Get the deepest stack use of a process so far
+ * 
+ * @param pid: Process ID
+ * 
+ * Returns: Bytes of stack touched, or SYSERR (also when built with
+ *          STACK_NOFILL, or when the canary has been overwritten)
+ */
+int32_t stkhighwater(pid32 pid) {
+    intmask mask;
+    proc_t *pptr;
+    uint32_t *low;
+#ifndef STACK_NOFILL
+    uint32_t *p, *top;
+#endif
+    int32_t used;
+    
+    if (pid < 0 || pid >= NPROC) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    pptr = &proctab[pid];
+    
+    if (pptr->pstate == PR_FREE || pptr->pstkbase == 0) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    low = STK_LOW(pptr);
+    if (*low != STK_CANARY) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    /* Without the fill pattern there is nothing to measure */
+    used = SYSERR;
+#ifndef STACK_NOFILL
+    top = (uint32_t *)pptr->pstkbase;
+    p = low + 1;
+    while (p < top && *p == STK_FILLWORD) {
+        p++;
+    }
+    used = (int32_t)((char *)top - (char *)p);
+#endif
+    
+    restore(mask);
+    return used;
+}
+
 /**
  * getprocinfo - Get information about a process
  * 
@@ -700,6 +807,11 @@ typedef struct procinfo {
     char        name[NAMELEN];
     uint32_t    stksize;
     uint32_t    stkbase;
+    int32_t     stkused;        /* Stack high-water mark, SYSERR if unknown */
+    uint64_t    cputicks;       /* Clock ticks spent running */
+    uint32_t    nvcsw;          /* Voluntary context switches */
+    uint32_t    nivcsw;         /* Involuntary context switches */
+    uint32_t    latency[SCHED_LATBUCKETS];  /* log2(cycles) ready->run */
 } procinfo_t;
 
 syscall getprocinfo(pid32 pid, procinfo_t *info) {
@@ -724,6 +836,9 @@ syscall getprocinfo(pid32 pid, procinfo_t *info) {
     strncpy(info->name, pptr->pname, NAMELEN);
     info->stksize = pptr->pstklen;
     info->stkbase = pptr->pstkbase;
+    info->stkused = stkhighwater(pid);
+    sched_getacct(pid, &info->cputicks, &info->nvcsw, &info->nivcsw,
+                  info->latency);
     
     restore(mask);
     return OK;
@@ -24,17 +24,33 @@
  * Queue entry structure
  * 
  * Uses array-based implementation with indices as pointers.
- * Each entry can link to previous and next entries.
+ * Each entry can link to previous and next entries. Links are stored
+ * as 16-bit indices so an entry is 8 bytes and eight share a cache
+ * line; the entry state lives in the parallel qstate[] array rather
+ * than padding every entry out to 16 bytes. qstate[] is read once per
+ * call to validate the queue ID. Walks never touch it: within a queue
+ * only the tail has no successor, so QE_ISTAIL() tests the link the
+ * walk loads anyway.
  */
+typedef int16_t qid16;
+
+#if NQENT > 32767
+#error "NQENT too large for 16-bit queue links"
+#endif
+
 typedef struct qentry {
     pid32   key;        /* Key for ordering (priority or time) */
-    qid32   next;       /* Index of next entry */
-    qid32   prev;       /* Index of previous entry */
-    uint8_t state;      /* Entry state (free, head, tail, proc) */
+    qid16   next;       /* Index of next entry */
+    qid16   prev;       /* Index of previous entry */
 } qentry_t;
 
 /* Queue entry table */
-static qentry_t queuetab[NQENT];
+static qentry_t queuetab[NQENT] __attribute__((aligned(64)));
+
+/* Entry state (free, head, tail, proc), indexed like queuetab */
+static uint8_t qstate[NQENT];
+
+#define QE_ISTAIL(e)    (queuetab[(e)].next == EMPTY)
 
 /* Free list of queue entries */
 static qid32 qfree = EMPTY;
@@ -59,7 +75,7 @@ void init_queues(void) {
         queuetab[i].key = 0;
         queuetab[i].next = i + 1;
         queuetab[i].prev = i - 1;
-        queuetab[i].state = QE_FREE;
+        qstate[i] = QE_FREE;
     }
     
     /* Fix up free list */
@@ -105,13 +121,13 @@ qid32 newqueue(void) {
     }
     
     /* Initialize head */
-    queuetab[head].state = QE_HEAD;
+    qstate[head] = QE_HEAD;
     queuetab[head].key = MAXINT;
     queuetab[head].prev = EMPTY;
     queuetab[head].next = tail;
     
     /* Initialize tail */
-    queuetab[tail].state = QE_TAIL;
+    qstate[tail] = QE_TAIL;
     queuetab[tail].key = MININT;
     queuetab[tail].prev = head;
     queuetab[tail].next = EMPTY;
@@ -142,7 +158,7 @@ syscall freequeue(qid32 q) {
     mask = disable();
     
     /* Verify this is a queue head */
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return SYSERR;
     }
@@ -151,7 +167,7 @@ syscall freequeue(qid32 q) {
     tail = queuetab[head].next;
     
     /* Check if queue is empty */
-    if (tail == EMPTY || queuetab[tail].state != QE_TAIL) {
+    if (tail == EMPTY || qstate[tail] != QE_TAIL) {
         restore(mask);
         return SYSERR;
     }
@@ -163,7 +179,7 @@ syscall freequeue(qid32 q) {
     }
     
     /* Return head to free list */
-    queuetab[head].state = QE_FREE;
+    qstate[head] = QE_FREE;
     queuetab[head].next = qfree;
     if (qfree != EMPTY) {
         queuetab[qfree].prev = head;
@@ -171,7 +187,7 @@ syscall freequeue(qid32 q) {
     qfree = head;
     
     /* Return tail to free list */
-    queuetab[tail].state = QE_FREE;
+    qstate[tail] = QE_FREE;
     queuetab[tail].next = qfree;
     if (qfree != EMPTY) {
         queuetab[qfree].prev = tail;
@@ -198,12 +214,12 @@ syscall freequeue(qid32 q) {
 bool isempty(qid32 q) {
     qid32 tail;
     
-    if (q < 0 || q >= NQENT || queuetab[q].state != QE_HEAD) {
+    if (q < 0 || q >= NQENT || qstate[q] != QE_HEAD) {
         return true;  /* Invalid queue treated as empty */
     }
     
     tail = queuetab[q].next;
-    return (queuetab[tail].state == QE_TAIL && queuetab[tail].prev == q);
+    return QE_ISTAIL(tail);
 }
 
 /**
@@ -227,12 +243,12 @@ bool nonempty(qid32 q) {
 pid32 firstid(qid32 q) {
     qid32 first;
     
-    if (q < 0 || q >= NQENT || queuetab[q].state != QE_HEAD) {
+    if (q < 0 || q >= NQENT || qstate[q] != QE_HEAD) {
         return EMPTY;
     }
     
     first = queuetab[q].next;
-    if (queuetab[first].state == QE_TAIL) {
+    if (QE_ISTAIL(first)) {
         return EMPTY;  /* Queue is empty */
     }
     
@@ -249,17 +265,17 @@ pid32 firstid(qid32 q) {
 pid32 lastid(qid32 q) {
     qid32 tail, last;
     
-    if (q < 0 || q >= NQENT || queuetab[q].state != QE_HEAD) {
+    if (q < 0 || q >= NQENT || qstate[q] != QE_HEAD) {
         return EMPTY;
     }
     
     tail = queuetab[q].next;
-    while (queuetab[tail].state != QE_TAIL) {
+    while (!QE_ISTAIL(tail)) {
         tail = queuetab[tail].next;
     }
     
     last = queuetab[tail].prev;
-    if (queuetab[last].state == QE_HEAD) {
+    if (last == q) {
         return EMPTY;  /* Queue is empty */
     }
     
@@ -288,14 +304,14 @@ syscall enqueue(pid32 pid, qid32 q) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return SYSERR;
     }
     
     /* Find tail */
     tail = queuetab[q].next;
-    while (queuetab[tail].state != QE_TAIL) {
+    while (!QE_ISTAIL(tail)) {
         tail = queuetab[tail].next;
     }
     
@@ -314,7 +330,7 @@ syscall enqueue(pid32 pid, qid32 q) {
     /* Insert before tail */
     prev = queuetab[tail].prev;
     
-    queuetab[entry].state = QE_PROC;
+    qstate[entry] = QE_PROC;
     queuetab[entry].key = pid;
     queuetab[entry].next = tail;
     queuetab[entry].prev = prev;
@@ -344,14 +360,14 @@ pid32 dequeue(qid32 q) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return EMPTY;
     }
     
     first = queuetab[q].next;
     
-    if (queuetab[first].state == QE_TAIL) {
+    if (QE_ISTAIL(first)) {
         /* Queue is empty */
         restore(mask);
         return EMPTY;
@@ -365,7 +381,7 @@ pid32 dequeue(qid32 q) {
     queuetab[next].prev = q;
     
     /* Return entry to free list */
-    queuetab[first].state = QE_FREE;
+    qstate[first] = QE_FREE;
     queuetab[first].next = qfree;
     if (qfree != EMPTY) {
         queuetab[qfree].prev = first;
@@ -401,7 +417,7 @@ syscall insert(pid32 pid, qid32 q, int32_t key) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return SYSERR;
     }
@@ -420,12 +436,12 @@ syscall insert(pid32 pid, qid32 q, int32_t key) {
     
     /* Find insertion point (descending order) */
     curr = queuetab[q].next;
-    while (queuetab[curr].state == QE_PROC && queuetab[curr].key >= key) {
+    while (!QE_ISTAIL(curr) && queuetab[curr].key >= key) {
         curr = queuetab[curr].next;
     }
     
     /* Insert before curr */
-    queuetab[entry].state = QE_PROC;
+    qstate[entry] = QE_PROC;
     queuetab[entry].key = pid;  /* Store PID in key field */
     queuetab[entry].next = curr;
     queuetab[entry].prev = queuetab[curr].prev;
@@ -459,7 +475,7 @@ syscall insertd(pid32 pid, qid32 q, int32_t key) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return SYSERR;
     }
@@ -478,7 +494,7 @@ syscall insertd(pid32 pid, qid32 q, int32_t key) {
     
     /* Find insertion point and adjust deltas */
     curr = queuetab[q].next;
-    while (queuetab[curr].state == QE_PROC) {
+    while (!QE_ISTAIL(curr)) {
         if (key < proctab[queuetab[curr].key].pargs) {
             /* Reduce next entry's delta */
             proctab[queuetab[curr].key].pargs -= key;
@@ -489,7 +505,7 @@ syscall insertd(pid32 pid, qid32 q, int32_t key) {
     }
     
     /* Insert before curr */
-    queuetab[entry].state = QE_PROC;
+    qstate[entry] = QE_PROC;
     queuetab[entry].key = pid;
     queuetab[entry].next = curr;
     queuetab[entry].prev = queuetab[curr].prev;
@@ -536,19 +552,19 @@ pid32 getlast(qid32 q) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return EMPTY;
     }
     
     /* Find tail */
     tail = queuetab[q].next;
-    while (queuetab[tail].state != QE_TAIL) {
+    while (!QE_ISTAIL(tail)) {
         tail = queuetab[tail].next;
     }
     
     last = queuetab[tail].prev;
-    if (queuetab[last].state == QE_HEAD) {
+    if (last == q) {
         /* Queue is empty */
         restore(mask);
         return EMPTY;
@@ -560,7 +576,7 @@ pid32 getlast(qid32 q) {
     queuetab[tail].prev = queuetab[last].prev;
     
     /* Return entry to free list */
-    queuetab[last].state = QE_FREE;
+    qstate[last] = QE_FREE;
     queuetab[last].next = qfree;
     if (qfree != EMPTY) {
         queuetab[qfree].prev = last;
@@ -589,21 +605,21 @@ syscall getitem(pid32 pid, qid32 q) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return SYSERR;
     }
     
     /* Find the entry */
     curr = queuetab[q].next;
-    while (queuetab[curr].state == QE_PROC) {
+    while (!QE_ISTAIL(curr)) {
         if (queuetab[curr].key == pid) {
             /* Found - remove it */
             queuetab[queuetab[curr].prev].next = queuetab[curr].next;
             queuetab[queuetab[curr].next].prev = queuetab[curr].prev;
             
             /* Return to free list */
-            queuetab[curr].state = QE_FREE;
+            qstate[curr] = QE_FREE;
             queuetab[curr].next = qfree;
             if (qfree != EMPTY) {
                 queuetab[qfree].prev = curr;
@@ -642,13 +658,13 @@ int32_t queuelen(qid32 q) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return -1;
     }
     
     curr = queuetab[q].next;
-    while (queuetab[curr].state == QE_PROC) {
+    while (!QE_ISTAIL(curr)) {
         count++;
         curr = queuetab[curr].next;
     }
@@ -675,13 +691,13 @@ bool inqueue(pid32 pid, qid32 q) {
     
     mask = disable();
     
-    if (queuetab[q].state != QE_HEAD) {
+    if (qstate[q] != QE_HEAD) {
         restore(mask);
         return false;
     }
     
     curr = queuetab[q].next;
-    while (queuetab[curr].state == QE_PROC) {
+    while (!QE_ISTAIL(curr)) {
         if (queuetab[curr].key == pid) {
             restore(mask);
             return true;
@@ -0,0 +1,18 @@
+/* sched.h - Scheduler accounting shared with getprocinfo() */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+/*
+ * Ready-to-dispatch latency is kept per process as a log2 histogram of
+ * cycles: bucket b counts waits in [2^b, 2^(b+1)).
+ */
+#define SCHED_LATBUCKETS    32
+
+extern void sched_acct_reset(pid32 pid);
+extern syscall sched_getacct(pid32 pid, uint64_t *cputicks, uint32_t *nvcsw,
+                             uint32_t *nivcsw, uint32_t *latency);
+
+#endif /* _SCHED_H_ */
@@ -3,16 +3,30 @@
 #include "../include/kernel.h"
 #include "../include/process.h"
 #include "../include/interrupts.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdbool.h>
 
 extern sem_t semtab[];
 extern proc_t proctab[];
-extern pid32 currpid;
+extern pid32 cpu_currpid(void);
 extern void resched(void);
+extern void irq_resched(void);
+extern syscall deadline_arm(pid32 pid, uint32_t ticks, void (*expire)(pid32));
+extern bool deadline_cancel(pid32 pid);
+extern void sched_setprio(pid32 pid, int32_t prio);
+extern void sched_ready(pid32 pid);
+extern int32_t smp_ncpus(void);
+extern void cpu_relax(void);
+
+typedef volatile int spinlock_t;
+
+extern void spin_lock(spinlock_t *lock);
+extern void spin_unlock(spinlock_t *lock);
 
 static sid32 semfree = 0;
+static sid32 semnext[NSEM];             /* Free list links */
 static int32_t nsem_used = 0;
 
 static struct {
@@ -20,6 +34,79 @@ static struct {
     pid32 tail;
 } sem_queues[NSEM];
 
+/*
+ * Counts are updated atomically so that an uncontended wait() or
+ * signal() is one compare-and-swap with interrupts left on. Only the
+ * contended paths, which touch the wait queue, mask interrupts and take
+ * the per-semaphore lock. A contended wait() on SMP first spins for up
+ * to SEM_SPIN_LIMIT tries, since the holder may be about to release.
+ */
+#define SEM_SPIN_LIMIT  64
+
+/*
+ * A free semaphore holds SEM_DEAD as its count. Both fast paths reject
+ * it inside their CAS loops, so a wait() or signal() racing semdelete()
+ * either completes before the delete or falls through to the locked
+ * path, which then sees queue == -1.
+ */
+#define SEM_DEAD        INT32_MIN
+
+static spinlock_t semlock[NSEM];
+static spinlock_t semfree_lock;         /* Protects semfree and semnext */
+
+/* Take one unit if the count is positive */
+static inline bool sem_fast_take(sid32 sem) {
+    int32_t c = __atomic_load_n(&semtab[sem].count, __ATOMIC_RELAXED);
+    
+    while (c > 0) {
+        if (__atomic_compare_exchange_n(&semtab[sem].count, &c, c - 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Give one unit back if nobody is waiting */
+static inline bool sem_fast_give(sid32 sem) {
+    int32_t c = __atomic_load_n(&semtab[sem].count, __ATOMIC_RELAXED);
+    
+    while (c >= 0) {
+        if (__atomic_compare_exchange_n(&semtab[sem].count, &c, c + 1, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Add n to the count under the lock, returning the new value */
+static inline int32_t sem_add(sid32 sem, int32_t n) {
+    return __atomic_add_fetch(&semtab[sem].count, n, __ATOMIC_ACQ_REL);
+}
+
+/* Per-process wait links, so a timed-out waiter can leave in O(1) */
+static struct {
+    sid32 sem;          /* Semaphore being waited on, or -1 */
+    pid32 prev;         /* Previous waiter in that queue, or -1 */
+    bool  timedout;     /* Woken by its deadline rather than a signal */
+} semwait[NPROC];
+
+/*
+ * Mutex ownership for priority inheritance. Each process keeps a list
+ * of the mutexes it holds so its priority can be recomputed on unlock.
+ */
+static struct {
+    bool  ismutex;
+    pid32 owner;        /* Holder, or -1 */
+    sid32 nextheld;     /* Next mutex held by the same owner, or -1 */
+} mutextab[NSEM];
+
+static struct {
+    sid32   held;       /* First mutex held, or -1 */
+    int32_t baseprio;   /* Priority before any boost */
+} mutexheld[NPROC];
+
 /* Initialize semaphore subsystem */
 void init_semaphores(void) {
     int i;
@@ -29,19 +116,38 @@ void init_semaphores(void) {
         semtab[i].queue = -1;
         sem_queues[i].head = -1;
         sem_queues[i].tail = -1;
+        semlock[i] = 0;
+    }
+    
+    for (i = 0; i < NSEM; i++) {
+        mutextab[i].ismutex = false;
+        mutextab[i].owner = -1;
+        mutextab[i].nextheld = -1;
+    }
+    
+    for (i = 0; i < NPROC; i++) {
+        semwait[i].sem = -1;
+        semwait[i].prev = -1;
+        semwait[i].timedout = false;
+        mutexheld[i].held = -1;
+        mutexheld[i].baseprio = 0;
     }
     
-    for (i = 0; i < NSEM - 1; i++) {
-        semtab[i].count = i + 1;
+    for (i = 0; i < NSEM; i++) {
+        semtab[i].count = SEM_DEAD;
+        semnext[i] = (i < NSEM - 1) ? i + 1 : -1;
     }
-    semtab[NSEM - 1].count = -1;
     
+    semfree_lock = 0;
     semfree = 0;
     nsem_used = 0;
 }
 
 /* Add process to semaphore wait queue (FIFO) */
 static void enqueue_sem(sid32 sem, pid32 pid) {
+    semwait[pid].sem = sem;
+    semwait[pid].prev = sem_queues[sem].tail;
+    
     if (sem_queues[sem].tail == -1) {
         sem_queues[sem].head = pid;
         sem_queues[sem].tail = pid;
@@ -52,7 +158,28 @@ static void enqueue_sem(sid32 sem, pid32 pid) {
     proctab[pid].pwait = -1;
 }
 
-/* Remove first process from semaphore wait queue */
+/* Unlink a specific process from its semaphore wait queue */
+static void remove_sem(sid32 sem, pid32 pid) {
+    pid32 prev = semwait[pid].prev;
+    pid32 next = proctab[pid].pwait;
+    
+    if (prev == -1) {
+        sem_queues[sem].head = next;
+    } else {
+        proctab[prev].pwait = next;
+    }
+    
+    if (next == -1) {
+        sem_queues[sem].tail = prev;
+    } else {
+        semwait[next].prev = prev;
+    }
+    
+    proctab[pid].pwait = -1;
+    semwait[pid].sem = -1;
+    semwait[pid].prev = -1;
+}
+
 /* Remove first process from semaphore wait queue */
 static pid32 dequeue_sem(sid32 sem) {
     pid32 pid = sem_queues[sem].head;
@@ -61,13 +188,35 @@ static pid32 dequeue_sem(sid32 sem) {
         return -1;
     }
     
-    sem_queues[sem].head = proctab[pid].pwait;
-    if (sem_queues[sem].head == -1) {
-        sem_queues[sem].tail = -1;
+    remove_sem(sem, pid);
+    return pid;
+}
+
+/* Deadline expiry for timedwait(): back the waiter out of the queue */
+static void sem_timeout(pid32 pid) {
+    intmask mask;
+    sid32 sem;
+    
+    mask = disable();
+    sem = semwait[pid].sem;
+    if (sem < 0 || proctab[pid].pstate != PR_WAIT) {
+        restore(mask);
+        return;     /* Already signalled */
     }
     
-    proctab[pid].pwait = -1;
-    return pid;
+    /* A signal() on another CPU may have dequeued it since the check */
+    spin_lock(&semlock[sem]);
+    if (semwait[pid].sem != sem || proctab[pid].pstate != PR_WAIT) {
+        spin_unlock(&semlock[sem]);
+        restore(mask);
+        return;
+    }
+    remove_sem(sem, pid);
+    sem_add(sem, 1);
+    semwait[pid].timedout = true;
+    spin_unlock(&semlock[sem]);
+    ready(pid);
+    restore(mask);
 }
 
 /* Create a semaphore with initial count */
@@ -80,22 +229,26 @@ sid32 semcreate(int32_t count) {
     }
     
     mask = disable();
+    spin_lock(&semfree_lock);
     
     if (semfree == -1) {
+        spin_unlock(&semfree_lock);
         restore(mask);
         return SYSERR;
     }
     
     sem = semfree;
-    semfree = semtab[sem].count;
+    semfree = semnext[sem];
+    nsem_used++;
+    spin_unlock(&semfree_lock);
     
-    /* Initialize semaphore */
-    semtab[sem].count = count;
+    /* Initialize semaphore; the count store makes it live */
+    spin_lock(&semlock[sem]);
     semtab[sem].queue = 0;  /* Mark as allocated (not -1) */
     sem_queues[sem].head = -1;
     sem_queues[sem].tail = -1;
-    
-    nsem_used++;
+    __atomic_store_n(&semtab[sem].count, count, __ATOMIC_RELEASE);
+    spin_unlock(&semlock[sem]);
     
     restore(mask);
     return sem;
@@ -111,24 +264,30 @@ syscall semdelete(sid32 sem) {
     }
     
     mask = disable();
+    spin_lock(&semlock[sem]);
     
     if (semtab[sem].queue == -1) {
+        spin_unlock(&semlock[sem]);
         restore(mask);
         return SYSERR;
     }
     
+    /* Fail the fast paths first, then wake everyone */
+    __atomic_store_n(&semtab[sem].count, SEM_DEAD, __ATOMIC_RELEASE);
+    semtab[sem].queue = -1;
     while ((pid = dequeue_sem(sem)) != -1) {
         proctab[pid].pstate = PR_READY;
     }
+    spin_unlock(&semlock[sem]);
     
     /* Return semaphore to free list */
-    semtab[sem].queue = -1;
-    semtab[sem].count = semfree;
+    spin_lock(&semfree_lock);
+    semnext[sem] = semfree;
     semfree = sem;
-    
     nsem_used--;
+    spin_unlock(&semfree_lock);
     
-    resched();  /* Woken processes may have higher priority */
+    irq_resched();  /* Woken processes may have higher priority */
     restore(mask);
     return OK;
 }
@@ -158,15 +317,19 @@ syscall semreset(sid32 sem, int32_t count) {
         return SYSERR;
     }
     
+    spin_lock(&semlock[sem]);
+    
     /* Wake all waiting processes */
     while ((pid = dequeue_sem(sem)) != -1) {
         proctab[pid].pstate = PR_READY;
     }
     
     /* Set new count */
-    semtab[sem].count = count;
+    __atomic_store_n(&semtab[sem].count, count, __ATOMIC_RELEASE);
     
-    resched();
+    spin_unlock(&semlock[sem]);
+    
+    irq_resched();
     restore(mask);
     return OK;
 }
@@ -174,24 +337,43 @@ syscall semreset(sid32 sem, int32_t count) {
 /* Wait on semaphore (P operation) */
 syscall wait(sid32 sem) {
     intmask mask;
+    int32_t spins;
+    pid32 self = cpu_currpid();
     
-    if (sem < 0 || sem >= NSEM) {
+    if (sem < 0 || sem >= NSEM || semtab[sem].queue == -1) {
         return SYSERR;
     }
     
+    if (sem_fast_take(sem)) {
+        TRACE(TRACE_WAIT, sem, 0);
+        return OK;
+    }
+    
+    if (smp_ncpus() > 1) {
+        for (spins = 0; spins < SEM_SPIN_LIMIT; spins++) {
+            cpu_relax();
+            if (sem_fast_take(sem)) {
+                TRACE(TRACE_WAIT, sem, 0);
+                return OK;
+            }
+        }
+    }
+    
     mask = disable();
+    spin_lock(&semlock[sem]);
     
     if (semtab[sem].queue == -1) {
+        spin_unlock(&semlock[sem]);
         restore(mask);
         return SYSERR;
     }
     
-    semtab[sem].count--;
-    
-    if (semtab[sem].count < 0) {
-        proctab[currpid].pstate = PR_WAIT;
-        proctab[currpid].pwait = sem;
-        enqueue_sem(sem, currpid);
+    TRACE(TRACE_WAIT, sem, semtab[sem].count <= 0);
+    if (sem_add(sem, -1) < 0) {
+        proctab[self].pstate = PR_WAIT;
+        proctab[self].pwait = sem;
+        enqueue_sem(sem, self);
+        spin_unlock(&semlock[sem]);
         resched();
         
         /* Check if semaphore was deleted while waiting */
@@ -199,6 +381,8 @@ syscall wait(sid32 sem) {
             restore(mask);
             return SYSERR;
         }
+    } else {
+        spin_unlock(&semlock[sem]);
     }
     
     restore(mask);
@@ -208,30 +392,46 @@ syscall wait(sid32 sem) {
 /* Signal semaphore (V operation) */
 syscall signal(sid32 sem) {
     intmask mask;
-    pid32 pid;
+    pid32 pid = -1;
     
-    if (sem < 0 || sem >= NSEM) {
+    if (sem < 0 || sem >= NSEM || semtab[sem].queue == -1) {
         return SYSERR;
     }
     
+    if (sem_fast_give(sem)) {
+        TRACE(TRACE_SIGNAL, sem, -1);
+        return OK;
+    }
+    
     mask = disable();
+    spin_lock(&semlock[sem]);
     
     if (semtab[sem].queue == -1) {
+        spin_unlock(&semlock[sem]);
         restore(mask);
         return SYSERR;
     }
     
-    semtab[sem].count++;
-    
-    if (semtab[sem].count <= 0) {
+    if (sem_add(sem, 1) <= 0) {
         pid = dequeue_sem(sem);
         if (pid != -1) {
             proctab[pid].pstate = PR_READY;
             proctab[pid].pwait = -1;
-            resched();
         }
     }
     
+    spin_unlock(&semlock[sem]);
+    TRACE(TRACE_SIGNAL, sem, pid);
+    
+    /*
+     * Only switch if the woken process outranks us. From a softirq (an
+     * IRQ thread kick, a timer callback) the switch waits until the
+     * drain is done; see irq_resched().
+     */
+    if (pid != -1 && proctab[pid].pprio > proctab[cpu_currpid()].pprio) {
+        irq_resched();
+    }
+    
     restore(mask);
     return OK;
 }
@@ -240,6 +440,7 @@ syscall signal(sid32 sem) {
 syscall signaln(sid32 sem, int32_t n) {
     intmask mask;
     pid32 pid;
+    bool preempt = false;
     
     if (sem < 0 || sem >= NSEM || n <= 0) {
         return SYSERR;
@@ -252,20 +453,28 @@ syscall signaln(sid32 sem, int32_t n) {
         return SYSERR;
     }
     
+    spin_lock(&semlock[sem]);
+    
     while (n > 0) {
-        semtab[sem].count++;
-        
-        if (semtab[sem].count <= 0) {
+        if (sem_add(sem, 1) <= 0) {
             pid = dequeue_sem(sem);
             if (pid != -1) {
                 proctab[pid].pstate = PR_READY;
                 proctab[pid].pwait = -1;
+                if (proctab[pid].pprio > proctab[cpu_currpid()].pprio) {
+                    preempt = true;
+                }
             }
         }
         n--;
     }
     
-    resched();
+    spin_unlock(&semlock[sem]);
+    
+    if (preempt) {
+        irq_resched();
+    }
+    
     restore(mask);
     return OK;
 }
@@ -294,32 +503,40 @@ int32_t semcount(sid32 sem) {
 
 /* Non-blocking wait on semaphore */
 syscall trywait(sid32 sem) {
-    intmask mask;
-    
-    if (sem < 0 || sem >= NSEM) {
+    if (sem < 0 || sem >= NSEM || semtab[sem].queue == -1) {
         return SYSERR;
     }
     
-    mask = disable();
+    return sem_fast_take(sem) ? OK : SYSERR;
+}
+
+/* Non-blocking wait for up to max units; returns the number taken */
+int32_t trywaitn(sid32 sem, int32_t max) {
+    int32_t c, taken;
     
-    if (semtab[sem].queue == -1) {
-        restore(mask);
+    if (sem < 0 || sem >= NSEM || max <= 0 || semtab[sem].queue == -1) {
         return SYSERR;
     }
     
-    if (semtab[sem].count > 0) {
-        semtab[sem].count--;
-        restore(mask);
-        return OK;
-    }
+    c = __atomic_load_n(&semtab[sem].count, __ATOMIC_RELAXED);
+    do {
+        if (c <= 0) {
+            return (c == SEM_DEAD) ? SYSERR : 0;
+        }
+        taken = (c < max) ? c : max;
+    } while (!__atomic_compare_exchange_n(&semtab[sem].count, &c, c - taken,
+                                          true, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
     
-    restore(mask);
-    return SYSERR;
+    return taken;
 }
 
-/* Wait on semaphore with timeout */
+/* Wait on semaphore with timeout (in milliseconds) */
 syscall timedwait(sid32 sem, uint32_t timeout) {
     intmask mask;
+    uint32_t ticks;
+    bool timedout;
+    pid32 self = cpu_currpid();
     
     if (sem < 0 || sem >= NSEM) {
         return SYSERR;
@@ -332,32 +549,48 @@ syscall timedwait(sid32 sem, uint32_t timeout) {
         return SYSERR;
     }
     
-    if (semtab[sem].count > 0) {
-        semtab[sem].count--;
+    if (sem_fast_take(sem)) {
         restore(mask);
         return OK;
     }
     
-    /* Must wait with timeout */
-    semtab[sem].count--;
-    proctab[currpid].pstate = PR_WAIT;
-    proctab[currpid].pwait = sem;
-    proctab[currpid].pargs = timeout;  /* Store timeout */
-    enqueue_sem(sem, currpid);
+    if (timeout == 0) {
+        restore(mask);
+        return TIMEOUT;
+    }
+    
+    ticks = ms_to_ticks(timeout);
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    
+    /* Block on the semaphore and on the timer wheel at once */
+    spin_lock(&semlock[sem]);
+    if (sem_add(sem, -1) >= 0) {
+        spin_unlock(&semlock[sem]);     /* Released while we looked */
+        restore(mask);
+        return OK;
+    }
+    proctab[self].pstate = PR_WAIT;
+    semwait[self].timedout = false;
+    enqueue_sem(sem, self);
+    spin_unlock(&semlock[sem]);
+    deadline_arm(self, ticks, sem_timeout);
     
     resched();
     
+    deadline_cancel(self);
+    timedout = semwait[self].timedout;
+    semwait[self].timedout = false;
+    
     /* Check why we woke up */
     if (semtab[sem].queue == -1) {
         restore(mask);
         return SYSERR;  /* Semaphore deleted */
     }
     
-    /* Check if we timed out (would need clock handler support) */
-    /* For now, assume we got the semaphore */
-    
     restore(mask);
-    return OK;
+    return timedout ? TIMEOUT : OK;
 }
 
 /*------------------------------------------------------------------------
@@ -429,13 +662,130 @@ syscall seminfo(sid32 sem, int32_t *count, int32_t *nwait) {
  * Mutex Operations (Binary Semaphore Convenience)
  *------------------------------------------------------------------------*/
 
+/*
+ * Mutexes carry an owner and use priority inheritance: a process that
+ * blocks on a held mutex lends its priority to the owner, and through
+ * it to any owner that process is itself blocked behind. Unlock hands
+ * the mutex to the highest-priority waiter and drops the old owner back
+ * to the highest priority still owed to it.
+ */
+
+/* Record pid as owner of mutex, saving its base priority on first hold */
+static void mutex_take(sid32 mutex, pid32 pid) {
+    if (mutexheld[pid].held == -1) {
+        mutexheld[pid].baseprio = proctab[pid].pprio;
+    }
+    
+    mutextab[mutex].owner = pid;
+    mutextab[mutex].nextheld = mutexheld[pid].held;
+    mutexheld[pid].held = mutex;
+}
+
+/* Unlink mutex from its owner's held list */
+static void mutex_drop(sid32 mutex) {
+    pid32 owner = mutextab[mutex].owner;
+    sid32 *link = &mutexheld[owner].held;
+    
+    while (*link != -1 && *link != mutex) {
+        link = &mutextab[*link].nextheld;
+    }
+    if (*link == mutex) {
+        *link = mutextab[mutex].nextheld;
+    }
+    
+    mutextab[mutex].owner = -1;
+    mutextab[mutex].nextheld = -1;
+}
+
+/* Highest-priority process waiting on a mutex, or -1 */
+static pid32 mutex_top_waiter(sid32 mutex) {
+    pid32 pid, best = -1;
+    
+    for (pid = sem_queues[mutex].head; pid != -1; pid = proctab[pid].pwait) {
+        if (best == -1 || proctab[pid].pprio > proctab[best].pprio) {
+            best = pid;
+        }
+    }
+    
+    return best;
+}
+
+/* Recompute pid's priority from its base and the waiters it holds up */
+static void mutex_reprio(pid32 pid) {
+    int32_t prio = mutexheld[pid].baseprio;
+    sid32 m;
+    pid32 top;
+    
+    if (mutexheld[pid].held == -1) {
+        sched_setprio(pid, prio);
+        return;
+    }
+    
+    for (m = mutexheld[pid].held; m != -1; m = mutextab[m].nextheld) {
+        top = mutex_top_waiter(m);
+        if (top != -1 && proctab[top].pprio > prio) {
+            prio = proctab[top].pprio;
+        }
+    }
+    
+    sched_setprio(pid, prio);
+}
+
+/*
+ * chprio() on a process that holds mutexes: record prio as its base and
+ * recompute the effective priority, so a later unlock doesn't undo the
+ * change. Returns false, leaving the priority alone, if pid holds none.
+ * Caller has interrupts disabled.
+ */
+bool mutex_setbase(pid32 pid, int32_t prio) {
+    if (mutexheld[pid].held == -1) {
+        return false;
+    }
+    
+    mutexheld[pid].baseprio = prio;
+    mutex_reprio(pid);
+    return true;
+}
+
+/* Push prio down the chain of owners starting at mutex */
+static void mutex_boost(sid32 mutex, int32_t prio) {
+    pid32 owner;
+    sid32 next;
+    int32_t hops;
+    
+    /* Bounded by NPROC so a deadlock cycle cannot spin forever */
+    for (hops = 0; hops < NPROC; hops++) {
+        owner = mutextab[mutex].owner;
+        if (owner == -1 || proctab[owner].pprio >= prio) {
+            return;
+        }
+        
+        sched_setprio(owner, prio);
+        
+        next = semwait[owner].sem;
+        if (next < 0 || !mutextab[next].ismutex ||
+            proctab[owner].pstate != PR_WAIT) {
+            return;
+        }
+        mutex = next;
+    }
+}
+
 /**
- * mutex_create - Create a mutex (binary semaphore initialized to 1)
+ * mutex_create - Create a mutex with priority inheritance
  * 
  * Returns: Semaphore ID, or SYSERR on error
  */
 sid32 mutex_create(void) {
-    return semcreate(1);
+    sid32 mutex = semcreate(1);
+    
+    if (mutex != SYSERR) {
+        mutextab[mutex].ismutex = true;
+        mutextab[mutex].owner = -1;
+        mutextab[mutex].nextheld = -1;
+    }
+    
+    return mutex;
 }
 
 /**
@@ -444,9 +794,49 @@ sid32 mutex_create(void) {
  * @param mutex: Mutex (semaphore) ID
  * 
  * Returns: OK on success, SYSERR on error
+ * 
+ * If the mutex is held, the owner (and whoever it is blocked behind)
+ * runs at no less than the caller's priority until it unlocks.
  */
 syscall mutex_lock(sid32 mutex) {
-    return wait(mutex);
+    intmask mask;
+    pid32 self = cpu_currpid();
+    
+    if (mutex < 0 || mutex >= NSEM) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (semtab[mutex].queue == -1 || !mutextab[mutex].ismutex ||
+        mutextab[mutex].owner == self) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    spin_lock(&semlock[mutex]);
+    
+    if (sem_add(mutex, -1) >= 0) {
+        mutex_take(mutex, self);
+        spin_unlock(&semlock[mutex]);
+        restore(mask);
+        return OK;
+    }
+    
+    proctab[self].pstate = PR_WAIT;
+    enqueue_sem(mutex, self);
+    mutex_boost(mutex, proctab[self].pprio);
+    spin_unlock(&semlock[mutex]);
+    resched();
+    
+    /* Ownership was handed over by mutex_unlock() */
+    if (semtab[mutex].queue == -1 || mutextab[mutex].owner != self) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    restore(mask);
+    return OK;
 }
 
 /**
@@ -457,7 +847,31 @@ syscall mutex_lock(sid32 mutex) {
  * Returns: OK if acquired, SYSERR if would block
  */
 syscall mutex_trylock(sid32 mutex) {
-    return trywait(mutex);
+    intmask mask;
+    
+    if (mutex < 0 || mutex >= NSEM) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (semtab[mutex].queue == -1 || !mutextab[mutex].ismutex) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    /* Take and record the owner together, so a locker never sees neither */
+    spin_lock(&semlock[mutex]);
+    if (!sem_fast_take(mutex)) {
+        spin_unlock(&semlock[mutex]);
+        restore(mask);
+        return SYSERR;
+    }
+    mutex_take(mutex, cpu_currpid());
+    spin_unlock(&semlock[mutex]);
+    
+    restore(mask);
+    return OK;
 }
 
 /**
@@ -465,10 +879,50 @@ syscall mutex_trylock(sid32 mutex) {
  * 
  * @param mutex: Mutex (semaphore) ID
  * 
- * Returns: OK on success, SYSERR on error
+ * Returns: OK on success, SYSERR on error (including not the owner)
  */
 syscall mutex_unlock(sid32 mutex) {
-    return signal(mutex);
+    intmask mask;
+    pid32 pid;
+    pid32 self = cpu_currpid();
+    
+    if (mutex < 0 || mutex >= NSEM) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (semtab[mutex].queue == -1 || !mutextab[mutex].ismutex ||
+        mutextab[mutex].owner != self) {
+        restore(mask);
+        return SYSERR;
+    }
+    
+    spin_lock(&semlock[mutex]);
+    
+    mutex_drop(mutex);
+    sem_add(mutex, 1);
+    
+    pid = mutex_top_waiter(mutex);
+    if (pid != -1) {
+        remove_sem(mutex, pid);
+        mutex_take(mutex, pid);
+        mutex_reprio(pid);      /* Inherit from the waiters left behind */
+    }
+    
+    mutex_reprio(self);
+    
+    spin_unlock(&semlock[mutex]);
+    
+    if (pid != -1) {
+        sched_ready(pid);
+        if (proctab[pid].pprio > proctab[self].pprio) {
+            irq_resched();
+        }
+    }
+    
+    restore(mask);
+    return OK;
 }
 
 /**
@@ -479,5 +933,24 @@ syscall mutex_unlock(sid32 mutex) {
  * Returns: OK on success, SYSERR on error
  */
 syscall mutex_destroy(sid32 mutex) {
+    intmask mask;
+    pid32 owner;
+    
+    if (mutex < 0 || mutex >= NSEM) {
+        return SYSERR;
+    }
+    
+    mask = disable();
+    
+    if (mutextab[mutex].ismutex) {
+        owner = mutextab[mutex].owner;
+        if (owner != -1) {
+            mutex_drop(mutex);
+            mutex_reprio(owner);
+        }
+        mutextab[mutex].ismutex = false;
+    }
+    
+    restore(mask);
     return semdelete(mutex);
 }
@@ -4,11 +4,35 @@
 #include "../include/process.h"
 #include "../include/interrupts.h"
 #include "../include/memory.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 
+struct procinfo;
+extern syscall getprocinfo(pid32 pid, struct procinfo *info);
+extern syscall sched_getstats(uint64_t *ctxsw, uint64_t *preemptions,
+                              uint64_t *rescheds);
+extern const void *clock_timepage(void);
+extern syscall sched_setdeadline(pid32 pid, uint32_t runtime, uint32_t period,
+                                 uint32_t deadline);
+extern syscall sched_setclass(pid32 pid, bool fair);
+extern syscall setquantum_pid(pid32 pid, uint32_t ticks);
+extern uint32_t trace_control(uint32_t mask);
+extern void trace_reset(void);
+extern int32_t trace_dump(void *buf, uint32_t max);
+extern uint32_t trace_lost(void);
+extern syscall boot_stat(int32_t stage, uint64_t *cycles, uint64_t *ticks);
+extern int32_t port_send_batch(int32_t portid, const umsg32 *msgs, int32_t n);
+extern int32_t port_recv_batch(int32_t portid, umsg32 *buf, int32_t max,
+                               uint32_t timeout);
+
+typedef volatile int spinlock_t;
+
+extern intmask spin_lock_irqsave(spinlock_t *lock);
+extern void spin_unlock_irqrestore(spinlock_t *lock, intmask mask);
+
 #define SYS_CREATE      1
 #define SYS_KILL        2 
 #define SYS_GETPID      3
@@ -21,6 +45,11 @@
 #define SYS_WAIT        10 
 #define SYS_GETPRIO     11 
 #define SYS_SETPRIO     12
+#define SYS_PROCINFO    13
+#define SYS_SCHEDSTAT   14
+#define SYS_SETDEADLINE 15
+#define SYS_SETCLASS    16
+#define SYS_SETSLICE    17
 
 /* Memory system calls */
 #define SYS_GETMEM      20
@@ -50,370 +79,789 @@
 #define SYS_RECEIVE     51      
 #define SYS_RECVCLR     52      
 #define SYS_RECVTIME    53 
+#define SYS_PORTSEND_BATCH  54
+#define SYS_PORTRECV_BATCH  55
 
 /* Time system calls */
 #define SYS_GETTIME     60 
 #define SYS_GETTICKS    61
 #define SYS_GETUPTIME   62
+#define SYS_TIMEPAGE    63
 
 /* System control */
 #define SYS_SHUTDOWN    70 
 #define SYS_REBOOT      71
+#define SYS_TRACECTL    72
+#define SYS_TRACEDUMP   73
+#define SYS_BOOTSTAT    74
+
+/* Batched submission */
+#define SYS_RINGSETUP   80
+#define SYS_SUBMIT      81
 
 /* Maximum system call number */
 #define NSYSCALLS       128
 
-typedef int32_t (*syscall_handler_t)(void *args);
+/*
+ * Handlers take the trap's argument registers directly. Every handler
+ * has the same six-register signature so the table can be a flat
+ * array of function pointers; each one uses only the arguments it
+ * needs. The table is built at compile time and lives in read-only
+ * memory. Numbers with no static entry can still be bound at run time
+ * through syscall_register(), which dispatch consults only on a miss.
+ *
+ * Per-call statistics cost a counter update on every trap, so they are
+ * compiled in only with SYSCALL_STATS.
+ */
+typedef uintptr_t sysarg_t;             /* Register width, so pointers fit */
+
+#define SYSCALL_ARGS    sysarg_t a0, sysarg_t a1, sysarg_t a2, \
+                        sysarg_t a3, sysarg_t a4, sysarg_t a5
+
+typedef int32_t (*syscall_handler_t)(SYSCALL_ARGS);
 
 typedef struct {
     syscall_handler_t   handler; 
     const char          *name;
     uint8_t             nargs;
-    bool                enabled;
 } syscall_entry_t;
 
-static syscall_entry_t syscall_table[NSYSCALLS];
+#define SYSCALL_ENTRY(fn, name, n)  { sys_##fn, name, n }
 
+#ifdef SYSCALL_STATS
 static struct {
     uint64_t total_calls;
     uint64_t calls[NSYSCALLS];
     uint64_t errors;
 } syscall_stats;
 
-/*  System Call Argument Access */
+#define SYSCALL_COUNT(num)  do { syscall_stats.total_calls++; \
+                                 syscall_stats.calls[num]++; } while (0)
+#define SYSCALL_ERROR()     (syscall_stats.errors++)
+#else
+#define SYSCALL_COUNT(num)  do { } while (0)
+#define SYSCALL_ERROR()     do { } while (0)
+#endif
+
+/*
+ * Submission rings. A process that makes many small calls in a row can
+ * queue them in a shared ring and have the kernel run a whole batch in
+ * one SYS_SUBMIT trap, or, with SYSRING_SQPOLL, with no trap at all: a
+ * kernel poller drains the ring. The process owns sq_tail and cq_head,
+ * the kernel owns sq_head and cq_tail; each side publishes its index
+ * with a release store after the entries it covers are written.
+ *
+ * Polled entries run in the poller's context, which every SQPOLL ring
+ * shares, so anything that records or acts on the caller (a message's
+ * sender, a memory block's owner, a semaphore's creator) would be
+ * charged to the poller. Only read-only queries that neither block nor
+ * depend on who asks are run there (see sysring_pollable()); the rest
+ * complete with SYSERR and must go through SYS_SUBMIT instead.
+ */
+#define SYSRING_ENTRIES     32          /* Power of two */
+#define SYSRING_MASK        (SYSRING_ENTRIES - 1)
+#define SYSRING_SQPOLL      0x01        /* Drained by the kernel poller */
+#define SYSRING_POLL_MS     1           /* Poller nap when all rings idle */
 
 typedef struct {
-    uint32_t arg[8];    /* Up to 8 arguments */
-} syscall_args_t;
+    uint32_t    num;                    /* Syscall number */
+    uint32_t    user_data;              /* Copied to the completion */
+    sysarg_t    args[6];
+} sysring_sqe_t;
+
+typedef struct {
+    uint32_t    user_data;
+    int32_t     result;
+} sysring_cqe_t;
+
+typedef struct {
+    volatile uint32_t   sq_head;
+    volatile uint32_t   sq_tail;
+    volatile uint32_t   cq_head;
+    volatile uint32_t   cq_tail;
+    uint32_t            flags;
+    uint32_t            dropped;        /* Entries with no completion room */
+    sysring_sqe_t       sq[SYSRING_ENTRIES];
+    sysring_cqe_t       cq[SYSRING_ENTRIES];
+} sysring_t;
+
+static int32_t sysring_setup(uint32_t flags, sysring_t **out);
+static int32_t sysring_submit(pid32 pid, uint32_t max, bool polled);
 
 /*  System Call Handlers (Process) */
 
-static int32_t sys_create(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    void *funcaddr = (void *)a->arg[0];
-    uint32_t ssize = a->arg[1];
-    pri16 priority = (pri16)a->arg[2];
-    const char *name = (const char *)a->arg[3];
-    uint32_t nargs = a->arg[4];
-    /* Additional args would be in a->arg[5..] */
+static int32_t sys_create(SYSCALL_ARGS) {
+    void *funcaddr = (void *)a0;
+    uint32_t ssize = a1;
+    pri16 priority = (pri16)a2;
+    const char *name = (const char *)a3;
+    uint32_t nargs = a4;
+    /* A sixth argument would arrive in a5 */
     
     return create(funcaddr, ssize, priority, name, nargs);
 }
 
-static int32_t sys_kill(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    pid32 pid = (pid32)a->arg[0];
+static int32_t sys_kill(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
     
     return kill(pid);
 }
 
-static int32_t sys_getpid(void *args) {
-    (void)args;
+static int32_t sys_getpid(SYSCALL_ARGS) {
     return getpid();
 }
 
-static int32_t sys_suspend(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    pid32 pid = (pid32)a->arg[0];
+static int32_t sys_suspend(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
     
     return suspend(pid);
 }
 
-static int32_t sys_resume(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    pid32 pid = (pid32)a->arg[0];
+static int32_t sys_resume(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
     
     return resume(pid);
 }
 
-static int32_t sys_yield(void *args) {
-    (void)args;
+static int32_t sys_yield(SYSCALL_ARGS) {
     yield();
     return OK;
 }
 
-static int32_t sys_sleep(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    uint32_t delay = a->arg[0];
+static int32_t sys_sleep(SYSCALL_ARGS) {
+    uint32_t delay = a0;
     
     return sleep(delay);
 }
 
-static int32_t sys_sleepms(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    uint32_t msec = a->arg[0];
+static int32_t sys_sleepms(SYSCALL_ARGS) {
+    uint32_t msec = a0;
     
     return sleepms(msec);
 }
 
-static int32_t sys_exit(void *args) {
-    (void)args;
+static int32_t sys_exit(SYSCALL_ARGS) {
     /* Kill the current process */
     kill(getpid());
     /* Should not return */
     return OK;
 }
 
-static int32_t sys_getprio(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    pid32 pid = (pid32)a->arg[0];
+static int32_t sys_getprio(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
     
     return getprio(pid);
 }
 
-static int32_t sys_setprio(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    pid32 pid = (pid32)a->arg[0];
-    pri16 newprio = (pri16)a->arg[1];
+static int32_t sys_setprio(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
+    pri16 newprio = (pri16)a1;
     
     return chprio(pid, newprio);
 }
 
+static int32_t sys_procinfo(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
+    struct procinfo *info = (struct procinfo *)a1;
+    
+    return getprocinfo(pid, info);
+}
+
+static int32_t sys_schedstat(SYSCALL_ARGS) {
+    uint64_t *ctxsw = (uint64_t *)a0;
+    uint64_t *preemptions = (uint64_t *)a1;
+    uint64_t *rescheds = (uint64_t *)a2;
+    
+    return sched_getstats(ctxsw, preemptions, rescheds);
+}
+
+static int32_t sys_setdeadline(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
+    uint32_t runtime = a1;
+    uint32_t period = a2;
+    uint32_t deadline = a3;
+    
+    return sched_setdeadline(pid, runtime, period, deadline);
+}
+
+static int32_t sys_setclass(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
+    bool fair = (a1 != 0);
+    
+    return sched_setclass(pid, fair);
+}
+
+static int32_t sys_setslice(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
+    uint32_t ticks = a1;
+    
+    return setquantum_pid(pid, ticks);
+}
+
 /*  System Call Handlers (Memory) */
 
-static int32_t sys_getmem(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    uint32_t nbytes = a->arg[0];
+static int32_t sys_getmem(SYSCALL_ARGS) {
+    uint32_t nbytes = a0;
     
     return (int32_t)getmem(nbytes);
 }
 
-static int32_t sys_freemem(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    void *block = (void *)a->arg[0];
-    uint32_t nbytes = a->arg[1];
+static int32_t sys_freemem(SYSCALL_ARGS) {
+    void *block = (void *)a0;
+    uint32_t nbytes = a1;
     
     return freemem(block, nbytes);
 }
 
 /*  System Call Handlers (Semaphore) */
 
-static int32_t sys_semcreate(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    int32_t count = (int32_t)a->arg[0];
+static int32_t sys_semcreate(SYSCALL_ARGS) {
+    int32_t count = (int32_t)a0;
     
     return semcreate(count);
 }
 
-static int32_t sys_semdelete(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    sid32 sem = (sid32)a->arg[0];
+static int32_t sys_semdelete(SYSCALL_ARGS) {
+    sid32 sem = (sid32)a0;
     
     return semdelete(sem);
 }
 
-static int32_t sys_wait_sem(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    sid32 sem = (sid32)a->arg[0];
+static int32_t sys_wait_sem(SYSCALL_ARGS) {
+    sid32 sem = (sid32)a0;
     
     return wait(sem);
 }
 
-static int32_t sys_signal(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    sid32 sem = (sid32)a->arg[0];
+static int32_t sys_signal(SYSCALL_ARGS) {
+    sid32 sem = (sid32)a0;
     
     return signal(sem);
 }
 
-static int32_t sys_signaln(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    sid32 sem = (sid32)a->arg[0];
-    int32_t count = (int32_t)a->arg[1];
+static int32_t sys_signaln(SYSCALL_ARGS) {
+    sid32 sem = (sid32)a0;
+    int32_t count = (int32_t)a1;
     
     return signaln(sem, count);
 }
 
-static int32_t sys_semcount(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    sid32 sem = (sid32)a->arg[0];
+static int32_t sys_semcount(SYSCALL_ARGS) {
+    sid32 sem = (sid32)a0;
     
     return semcount(sem);
 }
 
 /* System Call Handlers (Message Passing) */
 
-static int32_t sys_send(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    pid32 pid = (pid32)a->arg[0];
-    umsg32 msg = (umsg32)a->arg[1];
+static int32_t sys_send(SYSCALL_ARGS) {
+    pid32 pid = (pid32)a0;
+    umsg32 msg = (umsg32)a1;
     
     return send(pid, msg);
 }
 
-static int32_t sys_receive(void *args) {
-    (void)args;
+static int32_t sys_receive(SYSCALL_ARGS) {
     return receive();
 }
 
-static int32_t sys_recvclr(void *args) {
-    (void)args;
+static int32_t sys_recvclr(SYSCALL_ARGS) {
     return recvclr();
 }
 
-static int32_t sys_recvtime(void *args) {
-    syscall_args_t *a = (syscall_args_t *)args;
-    uint32_t timeout = a->arg[0];
+static int32_t sys_recvtime(SYSCALL_ARGS) {
+    uint32_t timeout = a0;
     
     return recvtime(timeout);
 }
 
+static int32_t sys_port_send_batch(SYSCALL_ARGS) {
+    int32_t portid = (int32_t)a0;
+    const umsg32 *msgs = (const umsg32 *)a1;
+    int32_t n = (int32_t)a2;
+    
+    return port_send_batch(portid, msgs, n);
+}
+
+static int32_t sys_port_recv_batch(SYSCALL_ARGS) {
+    int32_t portid = (int32_t)a0;
+    umsg32 *buf = (umsg32 *)a1;
+    int32_t max = (int32_t)a2;
+    uint32_t timeout = a3;
+    
+    return port_recv_batch(portid, buf, max, timeout);
+}
+
 /* System Call Handlers (Time) */
 
-static int32_t sys_gettime(void *args) {
-    (void)args;
+static int32_t sys_gettime(SYSCALL_ARGS) {
     return gettime();
 }
 
-static int32_t sys_getticks(void *args) {
-    (void)args;
+static int32_t sys_getticks(SYSCALL_ARGS) {
     return (int32_t)(getticks() & 0xFFFFFFFF);
 }
 
-static int32_t sys_shutdown(void *args) {
-    (void)args;
+static int32_t sys_timepage(SYSCALL_ARGS) {
+    const void **out = (const void **)a0;
+    
+    if (out == NULL) {
+        return SYSERR;
+    }
+    *out = clock_timepage();
+    return OK;
+}
+
+static int32_t sys_shutdown(SYSCALL_ARGS) {
     shutdown();
     return OK;
 }
 
-static int32_t sys_reboot(void *args) {
-    (void)args;
+static int32_t sys_reboot(SYSCALL_ARGS) {
     reboot();
     return OK;
 }
 
+static int32_t sys_tracectl(SYSCALL_ARGS) {
+    uint32_t mask = a0;
+    bool reset = (a1 != 0);
+    
+    if (reset) {
+        trace_reset();
+    }
+    return (int32_t)trace_control(mask);
+}
+
+static int32_t sys_tracedump(SYSCALL_ARGS) {
+    void *buf = (void *)a0;
+    uint32_t max = a1;
+    uint32_t *lost = (uint32_t *)a2;
+    
+    if (lost != NULL) {
+        *lost = trace_lost();
+    }
+    return trace_dump(buf, max);
+}
+
+static int32_t sys_bootstat(SYSCALL_ARGS) {
+    return boot_stat((int32_t)a0, (uint64_t *)a1, (uint64_t *)a2);
+}
+
+/* System Call Handlers (Batched Submission) */
+
+static int32_t sys_ringsetup(SYSCALL_ARGS) {
+    uint32_t flags = a0;
+    sysring_t **out = (sysring_t **)a1;
+    
+    if (out == NULL) {
+        return SYSERR;
+    }
+    return sysring_setup(flags, out);
+}
+
+static int32_t sys_submit(SYSCALL_ARGS) {
+    uint32_t max = a0;
+    
+    return sysring_submit(getpid(), max, false);
+}
+
+/* System Call Table */
+
+static const syscall_entry_t syscall_table[NSYSCALLS] = {
+    /* Process */
+    [SYS_CREATE]        = SYSCALL_ENTRY(create, "create", 5),
+    [SYS_KILL]          = SYSCALL_ENTRY(kill, "kill", 1),
+    [SYS_GETPID]        = SYSCALL_ENTRY(getpid, "getpid", 0),
+    [SYS_SUSPEND]       = SYSCALL_ENTRY(suspend, "suspend", 1),
+    [SYS_RESUME]        = SYSCALL_ENTRY(resume, "resume", 1),
+    [SYS_YIELD]         = SYSCALL_ENTRY(yield, "yield", 0),
+    [SYS_SLEEP]         = SYSCALL_ENTRY(sleep, "sleep", 1),
+    [SYS_SLEEPMS]       = SYSCALL_ENTRY(sleepms, "sleepms", 1),
+    [SYS_EXIT]          = SYSCALL_ENTRY(exit, "exit", 0),
+    [SYS_GETPRIO]       = SYSCALL_ENTRY(getprio, "getprio", 1),
+    [SYS_SETPRIO]       = SYSCALL_ENTRY(setprio, "chprio", 2),
+    [SYS_PROCINFO]      = SYSCALL_ENTRY(procinfo, "getprocinfo", 2),
+    [SYS_SCHEDSTAT]     = SYSCALL_ENTRY(schedstat, "schedstat", 3),
+    [SYS_SETDEADLINE]   = SYSCALL_ENTRY(setdeadline, "setdeadline", 4),
+    [SYS_SETCLASS]      = SYSCALL_ENTRY(setclass, "setclass", 2),
+    [SYS_SETSLICE]      = SYSCALL_ENTRY(setslice, "setslice", 2),
+    
+    /* Memory */
+    [SYS_GETMEM]        = SYSCALL_ENTRY(getmem, "getmem", 1),
+    [SYS_FREEMEM]       = SYSCALL_ENTRY(freemem, "freemem", 2),
+    
+    /* Semaphore */
+    [SYS_SEMCREATE]     = SYSCALL_ENTRY(semcreate, "semcreate", 1),
+    [SYS_SEMDELETE]     = SYSCALL_ENTRY(semdelete, "semdelete", 1),
+    [SYS_WAIT_SEM]      = SYSCALL_ENTRY(wait_sem, "wait", 1),
+    [SYS_SIGNAL]        = SYSCALL_ENTRY(signal, "signal", 1),
+    [SYS_SIGNALN]       = SYSCALL_ENTRY(signaln, "signaln", 2),
+    [SYS_SEMCOUNT]      = SYSCALL_ENTRY(semcount, "semcount", 1),
+    
+    /* Message passing */
+    [SYS_SEND]          = SYSCALL_ENTRY(send, "send", 2),
+    [SYS_RECEIVE]       = SYSCALL_ENTRY(receive, "receive", 0),
+    [SYS_RECVCLR]       = SYSCALL_ENTRY(recvclr, "recvclr", 0),
+    [SYS_RECVTIME]      = SYSCALL_ENTRY(recvtime, "recvtime", 1),
+    [SYS_PORTSEND_BATCH] = SYSCALL_ENTRY(port_send_batch, "port_send_batch", 3),
+    [SYS_PORTRECV_BATCH] = SYSCALL_ENTRY(port_recv_batch, "port_recv_batch", 4),
+    
+    /* Time */
+    [SYS_GETTIME]       = SYSCALL_ENTRY(gettime, "gettime", 0),
+    [SYS_GETTICKS]      = SYSCALL_ENTRY(getticks, "getticks", 0),
+    [SYS_TIMEPAGE]      = SYSCALL_ENTRY(timepage, "timepage", 1),
+    
+    /* System control */
+    [SYS_SHUTDOWN]      = SYSCALL_ENTRY(shutdown, "shutdown", 0),
+    [SYS_REBOOT]        = SYSCALL_ENTRY(reboot, "reboot", 0),
+    [SYS_TRACECTL]      = SYSCALL_ENTRY(tracectl, "tracectl", 2),
+    [SYS_TRACEDUMP]     = SYSCALL_ENTRY(tracedump, "tracedump", 3),
+    [SYS_BOOTSTAT]      = SYSCALL_ENTRY(bootstat, "bootstat", 3),
+    
+    /* Batched submission */
+    [SYS_RINGSETUP]     = SYSCALL_ENTRY(ringsetup, "ringsetup", 2),
+    [SYS_SUBMIT]        = SYSCALL_ENTRY(submit, "submit", 1),
+};
+
+/* Run-time bindings for numbers the static table leaves empty */
+static syscall_entry_t syscall_ext[NSYSCALLS];
+
 /* System Call Initialization */
 
 void syscall_init(void) {
     int i;
     
-    /* Clear syscall table */
     for (i = 0; i < NSYSCALLS; i++) {
-        syscall_table[i].handler = NULL;
-        syscall_table[i].name = "unused";
-        syscall_table[i].nargs = 0;
-        syscall_table[i].enabled = false;
+        syscall_ext[i].handler = NULL;
+        syscall_ext[i].name = NULL;
+        syscall_ext[i].nargs = 0;
     }
     
+#ifdef SYSCALL_STATS
     /* Clear statistics */
     syscall_stats.total_calls = 0;
     syscall_stats.errors = 0;
     for (i = 0; i < NSYSCALLS; i++) {
         syscall_stats.calls[i] = 0;
     }
-    
-    /* Register process syscalls */
-    syscall_register(SYS_CREATE, sys_create, "create", 5);
-    syscall_register(SYS_KILL, sys_kill, "kill", 1);
-    syscall_register(SYS_GETPID, sys_getpid, "getpid", 0);
-    syscall_register(SYS_SUSPEND, sys_suspend, "suspend", 1);
-    syscall_register(SYS_RESUME, sys_resume, "resume", 1);
-    syscall_register(SYS_YIELD, sys_yield, "yield", 0);
-    syscall_register(SYS_SLEEP, sys_sleep, "sleep", 1);
-    syscall_register(SYS_SLEEPMS, sys_sleepms, "sleepms", 1);
-    syscall_register(SYS_EXIT, sys_exit, "exit", 0);
-    syscall_register(SYS_GETPRIO, sys_getprio, "getprio", 1);
-    syscall_register(SYS_SETPRIO, sys_setprio, "chprio", 2);
-    
-    /* Register memory syscalls */
-    syscall_register(SYS_GETMEM, sys_getmem, "getmem", 1);
-    syscall_register(SYS_FREEMEM, sys_freemem, "freemem", 2);
-    
-    /* Register semaphore syscalls */
-    syscall_register(SYS_SEMCREATE, sys_semcreate, "semcreate", 1);
-    syscall_register(SYS_SEMDELETE, sys_semdelete, "semdelete", 1);
-    syscall_register(SYS_WAIT_SEM, sys_wait_sem, "wait", 1);
-    syscall_register(SYS_SIGNAL, sys_signal, "signal", 1);
-    syscall_register(SYS_SIGNALN, sys_signaln, "signaln", 2);
-    syscall_register(SYS_SEMCOUNT, sys_semcount, "semcount", 1);
-    
-    /* Register message syscalls */
-    syscall_register(SYS_SEND, sys_send, "send", 2);
-    syscall_register(SYS_RECEIVE, sys_receive, "receive", 0);
-    syscall_register(SYS_RECVCLR, sys_recvclr, "recvclr", 0);
-    syscall_register(SYS_RECVTIME, sys_recvtime, "recvtime", 1);
-    
-    /* Register time syscalls */
-    syscall_register(SYS_GETTIME, sys_gettime, "gettime", 0);
-    syscall_register(SYS_GETTICKS, sys_getticks, "getticks", 0);
-    
-    /* Register system control syscalls */
-    syscall_register(SYS_SHUTDOWN, sys_shutdown, "shutdown", 0);
-    syscall_register(SYS_REBOOT, sys_reboot, "reboot", 0);
+#endif
 }
 
+/* Bind a handler to a number the static table does not define */
 syscall syscall_register(int num, syscall_handler_t handler,
                          const char *name, uint8_t nargs) {
     if (num < 0 || num >= NSYSCALLS) {
         return SYSERR;
     }
     
-    if (handler == NULL) {
+    if (handler == NULL || syscall_table[num].handler != NULL) {
         return SYSERR;
     }
     
-    syscall_table[num].handler = handler;
-    syscall_table[num].name = name;
-    syscall_table[num].nargs = nargs;
-    syscall_table[num].enabled = true;
+    syscall_ext[num].handler = handler;
+    syscall_ext[num].name = name;
+    syscall_ext[num].nargs = nargs;
     
     return OK;
 }
 
 syscall syscall_unregister(int num) {
-    if (num < 0 || num >= NSYSCALLS) {
+    if (num < 0 || num >= NSYSCALLS || syscall_ext[num].handler == NULL) {
         return SYSERR;
     }
     
-    syscall_table[num].handler = NULL;
-    syscall_table[num].name = "unused";
-    syscall_table[num].nargs = 0;
-    syscall_table[num].enabled = false;
+    syscall_ext[num].handler = NULL;
+    syscall_ext[num].name = NULL;
+    syscall_ext[num].nargs = 0;
     
     return OK;
 }
 
+/* Look up the entry for a syscall number, or NULL if unused */
+static const syscall_entry_t *syscall_entry(int num) {
+    if (num < 0 || num >= NSYSCALLS) {
+        return NULL;
+    }
+    
+    if (syscall_table[num].handler != NULL) {
+        return &syscall_table[num];
+    }
+    
+    if (syscall_ext[num].handler != NULL) {
+        return &syscall_ext[num];
+    }
+    
+    return NULL;
+}
+
 /* System Call Dispatch */
 
-int32_t syscall_dispatch(int num, void *args) {
-    int32_t result;
+int32_t syscall_dispatch(uint32_t num, SYSCALL_ARGS) {
+    syscall_handler_t handler;
+    
+    /* The unsigned compare also rejects negative numbers */
+    if (num < NSYSCALLS) {
+        handler = syscall_table[num].handler;
+        if (handler == NULL) {
+            handler = syscall_ext[num].handler;
+        }
+        if (handler != NULL) {
+            SYSCALL_COUNT(num);
+            TRACE(TRACE_SYSCALL, num, a0);
+            return handler(a0, a1, a2, a3, a4, a5);
+        }
+    }
+    
+    SYSCALL_ERROR();
+    return SYSERR;
+}
 
-    if (num < 0 || num >= NSYSCALLS) {
-        syscall_stats.errors++;
+/*
+ * syscall_handler - C side of the syscall trap
+ * 
+ * The vector stub saves state and calls this with the syscall number
+ * and the six argument registers, and then stores the result in the
+ * return register:
+ * 
+ *   x86:    EAX = number, args EBX, ECX, EDX, ESI, EDI, EBP
+ *   x86-64: RAX = number, args RDI, RSI, RDX, R10, R8, R9
+ *   ARM:    R7 = number, args R0-R5
+ *   RISC-V: A7 = number, args A0-A5
+ */
+int32_t syscall_handler(uint32_t num, SYSCALL_ARGS) {
+    return syscall_dispatch(num, a0, a1, a2, a3, a4, a5);
+}
+
+/* Submission Rings */
+
+static sysring_t *sysring[NPROC];
+static pid32 sysring_poller_pid = -1;
+
+/*
+ * The ring is shared with its owner, so lifetime state is kept here.
+ * A consumer pins the ring for the length of a drain; a ring released
+ * while pinned is parked in zombie and freed by the last unpin.
+ */
+static struct {
+    uint32_t    refs;
+    sysring_t   *zombie;
+} sysring_ref[NPROC];
+
+static spinlock_t sysring_lock;         /* Protects the tables above */
+
+static void sysring_poller(void);
+
+/* Allocate (or find) the calling process's ring and store its address */
+static int32_t sysring_setup(uint32_t flags, sysring_t **out) {
+    intmask mask;
+    pid32 pid = getpid();
+    pid32 poller = SYSERR;
+    sysring_t *ring;
+    
+    mask = spin_lock_irqsave(&sysring_lock);
+    
+    /* A previous owner of this PID still has a drain in flight */
+    if (sysring_ref[pid].zombie != NULL) {
+        spin_unlock_irqrestore(&sysring_lock, mask);
         return SYSERR;
     }
+    
+    ring = sysring[pid];
+    if (ring == NULL) {
+        ring = (sysring_t *)getmem(sizeof(sysring_t));
+        if (ring == (sysring_t *)SYSERR) {
+            spin_unlock_irqrestore(&sysring_lock, mask);
+            return SYSERR;
+        }
+        memset(ring, 0, sizeof(sysring_t));
+        sysring[pid] = ring;
+    }
+    ring->flags = flags;
+    
+    if ((flags & SYSRING_SQPOLL) && sysring_poller_pid == -1) {
+        poller = create(sysring_poller, 1024, PRIORITY_DEFAULT, "sqpoll", 0);
+        sysring_poller_pid = (poller != SYSERR) ? poller : -1;
+    }
+    spin_unlock_irqrestore(&sysring_lock, mask);
+    
+    /* Resumed outside the lock, since it may switch to the poller */
+    if (poller != SYSERR) {
+        resume(poller);
+    }
+    *out = ring;
+    return OK;
+}
 
-    if (!syscall_table[num].enabled || syscall_table[num].handler == NULL) {
-        syscall_stats.errors++;
-        return SYSERR;
+/* Pin pid's ring for a drain; returns NULL if it has none */
+static sysring_t *sysring_pin(pid32 pid) {
+    intmask mask;
+    sysring_t *ring;
+    
+    mask = spin_lock_irqsave(&sysring_lock);
+    ring = sysring[pid];
+    if (ring != NULL) {
+        sysring_ref[pid].refs++;
     }
+    spin_unlock_irqrestore(&sysring_lock, mask);
+    return ring;
+}
 
-    syscall_stats.total_calls++;
-    syscall_stats.calls[num]++;
+/* Drop a pin, freeing the ring if it was released meanwhile */
+static void sysring_unpin(pid32 pid) {
+    intmask mask;
+    sysring_t *dead = NULL;
     
-    result = syscall_table[num].handler(args);
+    mask = spin_lock_irqsave(&sysring_lock);
+    if (--sysring_ref[pid].refs == 0 && sysring_ref[pid].zombie != NULL) {
+        dead = sysring_ref[pid].zombie;
+        sysring_ref[pid].zombie = NULL;
+    }
+    spin_unlock_irqrestore(&sysring_lock, mask);
     
-    return result;
+    if (dead != NULL) {
+        freemem(dead, sizeof(sysring_t));
+    }
 }
 
-void syscall_handler(void) {
-    /* Architecture-specific:
-     * 
-     * x86: syscall number in EAX, args in EBX, ECX, EDX, ESI, EDI
-     * ARM: syscall number in R7, args in R0-R5
-     * RISC-V: syscall number in A7, args in A0-A5
-     * 
-     * Implementation would extract these into syscall_args_t
-     * and call syscall_dispatch().
-     */
+/* True if num may run in the shared poller's context */
+static bool sysring_pollable(uint32_t num) {
+    switch (num) {
+    case SYS_GETPRIO:
+    case SYS_PROCINFO:
+    case SYS_SCHEDSTAT:
+    case SYS_SEMCOUNT:
+    case SYS_GETTIME:
+    case SYS_GETTICKS:
+    case SYS_TIMEPAGE:
+    case SYS_TRACEDUMP:
+    case SYS_BOOTSTAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * sysring_submit - Run queued submissions from a process's ring
+ * 
+ * @param pid: Owner of the ring
+ * @param max: Most entries to consume, 0 for all that are queued
+ * @param polled: Called from the poller rather than SYS_SUBMIT
+ * 
+ * Returns: Number of entries consumed, or SYSERR if pid has no ring
+ * 
+ * Stops early when the completion ring is full, so no result is lost.
+ * Each ring has one consumer: the poller for SYSRING_SQPOLL rings, the
+ * owner's SYS_SUBMIT otherwise. Each entry is copied out of the shared
+ * ring before it is checked, so the owner can't change it afterwards.
+ */
+static int32_t sysring_submit(pid32 pid, uint32_t max, bool polled) {
+    sysring_t *ring;
+    sysring_sqe_t sqe;
+    sysring_cqe_t *cqe;
+    uint32_t head, tail, cqtail;
+    int32_t done = 0;
+    
+    if (pid < 0 || pid >= NPROC || (ring = sysring_pin(pid)) == NULL) {
+        return SYSERR;
+    }
+    
+    if (((ring->flags & SYSRING_SQPOLL) != 0) != polled) {
+        sysring_unpin(pid);
+        return 0;
+    }
+    
+    head = ring->sq_head;
+    tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    cqtail = ring->cq_tail;
+    
+    while (head != tail && (max == 0 || (uint32_t)done < max)) {
+        if (cqtail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) >=
+            SYSRING_ENTRIES) {
+            break;
+        }
+        
+        sqe = ring->sq[head & SYSRING_MASK];
+        cqe = &ring->cq[cqtail & SYSRING_MASK];
+        
+        cqe->user_data = sqe.user_data;
+        if (sqe.num == SYS_SUBMIT || sqe.num == SYS_RINGSETUP ||
+            (polled && !sysring_pollable(sqe.num))) {
+            cqe->result = SYSERR;
+        } else {
+            cqe->result = syscall_dispatch(sqe.num, sqe.args[0], sqe.args[1],
+                                           sqe.args[2], sqe.args[3],
+                                           sqe.args[4], sqe.args[5]);
+        }
+        head++;
+        cqtail++;
+        done++;
+        
+        /* Publish as we go so a blocking entry does not hide earlier results */
+        __atomic_store_n(&ring->sq_head, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->cq_tail, cqtail, __ATOMIC_RELEASE);
+    }
+    
+    sysring_unpin(pid);
+    return done;
+}
+
+/* Kernel process that drains SYSRING_SQPOLL rings */
+static void sysring_poller(void) {
+    pid32 pid;
+    int32_t busy;
+    
+    while (true) {
+        busy = 0;
+        for (pid = 0; pid < NPROC; pid++) {
+            if (sysring[pid] != NULL && (sysring[pid]->flags & SYSRING_SQPOLL)) {
+                busy += sysring_submit(pid, 0, true);
+            }
+        }
+        if (busy <= 0) {
+            sleepms(SYSRING_POLL_MS);
+        }
+    }
+}
+
+/* Free a process's ring when it exits, or once its last drain ends */
+void sysring_release(pid32 pid) {
+    intmask mask;
+    sysring_t *dead = NULL;
+    
+    if (pid < 0 || pid >= NPROC) {
+        return;
+    }
+    
+    mask = spin_lock_irqsave(&sysring_lock);
+    if (sysring[pid] != NULL) {
+        if (sysring_ref[pid].refs == 0) {
+            dead = sysring[pid];
+        } else {
+            sysring_ref[pid].zombie = sysring[pid];
+        }
+        sysring[pid] = NULL;
+    }
+    
+    /* A killed poller is re-created by the next SQPOLL setup */
+    if (pid == sysring_poller_pid) {
+        sysring_poller_pid = -1;
+    }
+    spin_unlock_irqrestore(&sysring_lock, mask);
+    
+    if (dead != NULL) {
+        freemem(dead, sizeof(sysring_t));
+    }
 }
 
 const char *syscall_name(int num) {
+    const syscall_entry_t *e = syscall_entry(num);
+    
     if (num < 0 || num >= NSYSCALLS) {
         return NULL;
     }
     
-    return syscall_table[num].name;
+    return (e != NULL) ? e->name : "unused";
 }
 
 
@@ -422,10 +870,15 @@ int64_t syscall_count(int num) {
         return -1;
     }
     
+#ifdef SYSCALL_STATS
     return syscall_stats.calls[num];
+#else
+    return -1;
+#endif
 }
 
 void syscall_stats_print(void) {
+#ifdef SYSCALL_STATS
     int i;
     
     kprintf("\n System Call Statistics \n");
@@ -434,21 +887,25 @@ void syscall_stats_print(void) {
     
     kprintf("Per-syscall counts:\n");
     for (i = 0; i < NSYSCALLS; i++) {
-        if (syscall_table[i].enabled && syscall_stats.calls[i] > 0) {
+        if (syscall_entry(i) != NULL && syscall_stats.calls[i] > 0) {
             kprintf("  [%3d] %-12s: %llu\n", 
-                    i, syscall_table[i].name, syscall_stats.calls[i]);
+                    i, syscall_name(i), syscall_stats.calls[i]);
         }
     }
+#else
+    kprintf("\n System call statistics not built (SYSCALL_STATS)\n");
+#endif
 }
 
 void syscall_list(void) {
+    const syscall_entry_t *e;
     int i;
     
     kprintf("\n Registered System Calls \n");
     for (i = 0; i < NSYSCALLS; i++) {
-        if (syscall_table[i].enabled) {
-            kprintf("  [%3d] %-12s (%d args)\n",
-                    i, syscall_table[i].name, syscall_table[i].nargs);
+        e = syscall_entry(i);
+        if (e != NULL) {
+            kprintf("  [%3d] %-12s (%d args)\n", i, e->name, e->nargs);
         }
     }
 }
@@ -476,7 +933,7 @@ static inline int32_t _syscall0(int num) {
     return result;
 }
 
-static inline int32_t _syscall1(int num, uint32_t arg1) {
+static inline int32_t _syscall1(int num, sysarg_t arg1) {
     int32_t result;
     
 #if defined(__i386__)
@@ -497,7 +954,7 @@ static inline int32_t _syscall1(int num, uint32_t arg1) {
 }
 
 
-static inline int32_t _syscall2(int num, uint32_t arg1, uint32_t arg2) {
+static inline int32_t _syscall2(int num, sysarg_t arg1, sysarg_t arg2) {
     int32_t result;
     
 #if defined(__i386__)
@@ -517,7 +974,7 @@ static inline int32_t _syscall2(int num, uint32_t arg1, uint32_t arg2) {
     return result;
 }
 
-static inline int32_t _syscall3(int num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+static inline int32_t _syscall3(int num, sysarg_t arg1, sysarg_t arg2, sysarg_t arg3) {
     int32_t result;
     
 #if defined(__i386__)
@@ -537,4 +994,91 @@ static inline int32_t _syscall3(int num, uint32_t arg1, uint32_t arg2, uint32_t
     return result;
 }
 
+/*
+ * User-side time reads from the kernel time page (SYS_TIMEPAGE stores
+ * its address once). The layout must match timepage_t in clock.c.
+ */
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t clktime;
+    uint64_t clkticks;
+    uint32_t days;
+    uint8_t  hours;
+    uint8_t  minutes;
+    uint8_t  seconds;
+} _timepage_t;
+
+static const _timepage_t *_timepage;
+
+static inline const _timepage_t *_timepage_map(void) {
+    if (_timepage == NULL) {
+        _syscall1(SYS_TIMEPAGE, (sysarg_t)&_timepage);
+    }
+    return _timepage;
+}
+
+static inline uint64_t _vdso_getticks(void) {
+    const _timepage_t *tp = _timepage_map();
+    uint32_t seq;
+    uint64_t ticks;
+    
+    do {
+        seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE);
+        ticks = tp->clkticks;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&tp->seq, __ATOMIC_RELAXED));
+    
+    return ticks;
+}
+
+static inline uint32_t _vdso_gettime(void) {
+    const _timepage_t *tp = _timepage_map();
+    uint32_t seq, secs;
+    
+    do {
+        seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE);
+        secs = tp->clktime;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&tp->seq, __ATOMIC_RELAXED));
+    
+    return secs;
+}
+
+/* Queue one call on a ring; returns false if the ring is full */
+static inline bool _sysring_push(sysring_t *ring, uint32_t num,
+                                 uint32_t user_data, sysarg_t a0,
+                                 sysarg_t a1, sysarg_t a2) {
+    uint32_t tail = ring->sq_tail;
+    sysring_sqe_t *sqe;
+    
+    if (tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) >=
+        SYSRING_ENTRIES) {
+        return false;
+    }
+    
+    sqe = &ring->sq[tail & SYSRING_MASK];
+    sqe->num = num;
+    sqe->user_data = user_data;
+    sqe->args[0] = a0;
+    sqe->args[1] = a1;
+    sqe->args[2] = a2;
+    sqe->args[3] = sqe->args[4] = sqe->args[5] = 0;
+    
+    __atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Take one completion; returns false if none is ready */
+static inline bool _sysring_reap(sysring_t *ring, sysring_cqe_t *out) {
+    uint32_t head = ring->cq_head;
+    
+    if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    
+    *out = ring->cq[head & SYSRING_MASK];
+    __atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
 #endif 
@@ -0,0 +1,186 @@
+/* trace.c - Kernel event tracing */
+
+#include "../include/kernel.h"
+#include "../include/process.h"
+#include "../include/interrupts.h"
+#include "trace.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+#ifndef NCPU
+#define NCPU            4
+#endif
+
+extern pid32 cpu_currpid(void);
+extern volatile uint64_t clkticks;
+extern uint64_t get_cycles(void);
+extern int32_t cpuid(void);
+
+/*
+ * Each CPU records into its own ring, so writers never contend. A slot
+ * is reserved with one atomic add on the ring head, which also orders
+ * an interrupt that traces on top of the code it interrupted. The slot
+ * is published by storing its sequence number last; a reader takes a
+ * record only if the sequence matches before and after the copy, so a
+ * record overwritten mid-read is dropped rather than returned torn.
+ */
+#define TRACE_RING_SIZE     1024            /* Records per CPU, power of 2 */
+#define TRACE_RING_MASK     (TRACE_RING_SIZE - 1)
+
+typedef struct trace_rec {
+    uint32_t    seq;                /* Slot index + 1 once published */
+    uint16_t    event;
+    uint16_t    cpu;
+    uint64_t    cycles;
+    uint32_t    ticks;              /* Low 32 bits of clkticks */
+    pid32       pid;
+    uint32_t    a0;
+    uint32_t    a1;
+} trace_rec_t;
+
+typedef struct trace_ring {
+    uint32_t    head;               /* Next slot to reserve */
+    uint32_t    tail;               /* Next slot trace_dump() reads */
+    uint32_t    lost;               /* Overwritten before being read */
+    trace_rec_t rec[TRACE_RING_SIZE];
+} __attribute__((aligned(64))) trace_ring_t;
+
+/* Bit n set = event n enabled; read on every tracepoint */
+volatile uint32_t trace_mask = 0;
+
+static trace_ring_t trace_rings[NCPU];
+
+/**
+ * trace_record - Append an event to this CPU's trace ring
+ * 
+ * @param event: Event ID
+ * @param a0: First event argument
+ * @param a1: Second event argument
+ * 
+ * Callable from any context, including interrupt handlers.
+ */
+void trace_record(uint16_t event, uint32_t a0, uint32_t a1) {
+    int32_t cpu = cpuid();
+    trace_ring_t *r;
+    trace_rec_t *t;
+    uint32_t slot;
+    
+    if (cpu < 0 || cpu >= NCPU) {
+        return;
+    }
+    
+    r = &trace_rings[cpu];
+    slot = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+    t = &r->rec[slot & TRACE_RING_MASK];
+    
+    __atomic_store_n(&t->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    t->event = event;
+    t->cpu = (uint16_t)cpu;
+    t->cycles = get_cycles();
+    t->ticks = (uint32_t)clkticks;
+    t->pid = cpu_currpid();
+    t->a0 = a0;
+    t->a1 = a1;
+    __atomic_store_n(&t->seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * trace_control - Enable or disable trace events
+ * 
+ * @param mask: Bitmask of events to enable (0 disables tracing)
+ * 
+ * Returns: Previous mask
+ */
+uint32_t trace_control(uint32_t mask) {
+    return __atomic_exchange_n(&trace_mask, mask & TRACE_ALL, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * trace_reset - Discard all recorded events
+ */
+void trace_reset(void) {
+    intmask mask;
+    int32_t cpu;
+    
+    mask = disable();
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        trace_rings[cpu].tail = __atomic_load_n(&trace_rings[cpu].head,
+                                                __ATOMIC_ACQUIRE);
+        trace_rings[cpu].lost = 0;
+    }
+    restore(mask);
+}
+
+/**
+ * trace_dump - Copy unread trace records out of the rings
+ * 
+ * @param buf: Destination for records
+ * @param max: Capacity of buf in records
+ * 
+ * Returns: Number of records copied, or SYSERR on error
+ * 
+ * Records are consumed, so repeated calls stream the trace. Each CPU's
+ * records are in order; merge across CPUs on the cycles field. Events
+ * overwritten before they were read are counted in trace_lost().
+ * There must be only one reader at a time.
+ */
+int32_t trace_dump(void *buf, uint32_t max) {
+    trace_rec_t *out = (trace_rec_t *)buf;
+    trace_ring_t *r;
+    trace_rec_t *t;
+    trace_rec_t copy;
+    uint32_t head, slot;
+    int32_t cpu, n = 0;
+    
+    if (buf == NULL) {
+        return SYSERR;
+    }
+    
+    for (cpu = 0; cpu < NCPU && (uint32_t)n < max; cpu++) {
+        r = &trace_rings[cpu];
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        
+        /* Skip whatever the writer has lapped */
+        if (head - r->tail > TRACE_RING_SIZE) {
+            r->lost += head - r->tail - TRACE_RING_SIZE;
+            r->tail = head - TRACE_RING_SIZE;
+        }
+        
+        while (r->tail != head && (uint32_t)n < max) {
+            slot = r->tail++;
+            t = &r->rec[slot & TRACE_RING_MASK];
+            
+            if (__atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) != slot + 1) {
+                r->lost++;              /* Unpublished or already reused */
+                continue;
+            }
+            copy = *t;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != slot + 1) {
+                r->lost++;
+                continue;
+            }
+            out[n++] = copy;
+        }
+    }
+    
+    return n;
+}
+
+/* Number of records lost to overwrite across all CPUs */
+uint32_t trace_lost(void) {
+    uint32_t lost = 0;
+    int32_t cpu;
+    
+    for (cpu = 0; cpu < NCPU; cpu++) {
+        lost += trace_rings[cpu].lost;
+    }
+    return lost;
+}
+
+/* Size of one trace record, for sizing trace_dump() buffers */
+uint32_t trace_recsize(void) {
+    return sizeof(trace_rec_t);
+}
@@ -0,0 +1,44 @@
+/* trace.h - Kernel event tracepoints */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* Event IDs, also the bit numbers of trace_mask */
+enum {
+    TRACE_RESCHED = 0,      /* a0 = old pid, a1 = 1 if involuntary */
+    TRACE_CTXSW,            /* a0 = old pid, a1 = new pid */
+    TRACE_WAIT,             /* a0 = sem, a1 = 1 if it blocked */
+    TRACE_SIGNAL,           /* a0 = sem, a1 = pid woken or -1 */
+    TRACE_SEND,             /* a0 = dest pid, a1 = message */
+    TRACE_RECEIVE,          /* a0 = message, a1 = 1 if it blocked */
+    TRACE_IRQ_ENTRY,        /* a0 = irq */
+    TRACE_IRQ_EXIT,         /* a0 = irq, a1 = handler cycles */
+    TRACE_GETMEM,           /* a0 = nbytes, a1 = address */
+    TRACE_FREEMEM,          /* a0 = address, a1 = nbytes */
+    TRACE_SYSCALL,          /* a0 = number, a1 = first argument */
+    TRACE_NEVENTS
+};
+
+#define TRACE_ALL           ((1u << TRACE_NEVENTS) - 1)
+
+extern volatile uint32_t trace_mask;
+extern void trace_record(uint16_t event, uint32_t a0, uint32_t a1);
+
+/*
+ * Tracepoints test trace_mask once and call trace_record() only if the
+ * event is enabled. Building with TRACE_DISABLE compiles them out.
+ */
+#ifndef TRACE_DISABLE
+#define TRACE(ev, a0, a1) \
+    do { \
+        if (__builtin_expect((trace_mask >> (ev)) & 1, 0)) { \
+            trace_record((ev), (uint32_t)(a0), (uint32_t)(a1)); \
+        } \
+    } while (0)
+#else
+#define TRACE(ev, a0, a1)   do { (void)(a0); (void)(a1); } while (0)
+#endif
+
+#endif /* _TRACE_H_ */